@@ -7,10 +7,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <sys/syslimits.h>
 
 #include <psp2/kernel/threadmgr.h>
+#include <psp2/kernel/processmgr.h>
 
 #include <psp2/io/fcntl.h>
 #include <psp2/io/dirent.h>
@@ -20,18 +22,33 @@
 
 #include <psp2/rtc.h>
 
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define UNUSED(x) (void)(x)
 
 #define NET_CTL_ERROR_NOT_TERMINATED 0x80412102
 
 #define FTP_PORT 1337
-#define NET_INIT_SIZE (64 * 1024)
-#define DEFAULT_FILE_BUF_SIZE (4 * 1024 * 1024)
+#define NET_INIT_SIZE FTPVITA_NET_POOL_SIZE
+#define NET_WAIT_POLL_INTERVAL (500 * 1000)
+#define DEFAULT_FILE_BUF_SIZE FTPVITA_DEFAULT_FILE_BUF_SIZE
 
 #define FTP_DEFAULT_PATH   "/"
 
-#define MAX_DEVICES 16
-#define MAX_CUSTOM_COMMANDS 16
+#define MAX_DEVICES FTPVITA_MAX_DEVICES
+#define MAX_CUSTOM_COMMANDS FTPVITA_MAX_CUSTOM_COMMANDS
+#define ASYNC_WORKERS FTPVITA_ASYNC_WORKERS
+#define ASYNC_QUEUE_SIZE FTPVITA_ASYNC_QUEUE_SIZE
+
+#define METRICS_PATH "/stats:/metrics"
+/* Initial size of the metrics text, it grows as needed */
+#define METRICS_BUF_SIZE (32 * 1024)
+/* Receive and send timeout of a metrics connection, in microseconds */
+#define METRICS_HTTP_TIMEOUT (5 * 1000 * 1000)
 
 /* PSVita paths are in the form:
  *     <device name>:<filename in device>
@@ -45,20 +62,39 @@ typedef struct {
 	cmd_dispatch_func func;
 } cmd_dispatch_entry;
 
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+typedef struct {
+	const char *cmd;
+	async_cmd_func func;
+} async_dispatch_entry;
+#endif
+
 static struct {
-	char name[PATH_MAX];
+	char name[FTPVITA_DEVNAME_MAX];
+	ftpvita_cache_policy_t cache_policy;
 	int valid;
 } device_list[MAX_DEVICES];
 
 static struct {
 	const char *cmd;
 	cmd_dispatch_func func;
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+	async_cmd_func async_func;
+	async_cmd_done_func async_done;
+#endif
 	int valid;
 } custom_command_dispatchers[MAX_CUSTOM_COMMANDS];
 
 static void *net_memory = NULL;
+static unsigned int net_pool_size = NET_INIT_SIZE;
 static int ftp_initialized = 0;
+static int server_running = 0;
+static SceUID net_wait_thid = -1;
+static volatile int net_wait_quit = 0;
+static ftpvita_state_cb_t state_cb = NULL;
+static void *state_cb_arg = NULL;
 static unsigned int file_buf_size = DEFAULT_FILE_BUF_SIZE;
+static ftpvita_io_mode_t io_mode = FTPVITA_IO_ASYNC;
 static SceNetInAddr vita_addr;
 static SceUID server_thid;
 static int server_sockfd;
@@ -66,6 +102,21 @@ static int number_clients = 0;
 static ftpvita_client_info_t *client_list = NULL;
 static SceUID client_list_mtx;
 
+/* Admission control, see ftpvita_set_session_limits() */
+static unsigned int max_sessions = FTPVITA_MAX_SESSIONS;
+static unsigned int max_sessions_per_ip = FTPVITA_MAX_SESSIONS_PER_IP;
+static unsigned int accept_rate = FTPVITA_ACCEPT_RATE;
+static unsigned int accept_burst = FTPVITA_ACCEPT_BURST;
+/* Token bucket, in millionths of a connection */
+static unsigned long long accept_tokens;
+static SceUInt64 accept_last = 0;
+
+#if FTPVITA_FEATURE_METRICS
+static unsigned short metrics_http_port = 0;
+static SceUID metrics_http_thid = -1;
+static int metrics_http_sockfd = -1;
+#endif
+
 static int netctl_init = -1;
 static int net_init = -1;
 
@@ -87,692 +138,7754 @@ static void log_func(ftpvita_log_cb_t log_cb, const char *s, ...)
 #define INFO(...) log_func(info_log_cb, __VA_ARGS__)
 #define DEBUG(...) log_func(debug_log_cb, __VA_ARGS__)
 
-#define client_send_ctrl_msg(cl, str) \
-	sceNetSend(cl->ctrl_sockfd, str, strlen(str), 0)
+/* Statistics counters, updated with atomic operations only
+ * so no lock is ever taken on the transfer path */
 
-static inline void client_send_data_msg(ftpvita_client_info_t *client, const char *str)
+#define IO_LATENCY_BUCKETS 8
+
+typedef struct {
+	unsigned int bucket[IO_LATENCY_BUCKETS];
+	unsigned long long sum_us;
+	unsigned int count;
+} io_latency_hist_t;
+
+enum {
+	IO_OP_READ,
+	IO_OP_WRITE,
+	IO_OP_MAX
+};
+
+static struct {
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	unsigned int files_sent;
+	unsigned int files_received;
+	unsigned int commands;
+	unsigned int sessions_accepted;
+	unsigned int sessions_rejected;
+	unsigned int commands_unknown;
+	unsigned int buffers_in_use;
+	unsigned int buffers_idle;
+	unsigned int events_dropped;
+	unsigned int dir_cache_hits;
+	unsigned int dir_cache_misses;
+	unsigned int dir_cache_stale;
+	unsigned int io_async_fallbacks;
+	unsigned int xferlog_dropped;
+	unsigned int prefetch_hits;
+	unsigned int prefetch_misses;
+	unsigned int prefetch_wasted;
+	unsigned long long prefetch_bytes;
+	unsigned int thumb_hits;
+	unsigned int thumb_misses;
+	/* Per device bytes and time spent in I/O calls */
+	unsigned long long dev_bytes_read[MAX_DEVICES];
+	unsigned long long dev_bytes_written[MAX_DEVICES];
+	unsigned long long dev_io_us[MAX_DEVICES];
+#if FTPVITA_FEATURE_METRICS
+	/* Replies with 4xx and 5xx codes, indexed by code - 400 */
+	unsigned int error_replies[200];
+	io_latency_hist_t io_latency[MAX_DEVICES][IO_OP_MAX];
+#endif
+} stats;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n) __atomic_fetch_sub(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STAT_DEC(field) STAT_SUB(field, 1)
+#define STAT_LOAD(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+#if FTPVITA_FEATURE_METRICS
+static const unsigned int io_latency_bounds_us[IO_LATENCY_BUCKETS - 1] = {
+	100, 500, 1000, 5000, 10000, 50000, 100000
+};
+
+static void stat_io_latency(int dev, int op, unsigned int us)
 {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		sceNetSend(client->data_sockfd, str, strlen(str), 0);
-	} else {
-		sceNetSend(client->pasv_sockfd, str, strlen(str), 0);
+	io_latency_hist_t *hist;
+	int i;
+
+	if (dev < 0)
+		return;
+
+	hist = &stats.io_latency[dev][op];
+	for (i = 0; i < IO_LATENCY_BUCKETS - 1; i++) {
+		if (us <= io_latency_bounds_us[i])
+			break;
 	}
+
+	__atomic_fetch_add(&hist->bucket[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->sum_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
 }
 
-static inline int client_recv_data_raw(ftpvita_client_info_t *client, void *buf, unsigned int len)
+static void stat_reply(const char *str)
 {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		return sceNetRecv(client->data_sockfd, buf, len, 0);
-	} else {
-		return sceNetRecv(client->pasv_sockfd, buf, len, 0);
+	int code;
+
+	/* Only count the final line of a reply ("NNN text") */
+	if (str[0] < '4' || str[0] > '5' ||
+	    str[1] < '0' || str[1] > '9' ||
+	    str[2] < '0' || str[2] > '9' || str[3] != ' ')
+		return;
+
+	code = (str[0] - '0') * 100 + (str[1] - '0') * 10 + (str[2] - '0');
+	STAT_INC(error_replies[code - 400]);
+}
+#else
+static inline void stat_io_latency(int dev, int op, unsigned int us) {}
+static inline void stat_reply(const char *str) {}
+#endif
+
+static void stat_io(int dev, int op, unsigned int bytes, unsigned int us)
+{
+	if (dev < 0)
+		return;
+
+	if (op == IO_OP_READ)
+		STAT_ADD(dev_bytes_read[dev], bytes);
+	else
+		STAT_ADD(dev_bytes_written[dev], bytes);
+	STAT_ADD(dev_io_us[dev], us);
+
+	stat_io_latency(dev, op, us);
+}
+
+/* Allocations: everything the library allocates is tagged with the
+ * subsystem it's for and goes through the host's allocator, if set, or
+ * malloc(). Each block starts with a header holding its size and tag,
+ * so freeing needs neither and the memory held by each subsystem is
+ * known at all times. The helpers some builds don't use are inline, so
+ * they don't warn. */
+
+/* Keeps the blocks as aligned as malloc() makes them */
+#define MEM_HEADER_SIZE 16
+
+typedef struct {
+	unsigned int size;
+	unsigned int tag;
+} mem_header_t;
+
+static ftpvita_alloc_cb_t alloc_cb = NULL;
+static void *alloc_cb_arg = NULL;
+
+static struct {
+	unsigned int current;
+	unsigned int peak;
+	unsigned int blocks;
+	unsigned int allocs;
+	unsigned int failures;
+} mem_stats[FTPVITA_MEM_TAG_MAX];
+
+static const char *mem_tag_names[FTPVITA_MEM_TAG_MAX] = {
+	"net", "session", "xfer", "xferlog", "hash", "hash_cache", "dir_cache",
+	"walk", "prefetch", "metrics", "thumb", "extract", "verify"
+};
+
+static void *mem_raw(void *ptr, size_t size, ftpvita_mem_tag_t tag)
+{
+	if (alloc_cb)
+		return alloc_cb(ptr, size, tag, alloc_cb_arg);
+
+	if (size == 0) {
+		free(ptr);
+		return NULL;
 	}
+	return realloc(ptr, size);
 }
 
-static inline void client_send_data_raw(ftpvita_client_info_t *client, const void *buf, unsigned int len)
+static void mem_track(ftpvita_mem_tag_t tag, int bytes, int blocks)
 {
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		sceNetSend(client->data_sockfd, buf, len, 0);
-	} else {
-		sceNetSend(client->pasv_sockfd, buf, len, 0);
+	unsigned int current, peak;
+
+	current = __atomic_add_fetch(&mem_stats[tag].current, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&mem_stats[tag].blocks, blocks, __ATOMIC_RELAXED);
+	if (blocks > 0)
+		__atomic_fetch_add(&mem_stats[tag].allocs, 1, __ATOMIC_RELAXED);
+
+	peak = __atomic_load_n(&mem_stats[tag].peak, __ATOMIC_RELAXED);
+	while (current > peak &&
+	       !__atomic_compare_exchange_n(&mem_stats[tag].peak, &peak, current,
+	       0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+static void *mem_alloc(ftpvita_mem_tag_t tag, size_t size)
+{
+	mem_header_t *header;
+
+	header = mem_raw(NULL, MEM_HEADER_SIZE + size, tag);
+	if (header == NULL) {
+		__atomic_fetch_add(&mem_stats[tag].failures, 1, __ATOMIC_RELAXED);
+		return NULL;
 	}
+
+	header->size = size;
+	header->tag = tag;
+	mem_track(tag, size, 1);
+
+	return (unsigned char *)header + MEM_HEADER_SIZE;
 }
 
-static inline const char *get_vita_path(const char *path)
+static inline void *mem_calloc(ftpvita_mem_tag_t tag, size_t n, size_t size)
 {
-	if (strlen(path) > 1)
-		/* /cache0:/foo/bar -> cache0:/foo/bar */
-		return &path[1];
-	else
+	void *ptr;
+
+	if (size && n > (size_t)-1 / size)
 		return NULL;
+
+	ptr = mem_alloc(tag, n * size);
+	if (ptr)
+		memset(ptr, 0, n * size);
+	return ptr;
 }
 
-static int file_exists(const char *path)
+/* Keeps the tag of the block, tag is only for ptr == NULL */
+static inline void *mem_realloc(ftpvita_mem_tag_t tag, void *ptr, size_t size)
 {
-	SceIoStat stat;
-	return (sceIoGetstat(path, &stat) >= 0);
+	mem_header_t *header;
+	unsigned int old_size;
+
+	if (ptr == NULL)
+		return mem_alloc(tag, size);
+
+	header = (mem_header_t *)((unsigned char *)ptr - MEM_HEADER_SIZE);
+	old_size = header->size;
+	tag = header->tag;
+
+	header = mem_raw(header, MEM_HEADER_SIZE + size, tag);
+	if (header == NULL) {
+		__atomic_fetch_add(&mem_stats[tag].failures, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	header->size = size;
+	mem_track(tag, (int)size - (int)old_size, 0);
+
+	return (unsigned char *)header + MEM_HEADER_SIZE;
 }
 
-static void cmd_NOOP_func(ftpvita_client_info_t *client)
+static void mem_free(void *ptr)
 {
-	client_send_ctrl_msg(client, "200 No operation ;)" FTPVITA_EOL);
+	mem_header_t *header;
+
+	if (ptr == NULL)
+		return;
+
+	header = (mem_header_t *)((unsigned char *)ptr - MEM_HEADER_SIZE);
+	mem_track(header->tag, -(int)header->size, -1);
+	mem_raw(header, 0, header->tag);
 }
 
-static void cmd_USER_func(ftpvita_client_info_t *client)
+/* Everything is freed once the library is stopped, report what isn't */
+static void mem_leak_check()
 {
-	client_send_ctrl_msg(client, "331 Username OK, need password b0ss." FTPVITA_EOL);
+	int i;
+
+	for (i = 0; i < FTPVITA_MEM_TAG_MAX; i++) {
+		if (__atomic_load_n(&mem_stats[i].blocks, __ATOMIC_RELAXED) != 0)
+			INFO("Memory leak: %u bytes in %u blocks (%s)\n",
+				mem_stats[i].current, mem_stats[i].blocks, mem_tag_names[i]);
+	}
 }
 
-static void cmd_PASS_func(ftpvita_client_info_t *client)
+static inline char *mem_strdup(ftpvita_mem_tag_t tag, const char *s)
 {
-	client_send_ctrl_msg(client, "230 User logged in!" FTPVITA_EOL);
+	size_t len = strlen(s) + 1;
+	char *copy = mem_alloc(tag, len);
+
+	if (copy)
+		memcpy(copy, s, len);
+	return copy;
 }
 
-static void cmd_QUIT_func(ftpvita_client_info_t *client)
+static inline void client_send_ctrl_msg(ftpvita_client_info_t *client, const char *str)
 {
-	client_send_ctrl_msg(client, "221 Goodbye senpai :'(" FTPVITA_EOL);
+	stat_reply(str);
+	sceNetSend(client->ctrl_sockfd, str, strlen(str), 0);
 }
 
-static void cmd_SYST_func(ftpvita_client_info_t *client)
+/* Replies of commands that may run on the async pool,
+ * nothing is sent once the command is cancelled by ABOR */
+static inline void job_reply(ftpvita_client_info_t *client, volatile int *cancelled, const char *str)
 {
-	client_send_ctrl_msg(client, "215 UNIX Type: L8" FTPVITA_EOL);
+	if (cancelled == NULL || !*cancelled)
+		client_send_ctrl_msg(client, str);
 }
 
-static void cmd_PASV_func(ftpvita_client_info_t *client)
+#if FTPVITA_FEATURE_HASH
+static unsigned int crc32_table[256];
+
+static void crc32_init_table()
 {
-	int ret;
-	UNUSED(ret);
+	unsigned int c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		crc32_table[i] = c;
+	}
+}
 
-	char cmd[512];
-	unsigned int namelen;
-	SceNetSockaddrIn picked;
+static unsigned int crc32_update(unsigned int crc, const void *data, unsigned int len)
+{
+	const unsigned char *p = data;
 
-	/* Create data mode socket name */
-	char data_socket_name[64];
-	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
-		client->num);
+	crc = ~crc;
+	while (len--)
+		crc = crc32_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+#endif
 
-	/* Create the data socket */
-	client->data_sockfd = sceNetSocket(data_socket_name,
-		SCE_NET_AF_INET,
-		SCE_NET_SOCK_STREAM,
-		0);
+#if FTPVITA_FEATURE_EVENTS
+/* Event hooks: session and transfer threads only copy the event into
+ * a bounded queue (dropping it if the queue is full), the host
+ * callback is run from a separate dispatcher thread */
 
-	DEBUG("PASV data socket fd: %d\n", client->data_sockfd);
+#define EVENT_QUEUE_SIZE FTPVITA_EVENT_QUEUE_SIZE
 
-	/* Fill the data socket address */
-	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
-	client->data_sockaddr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
-	/* Let the PSVita choose a port */
-	client->data_sockaddr.sin_port = sceNetHtons(0);
+static ftpvita_event_cb_t event_cb = NULL;
+static void *event_cb_arg = NULL;
 
-	/* Bind the data socket address to the data socket */
-	ret = sceNetBind(client->data_sockfd,
-		(SceNetSockaddr *)&client->data_sockaddr,
-		sizeof(client->data_sockaddr));
-	DEBUG("sceNetBind(): 0x%08X\n", ret);
+static struct {
+	ftpvita_event_t events[EVENT_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	SceUID mtx;
+	SceUID sema;
+	SceUID thid;
+	int quit;
+} event_queue;
+
+/* Returns a cleared queue slot with the event queue locked, or NULL */
+static ftpvita_event_t *event_reserve(ftpvita_event_type_t type, const ftpvita_client_info_t *client)
+{
+	ftpvita_event_t *ev;
 
-	/* Start listening */
-	ret = sceNetListen(client->data_sockfd, 128);
-	DEBUG("sceNetListen(): 0x%08X\n", ret);
+	if (event_cb == NULL)
+		return NULL;
 
-	/* Get the port that the PSVita has chosen */
-	namelen = sizeof(picked);
-	sceNetGetsockname(client->data_sockfd, (SceNetSockaddr *)&picked,
-		&namelen);
+	sceKernelLockMutex(event_queue.mtx, 1, NULL);
 
-	DEBUG("PASV mode port: 0x%04X\n", picked.sin_port);
+	if (event_queue.head - event_queue.tail == EVENT_QUEUE_SIZE) {
+		sceKernelUnlockMutex(event_queue.mtx, 1);
+		STAT_INC(events_dropped);
+		return NULL;
+	}
 
-	/* Build the command */
-	sprintf(cmd, "227 Entering Passive Mode (%hhu,%hhu,%hhu,%hhu,%hhu,%hhu)" FTPVITA_EOL,
-		(vita_addr.s_addr >> 0) & 0xFF,
-		(vita_addr.s_addr >> 8) & 0xFF,
-		(vita_addr.s_addr >> 16) & 0xFF,
-		(vita_addr.s_addr >> 24) & 0xFF,
-		(picked.sin_port >> 0) & 0xFF,
-		(picked.sin_port >> 8) & 0xFF);
+	ev = &event_queue.events[event_queue.head % EVENT_QUEUE_SIZE];
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->client_num = client->num;
+	ev->client_addr = client->addr.sin_addr;
 
-	client_send_ctrl_msg(client, cmd);
+	return ev;
+}
 
-	/* Set the data connection type to passive! */
-	client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+static void event_commit()
+{
+	event_queue.head++;
+	sceKernelUnlockMutex(event_queue.mtx, 1);
+	sceKernelSignalSema(event_queue.sema, 1);
 }
 
-static void cmd_PORT_func(ftpvita_client_info_t *client)
+static void event_post(ftpvita_event_type_t type, const ftpvita_client_info_t *client,
+		       const char *path, const char *old_path)
 {
-	unsigned int data_ip[4];
-	unsigned int porthi, portlo;
-	unsigned short data_port;
-	char ip_str[16];
-	SceNetInAddr data_addr;
+	ftpvita_event_t *ev = event_reserve(type, client);
+	if (ev == NULL)
+		return;
 
-	/* Using ints because of newlibc's u8 sscanf bug */
-	sscanf(client->recv_cmd_args, "%d,%d,%d,%d,%d,%d",
-		&data_ip[0], &data_ip[1], &data_ip[2], &data_ip[3],
-		&porthi, &portlo);
+	if (path)
+		strncpy(ev->path, path, sizeof(ev->path) - 1);
+	if (old_path)
+		strncpy(ev->old_path, old_path, sizeof(ev->old_path) - 1);
 
-	data_port = portlo + porthi*256;
+	event_commit();
+}
 
-	/* Convert to an X.X.X.X IP string */
-	sprintf(ip_str, "%d.%d.%d.%d",
-		data_ip[0], data_ip[1], data_ip[2], data_ip[3]);
+#if FTPVITA_FEATURE_WRITE
+static void event_post_upload(const ftpvita_client_info_t *client, const char *path,
+			      unsigned long long size, int has_crc32, unsigned int crc32)
+{
+	ftpvita_event_t *ev = event_reserve(FTPVITA_EVENT_UPLOAD_COMPLETE, client);
+	if (ev == NULL)
+		return;
 
-	/* Convert the IP to a SceNetInAddr */
-	sceNetInetPton(SCE_NET_AF_INET, ip_str, &data_addr);
+	strncpy(ev->path, path, sizeof(ev->path) - 1);
+	ev->size = size;
+	ev->has_crc32 = has_crc32;
+	ev->crc32 = crc32;
 
-	DEBUG("PORT connection to client's IP: %s Port: %d\n", ip_str, data_port);
+	event_commit();
+}
+#endif
 
-	/* Create data mode socket name */
-	char data_socket_name[64];
-	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
-		client->num);
+static int event_dispatch_thread(SceSize args, void *argp)
+{
+	ftpvita_event_t ev;
+	ftpvita_event_cb_t cb;
 
-	/* Create data mode socket */
-	client->data_sockfd = sceNetSocket(data_socket_name,
-		SCE_NET_AF_INET,
-		SCE_NET_SOCK_STREAM,
-		0);
+	DEBUG("Event dispatcher thread started!\n");
 
-	DEBUG("Client %i data socket fd: %d\n", client->num,
-		client->data_sockfd);
+	while (1) {
+		sceKernelWaitSema(event_queue.sema, 1, NULL);
+
+		sceKernelLockMutex(event_queue.mtx, 1, NULL);
+		if (event_queue.head == event_queue.tail) {
+			/* Woken up with nothing queued: we have to quit */
+			sceKernelUnlockMutex(event_queue.mtx, 1);
+			if (event_queue.quit)
+				break;
+			continue;
+		}
+		memcpy(&ev, &event_queue.events[event_queue.tail % EVENT_QUEUE_SIZE], sizeof(ev));
+		event_queue.tail++;
+		sceKernelUnlockMutex(event_queue.mtx, 1);
 
-	/* Prepare socket address for the data connection */
-	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
-	client->data_sockaddr.sin_addr = data_addr;
-	client->data_sockaddr.sin_port = sceNetHtons(data_port);
+		cb = event_cb;
+		if (cb)
+			cb(&ev, event_cb_arg);
+	}
 
-	/* Set the data connection type to active! */
-	client->data_con_type = FTP_DATA_CONNECTION_ACTIVE;
+	DEBUG("Event dispatcher thread exiting!\n");
 
-	client_send_ctrl_msg(client, "200 PORT command successful!" FTPVITA_EOL);
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-static void client_open_data_connection(ftpvita_client_info_t *client)
+static void event_queue_init()
 {
-	int ret;
-	UNUSED(ret);
+	event_queue.head = 0;
+	event_queue.tail = 0;
+	event_queue.quit = 0;
 
-	unsigned int addrlen;
+	event_queue.mtx = sceKernelCreateMutex("FTPVita_event_mutex", 0, 0, NULL);
+	event_queue.sema = sceKernelCreateSema("FTPVita_event_sema", 0, 0,
+		EVENT_QUEUE_SIZE + 1, NULL);
 
-	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
-		/* Connect to the client using the data socket */
-		ret = sceNetConnect(client->data_sockfd,
-			(SceNetSockaddr *)&client->data_sockaddr,
-			sizeof(client->data_sockaddr));
+	event_queue.thid = sceKernelCreateThread("FTPVita_event_thread",
+		event_dispatch_thread, 0x10000100, 0x4000, 0, 0, NULL);
+	DEBUG("Event dispatcher thread UID: 0x%08X\n", event_queue.thid);
 
-		DEBUG("sceNetConnect(): 0x%08X\n", ret);
-	} else {
-		/* Listen to the client using the data socket */
-		addrlen = sizeof(client->pasv_sockaddr);
-		client->pasv_sockfd = sceNetAccept(client->data_sockfd,
-			(SceNetSockaddr *)&client->pasv_sockaddr,
-			&addrlen);
-		DEBUG("PASV client fd: 0x%08X\n", client->pasv_sockfd);
+	sceKernelStartThread(event_queue.thid, 0, NULL);
+}
+
+static void event_queue_fini()
+{
+	/* The pending events are delivered before the thread exits */
+	event_queue.quit = 1;
+	sceKernelSignalSema(event_queue.sema, 1);
+	sceKernelWaitThreadEnd(event_queue.thid, NULL, NULL);
+
+	sceKernelDeleteSema(event_queue.sema);
+	sceKernelDeleteMutex(event_queue.mtx);
+}
+#else
+static inline void event_post(ftpvita_event_type_t type, const ftpvita_client_info_t *client,
+			      const char *path, const char *old_path) {}
+#endif
+
+#if FTPVITA_FEATURE_XFERLOG
+/* Transfer log in the wu-ftpd xferlog format. Transfers only append a
+ * line to a memory buffer; a low priority thread writes it out in one
+ * append every XFERLOG_FLUSH_INTERVAL seconds, or as soon as the buffer
+ * is half full. Lines that don't fit are dropped and counted. When the
+ * file would grow past max_size it's renamed to <path>.1, replacing the
+ * previous one. */
+
+#define XFERLOG_BUFFER_SIZE    FTPVITA_XFERLOG_BUFFER_SIZE
+#define XFERLOG_FLUSH_INTERVAL FTPVITA_XFERLOG_FLUSH_INTERVAL
+
+static char xferlog_path[PATH_MAX];
+static unsigned int xferlog_max_size;
+
+static struct {
+	/* Lines are added to buf while the thread writes out the other one */
+	char *bufs[2];
+	char *buf;
+	unsigned int len;
+	SceUID mtx;
+	SceUID sema;
+	SceUID thid;
+	volatile int quit;
+} xferlog;
+
+static unsigned int count_lines(const char *data, unsigned int len)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] == '\n')
+			n++;
 	}
+	return n;
 }
 
-static void client_close_data_connection(ftpvita_client_info_t *client)
+static void xferlog_write(const char *data, unsigned int len)
 {
-	sceNetSocketClose(client->data_sockfd);
-	/* In passive mode we have to close the client pasv socket too */
-	if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
-		sceNetSocketClose(client->pasv_sockfd);
+	char old_path[PATH_MAX + 2];
+	SceIoStat stat;
+	SceUID fd;
+
+	if (xferlog_max_size && sceIoGetstat(xferlog_path, &stat) >= 0 &&
+	    stat.st_size + len > xferlog_max_size) {
+		snprintf(old_path, sizeof(old_path), "%s.1", xferlog_path);
+		sceIoRemove(old_path);
+		sceIoRename(xferlog_path, old_path);
 	}
-	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+
+	fd = sceIoOpen(xferlog_path, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_APPEND, 0777);
+	if (fd < 0 || sceIoWrite(fd, data, len) != len)
+		STAT_ADD(xferlog_dropped, count_lines(data, len));
+	if (fd >= 0)
+		sceIoClose(fd);
 }
 
-static int gen_list_format(char *out, int n, int dir, const SceIoStat *stat, const char *filename)
+static int xferlog_thread(SceSize args, void *argp)
 {
-	static const char num_to_month[][4] = {
+	SceUInt32 timeout;
+	unsigned int len;
+	char *out;
+	int quit;
+
+	do {
+		timeout = XFERLOG_FLUSH_INTERVAL * 1000 * 1000;
+		sceKernelWaitSema(xferlog.sema, 1, &timeout);
+		quit = xferlog.quit;
+
+		sceKernelLockMutex(xferlog.mtx, 1, NULL);
+		out = xferlog.buf;
+		len = xferlog.len;
+		xferlog.buf = out == xferlog.bufs[0] ? xferlog.bufs[1] : xferlog.bufs[0];
+		xferlog.len = 0;
+		sceKernelUnlockMutex(xferlog.mtx, 1);
+
+		if (len > 0)
+			xferlog_write(out, len);
+	} while (!quit);
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+/* direction is 'o' for downloads and 'i' for uploads */
+static void xferlog_post(const ftpvita_client_info_t *client, const char *path, char direction,
+			 unsigned long long bytes, SceUInt64 start, int complete)
+{
+	static const char days[][4] = {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+	};
+	static const char months[][4] = {
 		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
 		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
 	};
+	char line[PATH_MAX + 128];
+	char ip[16];
+	SceDateTime now;
+	int len;
 
-	char yt[6];
-	SceDateTime cdt;
-	sceRtcGetCurrentClockLocalTime(&cdt);
+	if (xferlog.buf == NULL)
+		return;
 
-	if  (cdt.year == stat->st_mtime.year) {
-		snprintf(yt, sizeof(yt), "%02d:%02d", stat->st_mtime.hour, stat->st_mtime.minute);
-	}
-	else {
-		snprintf(yt, sizeof(yt), "%04d", stat->st_mtime.year);
+	sceRtcGetCurrentClockLocalTime(&now);
+	sceNetInetNtop(SCE_NET_AF_INET, &client->addr.sin_addr, ip, sizeof(ip));
+
+	/* time, seconds, host, bytes, file, type, no special action,
+	 * direction, real user, user, service, no auth, status */
+	len = snprintf(line, sizeof(line),
+		"%s %s %2d %02d:%02d:%02d %04d %u %s %llu %s %c _ %c r anonymous ftp 0 * %c\n",
+		days[sceRtcGetDayOfWeek(now.year, now.month, now.day) % 7],
+		months[now.month <= 0 ? 0 : (now.month - 1) % 12],
+		now.day, now.hour, now.minute, now.second, now.year,
+		(unsigned int)((sceKernelGetProcessTimeWide() - start) / (1000 * 1000)),
+		ip, bytes, path, client->type_ascii ? 'a' : 'b', direction, complete ? 'c' : 'i');
+	if (len >= sizeof(line))
+		len = sizeof(line) - 1;
+
+	sceKernelLockMutex(xferlog.mtx, 1, NULL);
+	if (xferlog.len + len <= XFERLOG_BUFFER_SIZE) {
+		memcpy(xferlog.buf + xferlog.len, line, len);
+		xferlog.len += len;
+		if (xferlog.len >= XFERLOG_BUFFER_SIZE / 2)
+			sceKernelSignalSema(xferlog.sema, 1);
+	} else {
+		STAT_INC(xferlog_dropped);
 	}
+	sceKernelUnlockMutex(xferlog.mtx, 1);
+}
+
+static void xferlog_init()
+{
+	memset(&xferlog, 0, sizeof(xferlog));
+
+	if (xferlog_path[0] == '\0')
+		return;
+
+	xferlog.bufs[0] = mem_alloc(FTPVITA_MEM_XFERLOG, XFERLOG_BUFFER_SIZE);
+	xferlog.bufs[1] = mem_alloc(FTPVITA_MEM_XFERLOG, XFERLOG_BUFFER_SIZE);
+	if (xferlog.bufs[0] == NULL || xferlog.bufs[1] == NULL) {
+		mem_free(xferlog.bufs[0]);
+		mem_free(xferlog.bufs[1]);
+		INFO("Not enough memory for the transfer log\n");
+		return;
+	}
+
+	xferlog.mtx = sceKernelCreateMutex("FTPVita_xferlog_mutex", 0, 0, NULL);
+	xferlog.sema = sceKernelCreateSema("FTPVita_xferlog_sema", 0, 0, 1, NULL);
+	xferlog.thid = sceKernelCreateThread("FTPVita_xferlog_thread",
+		xferlog_thread, 0x10000100 + 10, 0x4000, 0, 0, NULL);
+	DEBUG("Transfer log thread UID: 0x%08X\n", xferlog.thid);
+
+	xferlog.buf = xferlog.bufs[0];
+	sceKernelStartThread(xferlog.thid, 0, NULL);
+}
+
+static void xferlog_fini()
+{
+	if (xferlog.buf == NULL)
+		return;
+
+	/* The thread writes what's left before exiting */
+	xferlog.quit = 1;
+	sceKernelSignalSema(xferlog.sema, 1);
+	sceKernelWaitThreadEnd(xferlog.thid, NULL, NULL);
+
+	sceKernelDeleteSema(xferlog.sema);
+	sceKernelDeleteMutex(xferlog.mtx);
+	mem_free(xferlog.bufs[0]);
+	mem_free(xferlog.bufs[1]);
+	xferlog.buf = NULL;
+}
+#else
+static inline void xferlog_post(const ftpvita_client_info_t *client, const char *path, char direction,
+				unsigned long long bytes, SceUInt64 start, int complete) {}
+#endif
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+/* Asynchronous command worker pool. The job lives in the client
+ * struct, client->async_busy tells whether it's queued or running. */
+
+static struct {
+	ftpvita_client_info_t *jobs[ASYNC_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	SceUID mtx;
+	SceUID sema;
+	SceUID thids[ASYNC_WORKERS];
+	int started;
+	int quit;
+} async_pool;
+
+static void async_cmd_run(ftpvita_client_info_t *client)
+{
+	ftpvita_async_cmd_t *cmd = &client->async_cmd;
+	int result;
+
+	DEBUG("Client %i async %s started\n", client->num, cmd->cmd);
+
+	result = cmd->func(cmd);
+	if (cmd->done)
+		cmd->done(cmd, result);
+
+	if (cmd->cancelled)
+		client_send_ctrl_msg(client, "426 Command aborted." FTPVITA_EOL);
+
+	DEBUG("Client %i async %s finished: %d\n", client->num, cmd->cmd, result);
+}
+
+static int async_worker_thread(SceSize args, void *argp)
+{
+	ftpvita_client_info_t *client;
+
+	while (1) {
+		sceKernelWaitSema(async_pool.sema, 1, NULL);
+
+		sceKernelLockMutex(async_pool.mtx, 1, NULL);
+		if (async_pool.head == async_pool.tail) {
+			sceKernelUnlockMutex(async_pool.mtx, 1);
+			if (async_pool.quit)
+				break;
+			continue;
+		}
+		client = async_pool.jobs[async_pool.tail % ASYNC_QUEUE_SIZE];
+		async_pool.tail++;
+		sceKernelUnlockMutex(async_pool.mtx, 1);
+
+		async_cmd_run(client);
+
+		__atomic_store_n(&client->async_busy, 0, __ATOMIC_RELEASE);
+	}
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static void async_pool_init()
+{
+	char name[32];
+	int i;
+
+	async_pool.head = 0;
+	async_pool.tail = 0;
+	async_pool.started = 0;
+	async_pool.quit = 0;
+
+	async_pool.mtx = sceKernelCreateMutex("FTPVita_async_mutex", 0, 0, NULL);
+	async_pool.sema = sceKernelCreateSema("FTPVita_async_sema", 0, 0,
+		ASYNC_QUEUE_SIZE + ASYNC_WORKERS, NULL);
+
+	for (i = 0; i < ASYNC_WORKERS; i++) {
+		/* Commands run on the session threads without the queue */
+		if (async_pool.mtx < 0 || async_pool.sema < 0) {
+			async_pool.thids[i] = -1;
+			continue;
+		}
+		sprintf(name, "FTPVita_async_worker_%i", i);
+		async_pool.thids[i] = sceKernelCreateThread(name,
+			async_worker_thread, 0x10000100, 0x10000, 0, 0, NULL);
+		DEBUG("Async worker %i UID: 0x%08X\n", i, async_pool.thids[i]);
+		if (async_pool.thids[i] >= 0 &&
+		    sceKernelStartThread(async_pool.thids[i], 0, NULL) < 0) {
+			sceKernelDeleteThread(async_pool.thids[i]);
+			async_pool.thids[i] = -1;
+		}
+		if (async_pool.thids[i] >= 0)
+			async_pool.started++;
+	}
+}
+
+static void async_pool_fini()
+{
+	int i;
+
+	async_pool.quit = 1;
+	sceKernelSignalSema(async_pool.sema, ASYNC_WORKERS);
+	for (i = 0; i < ASYNC_WORKERS; i++) {
+		if (async_pool.thids[i] >= 0)
+			sceKernelWaitThreadEnd(async_pool.thids[i], NULL, NULL);
+	}
+
+	sceKernelDeleteSema(async_pool.sema);
+	sceKernelDeleteMutex(async_pool.mtx);
+}
+
+/* Queues the client's command on the worker pool, replies
+ * to the client itself if that's not possible */
+static void async_cmd_submit(ftpvita_client_info_t *client, const char *name,
+			     async_cmd_func func, async_cmd_done_func done)
+{
+	ftpvita_async_cmd_t *cmd = &client->async_cmd;
+
+	if (__atomic_load_n(&client->async_busy, __ATOMIC_ACQUIRE)) {
+		client_send_ctrl_msg(client, "450 Another command is in progress." FTPVITA_EOL);
+		return;
+	}
+
+	cmd->client_num = client->num;
+	strncpy(cmd->cmd, name, sizeof(cmd->cmd) - 1);
+	cmd->cmd[sizeof(cmd->cmd) - 1] = '\0';
+	cmd->args[0] = '\0';
+	if (client->recv_cmd_args != client->recv_buffer)
+		snprintf(cmd->args, sizeof(cmd->args), "%.*s",
+			(int)strcspn(client->recv_cmd_args, "\r\n"), client->recv_cmd_args);
+	strcpy(cmd->cur_path, client->cur_path);
+	cmd->cancelled = 0;
+	cmd->client = client;
+	cmd->func = func;
+	cmd->done = done;
+
+	/* Without workers the command runs here, it can't be aborted */
+	if (async_pool.started == 0) {
+		async_cmd_run(client);
+		return;
+	}
+
+	sceKernelLockMutex(async_pool.mtx, 1, NULL);
+
+	if (async_pool.head - async_pool.tail == ASYNC_QUEUE_SIZE) {
+		sceKernelUnlockMutex(async_pool.mtx, 1);
+		client_send_ctrl_msg(client, "421 Too many commands in progress, try later." FTPVITA_EOL);
+		return;
+	}
+
+	client->async_busy = 1;
+	async_pool.jobs[async_pool.head % ASYNC_QUEUE_SIZE] = client;
+	async_pool.head++;
+
+	sceKernelUnlockMutex(async_pool.mtx, 1);
+	sceKernelSignalSema(async_pool.sema, 1);
+}
+
+/* Cancels the client's async command, if any, and waits for it to end */
+static int async_cmd_cancel(ftpvita_client_info_t *client)
+{
+	if (!__atomic_load_n(&client->async_busy, __ATOMIC_ACQUIRE))
+		return 0;
+
+	client->async_cmd.cancelled = 1;
+	while (__atomic_load_n(&client->async_busy, __ATOMIC_ACQUIRE))
+		sceKernelDelayThread(10 * 1000);
+
+	return 1;
+}
+#else
+static inline int async_cmd_cancel(ftpvita_client_info_t *client)
+{
+	return 0;
+}
+#endif
+
+static inline void client_send_data_msg(ftpvita_client_info_t *client, const char *str)
+{
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
+		sceNetSend(client->data_sockfd, str, strlen(str), 0);
+	} else {
+		sceNetSend(client->pasv_sockfd, str, strlen(str), 0);
+	}
+}
+
+static inline int client_recv_data_raw(ftpvita_client_info_t *client, void *buf, unsigned int len)
+{
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
+		return sceNetRecv(client->data_sockfd, buf, len, 0);
+	} else {
+		return sceNetRecv(client->pasv_sockfd, buf, len, 0);
+	}
+}
+
+/* Sends all of buf, returns 0 on success or < 0 if the connection failed */
+static int send_all(int sockfd, const void *buf, unsigned int len)
+{
+	const unsigned char *p = buf;
+	int n;
+
+	while (len > 0) {
+		n = sceNetSend(sockfd, p, len, 0);
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static inline int client_send_data_raw(ftpvita_client_info_t *client, const void *buf, unsigned int len)
+{
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE)
+		return send_all(client->data_sockfd, buf, len);
+	else
+		return send_all(client->pasv_sockfd, buf, len);
+}
+
+/* cur_cmd and xfer_path are read by ftpvita_get_sessions(). The session
+ * thread can't take client_list_mtx to write them, ftpvita_fini() holds
+ * it while waiting for the thread to end, so info_seq is made odd while
+ * they change and readers retry a copy that was torn */
+static void client_info_write_begin(ftpvita_client_info_t *client)
+{
+	__atomic_store_n(&client->info_seq, client->info_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void client_info_write_end(ftpvita_client_info_t *client)
+{
+	__atomic_store_n(&client->info_seq, client->info_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void client_set_xfer_path(ftpvita_client_info_t *client, const char *path)
+{
+	client_info_write_begin(client);
+	if (path)
+		strcpy(client->xfer_path, path);
+	else
+		client->xfer_path[0] = '\0';
+	client_info_write_end(client);
+}
+
+static inline const char *get_vita_path(const char *path)
+{
+	if (strlen(path) > 1)
+		/* /cache0:/foo/bar -> cache0:/foo/bar */
+		return &path[1];
+	else
+		return NULL;
+}
+
+static int file_exists(const char *path)
+{
+	SceIoStat stat;
+	return (sceIoGetstat(path, &stat) >= 0);
+}
+
+/* Returns the device_list index of the device the path lives in, or -1 */
+static int device_index(const char *path)
+{
+	int i;
+
+	if (path == NULL)
+		return -1;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (device_list[i].valid &&
+		    strncmp(path, device_list[i].name, strlen(device_list[i].name)) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/* Cache policy of the device of path, see ftpvita_set_cache_policy().
+ * Inline, so builds without any cache don't warn */
+static inline ftpvita_cache_policy_t cache_policy(const char *path)
+{
+	int dev = device_index(path);
+
+	return dev >= 0 ? device_list[dev].cache_policy : FTPVITA_CACHE_POLICY;
+}
+
+/* Transfer buffer pool: a few idle buffers are kept around so
+ * back-to-back transfers don't hit the allocator every time */
+
+#define BUF_POOL_SLOTS FTPVITA_BUF_POOL_SLOTS
+
+typedef struct {
+	unsigned int size;
+	unsigned int pad[15];
+	unsigned char data[];
+} xfer_buf_t;
+
+static xfer_buf_t *buf_pool[BUF_POOL_SLOTS];
+
+static xfer_buf_t *xfer_buf_get()
+{
+	xfer_buf_t *buf;
+	unsigned int size = file_buf_size;
+	int i;
+
+	for (i = 0; i < BUF_POOL_SLOTS; i++) {
+		buf = __atomic_exchange_n(&buf_pool[i], NULL, __ATOMIC_ACQUIRE);
+		if (buf) {
+			STAT_DEC(buffers_idle);
+			if (buf->size == size)
+				goto out;
+			/* The buffer size has changed since it was pooled */
+			mem_free(buf);
+		}
+	}
+
+	buf = mem_alloc(FTPVITA_MEM_XFER, sizeof(*buf) + size);
+	if (buf == NULL)
+		return NULL;
+	buf->size = size;
+out:
+	STAT_INC(buffers_in_use);
+	return buf;
+}
+
+static void xfer_buf_put(xfer_buf_t *buf)
+{
+	xfer_buf_t *expected;
+	int i;
+
+	STAT_DEC(buffers_in_use);
+
+	if (buf->size == file_buf_size) {
+		for (i = 0; i < BUF_POOL_SLOTS; i++) {
+			expected = NULL;
+			if (__atomic_compare_exchange_n(&buf_pool[i], &expected, buf,
+			    0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				STAT_INC(buffers_idle);
+				return;
+			}
+		}
+	}
+
+	mem_free(buf);
+}
+
+/* Frees the idle buffers, returns the bytes freed */
+static unsigned int buf_pool_release()
+{
+	xfer_buf_t *buf;
+	unsigned int freed = 0;
+	int i;
+
+	for (i = 0; i < BUF_POOL_SLOTS; i++) {
+		buf = __atomic_exchange_n(&buf_pool[i], NULL, __ATOMIC_ACQUIRE);
+		if (buf) {
+			STAT_DEC(buffers_idle);
+			freed += sizeof(*buf) + buf->size;
+			mem_free(buf);
+		}
+	}
+
+	return freed;
+}
+
+#if FTPVITA_FEATURE_HASH
+/* Parallel CRC32: the requesting thread reads the file in chunks while
+ * the hash workers compute the CRC32 of each chunk on their own; the
+ * chunk CRCs are then combined in file order. */
+
+#define HASH_WORKERS    FTPVITA_HASH_WORKERS
+#define HASH_CHUNK_SIZE FTPVITA_HASH_CHUNK_SIZE
+/* Chunks of a file in flight, so the reader stays ahead of the workers */
+#define HASH_CHUNKS     (HASH_WORKERS + 2)
+#define HASH_QUEUE_SIZE 16
+
+typedef struct {
+	unsigned char *data;
+	unsigned int len;
+	unsigned int crc;
+	int done;
+	/* Signaled once the chunk is hashed */
+	SceUID sema;
+} hash_chunk_t;
+
+static struct {
+	hash_chunk_t *jobs[HASH_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	SceUID mtx;
+	SceUID jobs_sema;
+	SceUID free_sema;
+	SceUID thids[HASH_WORKERS];
+	int started;
+	int quit;
+} hash_pool;
+
+static int hash_worker_thread(SceSize args, void *argp)
+{
+	hash_chunk_t *chunk;
+
+	while (1) {
+		sceKernelWaitSema(hash_pool.jobs_sema, 1, NULL);
+
+		sceKernelLockMutex(hash_pool.mtx, 1, NULL);
+		if (hash_pool.head == hash_pool.tail) {
+			sceKernelUnlockMutex(hash_pool.mtx, 1);
+			if (hash_pool.quit)
+				break;
+			continue;
+		}
+		chunk = hash_pool.jobs[hash_pool.tail % HASH_QUEUE_SIZE];
+		hash_pool.tail++;
+		sceKernelUnlockMutex(hash_pool.mtx, 1);
+		sceKernelSignalSema(hash_pool.free_sema, 1);
+
+		chunk->crc = crc32_update(0, chunk->data, chunk->len);
+		__atomic_store_n(&chunk->done, 1, __ATOMIC_RELEASE);
+		sceKernelSignalSema(chunk->sema, 1);
+	}
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static void hash_pool_init()
+{
+	char name[32];
+	int i;
+
+	hash_pool.head = 0;
+	hash_pool.tail = 0;
+	hash_pool.started = 0;
+	hash_pool.quit = 0;
+
+	hash_pool.mtx = sceKernelCreateMutex("FTPVita_hash_mutex", 0, 0, NULL);
+	hash_pool.jobs_sema = sceKernelCreateSema("FTPVita_hash_jobs_sema", 0, 0,
+		HASH_QUEUE_SIZE + HASH_WORKERS, NULL);
+	hash_pool.free_sema = sceKernelCreateSema("FTPVita_hash_free_sema", 0,
+		HASH_QUEUE_SIZE, HASH_QUEUE_SIZE, NULL);
+
+	for (i = 0; i < HASH_WORKERS; i++) {
+		/* Files are hashed inline without the queue */
+		if (hash_pool.mtx < 0 || hash_pool.jobs_sema < 0 || hash_pool.free_sema < 0) {
+			hash_pool.thids[i] = -1;
+			continue;
+		}
+		sprintf(name, "FTPVita_hash_worker_%i", i);
+		hash_pool.thids[i] = sceKernelCreateThread(name,
+			hash_worker_thread, 0x10000100, 0x4000, 0, 0, NULL);
+		DEBUG("Hash worker %i UID: 0x%08X\n", i, hash_pool.thids[i]);
+		if (hash_pool.thids[i] >= 0 &&
+		    sceKernelStartThread(hash_pool.thids[i], 0, NULL) < 0) {
+			sceKernelDeleteThread(hash_pool.thids[i]);
+			hash_pool.thids[i] = -1;
+		}
+		if (hash_pool.thids[i] >= 0)
+			hash_pool.started++;
+	}
+}
+
+static void hash_pool_fini()
+{
+	int i;
+
+	hash_pool.quit = 1;
+	sceKernelSignalSema(hash_pool.jobs_sema, HASH_WORKERS);
+	for (i = 0; i < HASH_WORKERS; i++) {
+		if (hash_pool.thids[i] >= 0)
+			sceKernelWaitThreadEnd(hash_pool.thids[i], NULL, NULL);
+	}
+
+	sceKernelDeleteSema(hash_pool.free_sema);
+	sceKernelDeleteSema(hash_pool.jobs_sema);
+	sceKernelDeleteMutex(hash_pool.mtx);
+}
+
+/* Queues the chunk, waits for a free slot if the queue is full */
+static void hash_chunk_submit(hash_chunk_t *chunk)
+{
+	chunk->done = 0;
+
+	sceKernelWaitSema(hash_pool.free_sema, 1, NULL);
+
+	sceKernelLockMutex(hash_pool.mtx, 1, NULL);
+	hash_pool.jobs[hash_pool.head % HASH_QUEUE_SIZE] = chunk;
+	hash_pool.head++;
+	sceKernelUnlockMutex(hash_pool.mtx, 1);
+
+	sceKernelSignalSema(hash_pool.jobs_sema, 1);
+}
+
+static unsigned int gf2_matrix_times(const unsigned int *mat, unsigned int vec)
+{
+	unsigned int sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(unsigned int *square, const unsigned int *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* CRC32 of A followed by B, given the CRC32s of A and B and
+ * the length of B (same method as zlib's crc32_combine()) */
+static unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, unsigned long long len2)
+{
+	unsigned int even[32];
+	unsigned int odd[32];
+	unsigned int row;
+	int n;
+
+	if (len2 == 0)
+		return crc1;
+
+	/* Operator for one zero bit in odd */
+	odd[0] = 0xEDB88320;
+	row = 1;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* Operators for two and four zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	/* Apply len2 zero bytes to crc1 */
+	do {
+		gf2_matrix_square(even, odd);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(even, crc1);
+		len2 >>= 1;
+		if (len2 == 0)
+			break;
+
+		gf2_matrix_square(odd, even);
+		if (len2 & 1)
+			crc1 = gf2_matrix_times(odd, crc1);
+		len2 >>= 1;
+	} while (len2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+/* Hashes the range on the calling thread, reading size bytes at a time:
+ * small files, which fit in one read, and any file when the pool can't
+ * be used */
+static int hash_crc32_inline(SceUID fd, int dev, unsigned long long start, long long end,
+			     volatile int *cancelled, unsigned int size,
+			     unsigned int *crc, unsigned long long *len)
+{
+	unsigned char *buf;
+	unsigned long long offset = start;
+	unsigned int want;
+	int ret = 0;
+	int n;
+	SceUInt64 t;
+
+	buf = mem_alloc(FTPVITA_MEM_HASH, size);
+	if (buf == NULL)
+		return -2;
+
+	*crc = 0;
+	*len = 0;
+
+	while (1) {
+		if (cancelled && *cancelled) {
+			ret = -3;
+			break;
+		}
+
+		want = size;
+		if (end >= 0) {
+			if (offset >= (unsigned long long)end)
+				break;
+			if (offset + want > (unsigned long long)end)
+				want = end - offset;
+		}
+
+		t = sceKernelGetProcessTimeWide();
+		n = sceIoPread(fd, buf, want, offset);
+		stat_io(dev, IO_OP_READ, n > 0 ? n : 0, sceKernelGetProcessTimeWide() - t);
+		if (n <= 0) {
+			if (n < 0)
+				ret = -1;
+			break;
+		}
+
+		*crc = crc32_update(*crc, buf, n);
+		*len += n;
+		offset += n;
+	}
+
+	mem_free(buf);
+	return ret;
+}
+
+/* CRC32 of the bytes [start, end) of the file, end < 0 meaning up to
+ * the end of the file. cancelled, if not NULL, is polled between chunks.
+ * Returns 0 on success, -1 if the file can't be read, -2 without
+ * memory and -3 if cancelled */
+static int hash_crc32_file(const char *path, unsigned long long start, long long end,
+			   volatile int *cancelled, unsigned int *crc, unsigned long long *len)
+{
+	hash_chunk_t chunks[HASH_CHUNKS];
+	hash_chunk_t *chunk;
+	unsigned char *bufs;
+	unsigned int next_read = 0;
+	unsigned int next_combine = 0;
+	unsigned long long offset = start;
+	unsigned long long size = ~0ULL;
+	unsigned int want;
+	int dev = device_index(path);
+	int n_chunks = HASH_CHUNKS;
+	int eof = 0;
+	int ret = 0;
+	int i, n;
+	SceIoStat stat;
+	SceUID fd, sema;
+	SceUInt64 t;
+
+	if ((fd = sceIoOpen(path, SCE_O_RDONLY, 0777)) < 0)
+		return -1;
+
+	/* Bytes to hash, as far as we know now */
+	if (end >= 0)
+		size = (unsigned long long)end > start ? end - start : 0;
+	else if (sceIoGetstatByFd(fd, &stat) >= 0)
+		size = (unsigned long long)stat.st_size > start ? stat.st_size - start : 0;
+
+	/* Small files cost less than handing them to the pool */
+	if (size < HASH_CHUNK_SIZE) {
+		ret = hash_crc32_inline(fd, dev, start, end, cancelled, size > 0 ? size : 1, crc, len);
+		sceIoClose(fd);
+		return ret;
+	}
+
+	if (hash_pool.started == 0 ||
+	    (sema = sceKernelCreateSema("FTPVita_hash_sema", 0, 0, HASH_CHUNKS, NULL)) < 0) {
+		ret = hash_crc32_inline(fd, dev, start, end, cancelled, HASH_CHUNK_SIZE, crc, len);
+		sceIoClose(fd);
+		return ret;
+	}
+
+	/* No more buffers than the file fills */
+	if (size / HASH_CHUNK_SIZE < HASH_CHUNKS)
+		n_chunks = (size + HASH_CHUNK_SIZE - 1) / HASH_CHUNK_SIZE;
+
+	bufs = mem_alloc(FTPVITA_MEM_HASH, n_chunks * HASH_CHUNK_SIZE);
+	if (bufs == NULL) {
+		sceKernelDeleteSema(sema);
+		sceIoClose(fd);
+		return -2;
+	}
+
+	for (i = 0; i < n_chunks; i++) {
+		chunks[i].data = bufs + i * HASH_CHUNK_SIZE;
+		chunks[i].sema = sema;
+	}
+
+	*crc = 0;
+	*len = 0;
+
+	while (1) {
+		/* Keep the workers fed */
+		while (!eof && ret == 0 && next_read - next_combine < n_chunks) {
+			if (cancelled && *cancelled) {
+				ret = -3;
+				break;
+			}
+
+			want = HASH_CHUNK_SIZE;
+			if (end >= 0) {
+				if (offset >= (unsigned long long)end)
+					want = 0;
+				else if (offset + want > (unsigned long long)end)
+					want = end - offset;
+			}
+			if (want == 0) {
+				eof = 1;
+				break;
+			}
+
+			chunk = &chunks[next_read % n_chunks];
+			t = sceKernelGetProcessTimeWide();
+			n = sceIoPread(fd, chunk->data, want, offset);
+			stat_io(dev, IO_OP_READ, n > 0 ? n : 0, sceKernelGetProcessTimeWide() - t);
+			if (n <= 0) {
+				if (n < 0)
+					ret = -1;
+				eof = 1;
+				break;
+			}
+
+			chunk->len = n;
+			offset += n;
+			hash_chunk_submit(chunk);
+			next_read++;
+		}
+
+		/* Nothing left in flight */
+		if (next_combine == next_read)
+			break;
+
+		/* Combine the chunks in file order */
+		chunk = &chunks[next_combine % n_chunks];
+		while (!__atomic_load_n(&chunk->done, __ATOMIC_ACQUIRE))
+			sceKernelWaitSema(sema, 1, NULL);
+
+		*crc = crc32_combine(*crc, chunk->crc, chunk->len);
+		*len += chunk->len;
+		next_combine++;
+	}
+
+	sceKernelDeleteSema(sema);
+	mem_free(bufs);
+	sceIoClose(fd);
+
+	return ret;
+}
+
+/* Hash cache: the CRC32s of whole files, so hashing an unchanged file
+ * again only costs a stat. Entries are keyed by a hash of the path and
+ * only match while the size and mtime are the same, so a modified file
+ * is never served a stale CRC. The table is direct-mapped and only
+ * allocated once something is stored. */
+
+#define HASH_CACHE_SIZE FTPVITA_HASH_CACHE_SIZE
+
+typedef struct {
+	unsigned long long key;
+	SceOff size;
+	SceDateTime mtime;
+	unsigned int crc;
+	int valid;
+} hash_cache_entry_t;
+
+static hash_cache_entry_t *hash_cache = NULL;
+static SceUID hash_cache_mtx;
+
+static unsigned long long hash_cache_key(const char *path)
+{
+	unsigned long long h = 0xCBF29CE484222325ULL;
+
+	while (*path)
+		h = (h ^ (unsigned char)*path++) * 0x100000001B3ULL;
+	return h;
+}
+
+static void hash_cache_init()
+{
+	hash_cache_mtx = sceKernelCreateMutex("FTPVita_hash_cache_mutex", 0, 0, NULL);
+}
+
+static void hash_cache_fini()
+{
+	mem_free(hash_cache);
+	hash_cache = NULL;
+	sceKernelDeleteMutex(hash_cache_mtx);
+}
+
+static int hash_cache_lookup(const char *path, const SceIoStat *stat, unsigned int *crc)
+{
+	unsigned long long key = hash_cache_key(path);
+	hash_cache_entry_t *entry;
+	int found = 0;
+
+	sceKernelLockMutex(hash_cache_mtx, 1, NULL);
+	if (hash_cache) {
+		entry = &hash_cache[key % HASH_CACHE_SIZE];
+		if (entry->valid && entry->key == key && entry->size == stat->st_size &&
+		    memcmp(&entry->mtime, &stat->st_mtime, sizeof(entry->mtime)) == 0) {
+			*crc = entry->crc;
+			found = 1;
+		}
+	}
+	sceKernelUnlockMutex(hash_cache_mtx, 1);
+
+	return found;
+}
+
+static void hash_cache_store(const char *path, const SceIoStat *stat, unsigned int crc)
+{
+	unsigned long long key = hash_cache_key(path);
+	hash_cache_entry_t *entry;
+
+	sceKernelLockMutex(hash_cache_mtx, 1, NULL);
+	if (hash_cache == NULL)
+		hash_cache = mem_calloc(FTPVITA_MEM_HASH_CACHE, HASH_CACHE_SIZE, sizeof(*hash_cache));
+	if (hash_cache) {
+		entry = &hash_cache[key % HASH_CACHE_SIZE];
+		entry->key = key;
+		entry->size = stat->st_size;
+		entry->mtime = stat->st_mtime;
+		entry->crc = crc;
+		entry->valid = 1;
+	}
+	sceKernelUnlockMutex(hash_cache_mtx, 1);
+}
+
+/* Drops the whole table, returns the bytes freed */
+static unsigned int hash_cache_trim()
+{
+	unsigned int freed = 0;
+
+	sceKernelLockMutex(hash_cache_mtx, 1, NULL);
+	if (hash_cache) {
+		mem_free(hash_cache);
+		hash_cache = NULL;
+		freed = HASH_CACHE_SIZE * sizeof(*hash_cache);
+	}
+	sceKernelUnlockMutex(hash_cache_mtx, 1);
+
+	return freed;
+}
+
+/* CRC32 of the whole file, stat being its current one. Returns the
+ * same as hash_crc32_file() */
+static int hash_file_cached(const char *path, const SceIoStat *stat,
+			    volatile int *cancelled, unsigned int *crc)
+{
+	unsigned long long len;
+	int ret;
+
+	if (cache_policy(path) == FTPVITA_CACHE_BYPASS)
+		return hash_crc32_file(path, 0, -1, cancelled, crc, &len);
+
+	if (hash_cache_lookup(path, stat, crc))
+		return 0;
+
+	ret = hash_crc32_file(path, 0, -1, cancelled, crc, &len);
+	/* Don't remember a file that changed while being read */
+	if (ret == 0 && len == stat->st_size)
+		hash_cache_store(path, stat, *crc);
+
+	return ret;
+}
+#endif
+
+#if FTPVITA_FEATURE_DIR_CACHE
+/* Directory cache: the files total and the subdirectory names of the
+ * directories read by tree walks, so walking the same tree again only
+ * reads the directories that changed. The server's own changes drop
+ * the entries they affect. On devices with FTPVITA_CACHE_REVALIDATE the
+ * entries also remember the directory's stat, and are dropped when it
+ * changes: files created, removed or renamed by other applications.
+ * Files rewritten in place don't touch their directory, so their new
+ * size is only seen once the entry is dropped some other way. */
+
+#define DIR_CACHE_SIZE FTPVITA_DIR_CACHE_SIZE
+
+typedef struct {
+	unsigned int last_use;
+	/* Size of the allocation */
+	unsigned int size;
+	unsigned int files;
+	unsigned long long bytes;
+	unsigned int n_subdirs;
+	/* Stat of the directory when it was read, if has_stat */
+	int has_stat;
+	SceOff dir_size;
+	SceDateTime dir_mtime;
+	/* Subdirectory names, each one NUL terminated */
+	char *subdirs;
+	char path[];
+} dir_cache_entry_t;
+
+static dir_cache_entry_t *dir_cache[DIR_CACHE_SIZE];
+static unsigned int dir_cache_clock = 0;
+static unsigned int dir_cache_bytes = 0;
+static SceUID dir_cache_mtx;
+
+/* Length of the path without trailing slashes, so "ux0:/" and "ux0:" match */
+static unsigned int dir_cache_key_len(const char *path)
+{
+	unsigned int len = strlen(path);
+
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	return len;
+}
+
+static int dir_cache_match(const dir_cache_entry_t *entry, const char *path, unsigned int len)
+{
+	return strlen(entry->path) == len && strncmp(entry->path, path, len) == 0;
+}
+
+static dir_cache_entry_t *dir_cache_alloc(const char *path, unsigned int subdirs_len)
+{
+	dir_cache_entry_t *entry;
+	unsigned int len = dir_cache_key_len(path);
+	unsigned int size = sizeof(*entry) + len + 1 + subdirs_len;
+
+	entry = mem_alloc(FTPVITA_MEM_DIR_CACHE, size);
+	if (entry == NULL)
+		return NULL;
+
+	entry->size = size;
+	memcpy(entry->path, path, len);
+	entry->path[len] = '\0';
+	entry->subdirs = entry->path + len + 1;
+	return entry;
+}
+
+static int dir_cache_entry_stale(const dir_cache_entry_t *entry, const SceIoStat *stat)
+{
+	return !entry->has_stat || entry->dir_size != stat->st_size ||
+		memcmp(&entry->dir_mtime, &stat->st_mtime, sizeof(entry->dir_mtime)) != 0;
+}
+
+/* Returns a copy of the entry for path, to be freed by the caller, or
+ * NULL. stat, if not NULL, is the current one of the directory: an
+ * entry read before the directory last changed is dropped */
+static dir_cache_entry_t *dir_cache_get(const char *path, const SceIoStat *stat)
+{
+	dir_cache_entry_t *copy = NULL;
+	unsigned int len = dir_cache_key_len(path);
+	int i;
+
+	sceKernelLockMutex(dir_cache_mtx, 1, NULL);
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i] && dir_cache_match(dir_cache[i], path, len)) {
+			if (stat && dir_cache_entry_stale(dir_cache[i], stat)) {
+				STAT_INC(dir_cache_stale);
+				dir_cache_bytes -= dir_cache[i]->size;
+				mem_free(dir_cache[i]);
+				dir_cache[i] = NULL;
+				break;
+			}
+			dir_cache[i]->last_use = ++dir_cache_clock;
+			copy = mem_alloc(FTPVITA_MEM_DIR_CACHE, dir_cache[i]->size);
+			if (copy) {
+				memcpy(copy, dir_cache[i], dir_cache[i]->size);
+				copy->subdirs = copy->path + len + 1;
+			}
+			break;
+		}
+	}
+
+	sceKernelUnlockMutex(dir_cache_mtx, 1);
+
+	if (copy)
+		STAT_INC(dir_cache_hits);
+	else
+		STAT_INC(dir_cache_misses);
+
+	return copy;
+}
+
+/* Takes ownership of the entry, replacing the least recently used one if full */
+static void dir_cache_put(dir_cache_entry_t *entry)
+{
+	unsigned int len = strlen(entry->path);
+	int i, slot = -1;
+
+	sceKernelLockMutex(dir_cache_mtx, 1, NULL);
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i] == NULL) {
+			if (slot < 0 || dir_cache[slot] != NULL)
+				slot = i;
+		} else if (dir_cache_match(dir_cache[i], entry->path, len)) {
+			slot = i;
+			break;
+		} else if (slot < 0 || (dir_cache[slot] != NULL &&
+			   dir_cache[i]->last_use < dir_cache[slot]->last_use)) {
+			slot = i;
+		}
+	}
+
+	if (dir_cache[slot]) {
+		dir_cache_bytes -= dir_cache[slot]->size;
+		mem_free(dir_cache[slot]);
+	}
+	entry->last_use = ++dir_cache_clock;
+	dir_cache[slot] = entry;
+	dir_cache_bytes += entry->size;
+
+	sceKernelUnlockMutex(dir_cache_mtx, 1);
+}
+
+/* Drops the entries of path, of everything below it and of its parent */
+static void dir_cache_invalidate(const char *path)
+{
+	unsigned int len = dir_cache_key_len(path);
+	unsigned int parent_len = len;
+	unsigned int entry_len;
+	int i;
+
+	/* The parent is everything before the last slash */
+	while (parent_len > 0 && path[parent_len - 1] != '/')
+		parent_len--;
+	while (parent_len > 0 && path[parent_len - 1] == '/')
+		parent_len--;
+
+	sceKernelLockMutex(dir_cache_mtx, 1, NULL);
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		if (dir_cache[i] == NULL)
+			continue;
+
+		entry_len = strlen(dir_cache[i]->path);
+		if ((entry_len >= len && strncmp(dir_cache[i]->path, path, len) == 0 &&
+		     (entry_len == len || dir_cache[i]->path[len] == '/')) ||
+		    (parent_len > 0 && dir_cache_match(dir_cache[i], path, parent_len))) {
+			dir_cache_bytes -= dir_cache[i]->size;
+			mem_free(dir_cache[i]);
+			dir_cache[i] = NULL;
+		}
+	}
+
+	sceKernelUnlockMutex(dir_cache_mtx, 1);
+}
+
+/* Drops every entry, returns the bytes freed */
+static unsigned int dir_cache_trim()
+{
+	unsigned int freed;
+	int i;
+
+	sceKernelLockMutex(dir_cache_mtx, 1, NULL);
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		mem_free(dir_cache[i]);
+		dir_cache[i] = NULL;
+	}
+	freed = dir_cache_bytes;
+	dir_cache_bytes = 0;
+
+	sceKernelUnlockMutex(dir_cache_mtx, 1);
+
+	return freed;
+}
+
+static void dir_cache_init()
+{
+	dir_cache_mtx = sceKernelCreateMutex("FTPVita_dir_cache_mutex", 0, 0, NULL);
+}
+
+static void dir_cache_fini()
+{
+	int i;
+
+	for (i = 0; i < DIR_CACHE_SIZE; i++) {
+		mem_free(dir_cache[i]);
+		dir_cache[i] = NULL;
+	}
+	dir_cache_bytes = 0;
+
+	sceKernelDeleteMutex(dir_cache_mtx);
+}
+#else
+static inline void dir_cache_invalidate(const char *path) {}
+#endif
+
+#if FTPVITA_FEATURE_DU
+/* Parallel tree walker: WALK_WORKERS threads share a queue of
+ * directories to read, the number of directories being read at once
+ * on each device is bounded by its semaphore. */
+
+#define WALK_WORKERS FTPVITA_WALK_WORKERS
+
+static SceUID walk_dev_sema[MAX_DEVICES];
+
+typedef struct walk_dir {
+	struct walk_dir *next;
+	char path[];
+} walk_dir_t;
+
+typedef struct {
+	/* LIFO, walking depth first keeps it short */
+	walk_dir_t *queue;
+	/* Directories queued or being read */
+	unsigned int pending;
+	SceUID mtx;
+	SceUID sema;
+	int dev;
+	volatile int *cancelled;
+	/* Totals */
+	unsigned long long bytes;
+	unsigned int files;
+	unsigned int dirs;
+	unsigned int errors;
+} walk_t;
+
+static int walk_cancelled(const walk_t *w)
+{
+	return w->cancelled && *w->cancelled;
+}
+
+static void walk_push(walk_t *w, const char *path)
+{
+	walk_dir_t *d = mem_alloc(FTPVITA_MEM_WALK, sizeof(*d) + strlen(path) + 1);
+
+	if (d == NULL) {
+		__atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	strcpy(d->path, path);
+
+	sceKernelLockMutex(w->mtx, 1, NULL);
+	d->next = w->queue;
+	w->queue = d;
+	w->pending++;
+	sceKernelUnlockMutex(w->mtx, 1);
+
+	sceKernelSignalSema(w->sema, 1);
+}
+
+static void walk_child_path(char *out, size_t size, const char *path, const char *name)
+{
+	if (path[0] && path[strlen(path) - 1] == '/')
+		snprintf(out, size, "%s%s", path, name);
+	else
+		snprintf(out, size, "%s/%s", path, name);
+}
+
+static void walk_read_dir(walk_t *w, const char *path)
+{
+	char child[PATH_MAX];
+	SceIoDirent dirent;
+	SceUID dir;
+	unsigned long long bytes = 0;
+	unsigned int files = 0;
+	int complete = 1;
+#if FTPVITA_FEATURE_DIR_CACHE
+	dir_cache_entry_t *entry;
+	char *names = NULL, *p;
+	unsigned int names_len = 0;
+	unsigned int names_size = 0;
+	unsigned int n_subdirs = 0;
+	unsigned int name_len;
+	unsigned int i;
+	ftpvita_cache_policy_t policy = cache_policy(path);
+	SceIoStat dir_stat;
+	int has_stat = 0;
+
+	/* Stat before reading, so changes made meanwhile show next time */
+	if (policy == FTPVITA_CACHE_REVALIDATE)
+		has_stat = sceIoGetstat(path, &dir_stat) >= 0;
+
+	if (policy != FTPVITA_CACHE_BYPASS &&
+	    (policy == FTPVITA_CACHE_TRUST || has_stat) &&
+	    (entry = dir_cache_get(path, has_stat ? &dir_stat : NULL)) != NULL) {
+		for (i = 0, p = entry->subdirs; i < entry->n_subdirs; i++, p += strlen(p) + 1) {
+			walk_child_path(child, sizeof(child), path, p);
+			walk_push(w, child);
+		}
+		__atomic_fetch_add(&w->bytes, entry->bytes, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&w->files, entry->files, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&w->dirs, 1, __ATOMIC_RELAXED);
+		mem_free(entry);
+		return;
+	}
+#endif
+
+	if (w->dev >= 0)
+		sceKernelWaitSema(walk_dev_sema[w->dev], 1, NULL);
+
+	dir = sceIoDopen(path);
+	if (dir < 0) {
+		if (w->dev >= 0)
+			sceKernelSignalSema(walk_dev_sema[w->dev], 1);
+		__atomic_fetch_add(&w->errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	memset(&dirent, 0, sizeof(dirent));
+
+	while (sceIoDread(dir, &dirent) > 0) {
+		if (walk_cancelled(w)) {
+			complete = 0;
+			break;
+		}
+
+		if (SCE_S_ISDIR(dirent.d_stat.st_mode)) {
+			if (strcmp(dirent.d_name, ".") != 0 && strcmp(dirent.d_name, "..") != 0) {
+				walk_child_path(child, sizeof(child), path, dirent.d_name);
+				walk_push(w, child);
+#if FTPVITA_FEATURE_DIR_CACHE
+				name_len = strlen(dirent.d_name) + 1;
+				if (names_len + name_len > names_size) {
+					names_size = (names_len + name_len) * 2;
+					p = mem_realloc(FTPVITA_MEM_WALK, names, names_size);
+					if (p == NULL) {
+						complete = 0;
+						names_size = 0;
+					} else {
+						names = p;
+					}
+				}
+				if (names_size) {
+					memcpy(names + names_len, dirent.d_name, name_len);
+					names_len += name_len;
+					n_subdirs++;
+				}
+#endif
+			}
+		} else {
+			files++;
+			bytes += dirent.d_stat.st_size;
+		}
+
+		memset(&dirent, 0, sizeof(dirent));
+	}
+
+	sceIoDclose(dir);
+
+	if (w->dev >= 0)
+		sceKernelSignalSema(walk_dev_sema[w->dev], 1);
+
+	__atomic_fetch_add(&w->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->files, files, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&w->dirs, 1, __ATOMIC_RELAXED);
+
+#if FTPVITA_FEATURE_DIR_CACHE
+	if (complete && policy != FTPVITA_CACHE_BYPASS &&
+	    (entry = dir_cache_alloc(path, names_len)) != NULL) {
+		entry->files = files;
+		entry->bytes = bytes;
+		entry->n_subdirs = n_subdirs;
+		entry->has_stat = has_stat;
+		if (has_stat) {
+			entry->dir_size = dir_stat.st_size;
+			entry->dir_mtime = dir_stat.st_mtime;
+		}
+		if (names_len)
+			memcpy(entry->subdirs, names, names_len);
+		dir_cache_put(entry);
+	}
+	mem_free(names);
+#else
+	UNUSED(complete);
+#endif
+}
+
+/* Reads queued directories until the walk is over */
+static void walk_run(walk_t *w)
+{
+	walk_dir_t *d;
+
+	while (1) {
+		sceKernelLockMutex(w->mtx, 1, NULL);
+		while (w->queue == NULL && w->pending > 0) {
+			sceKernelUnlockMutex(w->mtx, 1);
+			sceKernelWaitSema(w->sema, 1, NULL);
+			sceKernelLockMutex(w->mtx, 1, NULL);
+		}
+		d = w->queue;
+		if (d == NULL) {
+			/* Nothing queued nor being read: the walk is over */
+			sceKernelUnlockMutex(w->mtx, 1);
+			break;
+		}
+		w->queue = d->next;
+		sceKernelUnlockMutex(w->mtx, 1);
+
+		/* Once cancelled the queue is just drained */
+		if (!walk_cancelled(w))
+			walk_read_dir(w, d->path);
+		mem_free(d);
+
+		sceKernelLockMutex(w->mtx, 1, NULL);
+		if (--w->pending == 0)
+			sceKernelSignalSema(w->sema, WALK_WORKERS);
+		sceKernelUnlockMutex(w->mtx, 1);
+	}
+}
+
+static int walk_worker_thread(SceSize args, void *argp)
+{
+	walk_run(*(walk_t **)argp);
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static void walk_init()
+{
+	int i;
+
+	for (i = 0; i < MAX_DEVICES; i++) {
+		walk_dev_sema[i] = sceKernelCreateSema("FTPVita_walk_dev_sema", 0,
+			FTPVITA_WALK_DEV_CONCURRENCY, FTPVITA_WALK_DEV_CONCURRENCY, NULL);
+	}
+}
+
+static void walk_fini()
+{
+	int i;
+
+	for (i = 0; i < MAX_DEVICES; i++)
+		sceKernelDeleteSema(walk_dev_sema[i]);
+}
+#endif
+
+#if FTPVITA_FEATURE_PREFETCH
+/* Read-ahead: the start of the files a client is expected to RETR
+ * next is loaded by a background thread, so the first-byte latency of
+ * the next transfer overlaps the current one. The next file is either
+ * predicted (after two RETRs in the same directory, the file that
+ * follows in directory order) or hinted with SITE PREFETCH. */
+
+#define PREFETCH_SIZE       FTPVITA_PREFETCH_SIZE
+#define PREFETCH_SLOTS      (FTPVITA_PREFETCH_BUDGET / FTPVITA_PREFETCH_SIZE)
+#define PREFETCH_QUEUE_SIZE 16
+
+#if PREFETCH_SLOTS < 1
+#  error "FTPVITA_PREFETCH_BUDGET must hold at least one FTPVITA_PREFETCH_SIZE"
+#endif
+
+enum {
+	PREFETCH_FREE,
+	PREFETCH_LOADING,
+	PREFETCH_READY,
+};
+
+enum {
+	/* Read ahead the file */
+	PREFETCH_REQ_FILE,
+	/* Read ahead the file after this one in its directory */
+	PREFETCH_REQ_NEXT,
+};
+
+typedef struct {
+	int state;
+	/* Changed by the server while loading, drop it once loaded */
+	int stale;
+	unsigned int last_use;
+	char path[PATH_MAX];
+	SceIoStat stat;
+	unsigned int len;
+	unsigned char *data;
+} prefetch_entry_t;
+
+static struct {
+	prefetch_entry_t entries[PREFETCH_SLOTS];
+	unsigned int clock;
+	struct {
+		int type;
+		char path[PATH_MAX];
+	} reqs[PREFETCH_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	SceUID mtx;
+	SceUID sema;
+	SceUID thid;
+	int quit;
+} prefetch;
+
+static void prefetch_request(int type, const char *path)
+{
+	if (cache_policy(path) == FTPVITA_CACHE_BYPASS)
+		return;
+
+	sceKernelLockMutex(prefetch.mtx, 1, NULL);
+
+	/* Hints are best effort, drop them if the thread is behind */
+	if (prefetch.head - prefetch.tail == PREFETCH_QUEUE_SIZE) {
+		sceKernelUnlockMutex(prefetch.mtx, 1);
+		return;
+	}
+
+	prefetch.reqs[prefetch.head % PREFETCH_QUEUE_SIZE].type = type;
+	strncpy(prefetch.reqs[prefetch.head % PREFETCH_QUEUE_SIZE].path, path, PATH_MAX - 1);
+	prefetch.reqs[prefetch.head % PREFETCH_QUEUE_SIZE].path[PATH_MAX - 1] = '\0';
+	prefetch.head++;
+
+	sceKernelUnlockMutex(prefetch.mtx, 1);
+	sceKernelSignalSema(prefetch.sema, 1);
+}
+
+static int prefetch_matches(const char *entry_path, const char *path, unsigned int len)
+{
+	return strncmp(entry_path, path, len) == 0 &&
+		(entry_path[len] == '\0' || entry_path[len] == '/');
+}
+
+/* Finds the regular file that follows path in its directory */
+static int prefetch_find_next(const char *path, char *next, size_t next_size)
+{
+	char dir_path[PATH_MAX];
+	const char *name;
+	SceIoDirent dirent;
+	SceUID dir;
+	int found = 0;
+	int ret = -1;
+
+	name = strrchr(path, '/');
+	if (name == NULL)
+		return -1;
+	snprintf(dir_path, sizeof(dir_path), "%.*s", (int)(name - path + 1), path);
+	name++;
+
+	dir = sceIoDopen(dir_path);
+	if (dir < 0)
+		return -1;
+
+	memset(&dirent, 0, sizeof(dirent));
+
+	while (sceIoDread(dir, &dirent) > 0) {
+		if (found && !SCE_S_ISDIR(dirent.d_stat.st_mode)) {
+			snprintf(next, next_size, "%s%s", dir_path, dirent.d_name);
+			ret = 0;
+			break;
+		}
+		if (strcmp(dirent.d_name, name) == 0)
+			found = 1;
+		memset(&dirent, 0, sizeof(dirent));
+	}
+
+	sceIoDclose(dir);
+	return ret;
+}
+
+static void prefetch_load(const char *path)
+{
+	prefetch_entry_t *entry = NULL;
+	unsigned char *data;
+	int dev = device_index(path);
+	int i, len = -1;
+	SceIoStat stat;
+	SceUInt64 t;
+	SceUID fd;
+
+	sceKernelLockMutex(prefetch.mtx, 1, NULL);
+
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (prefetch.entries[i].state != PREFETCH_FREE &&
+		    strcmp(prefetch.entries[i].path, path) == 0) {
+			/* Already there */
+			sceKernelUnlockMutex(prefetch.mtx, 1);
+			return;
+		}
+	}
+
+	/* A free slot, or else the least recently loaded file */
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (prefetch.entries[i].state == PREFETCH_FREE) {
+			entry = &prefetch.entries[i];
+			break;
+		}
+		if (prefetch.entries[i].state == PREFETCH_READY &&
+		    (entry == NULL || prefetch.entries[i].last_use < entry->last_use))
+			entry = &prefetch.entries[i];
+	}
+
+	if (entry == NULL) {
+		sceKernelUnlockMutex(prefetch.mtx, 1);
+		return;
+	}
+
+	if (entry->state == PREFETCH_READY) {
+		STAT_INC(prefetch_wasted);
+		mem_free(entry->data);
+	}
+	entry->state = PREFETCH_LOADING;
+	entry->stale = 0;
+	entry->last_use = ++prefetch.clock;
+	strcpy(entry->path, path);
+	entry->data = NULL;
+
+	sceKernelUnlockMutex(prefetch.mtx, 1);
+
+	data = mem_alloc(FTPVITA_MEM_PREFETCH, PREFETCH_SIZE);
+	if (data && (fd = sceIoOpen(path, SCE_O_RDONLY, 0777)) >= 0) {
+		if (sceIoGetstatByFd(fd, &stat) >= 0 && !SCE_S_ISDIR(stat.st_mode)) {
+			t = sceKernelGetProcessTimeWide();
+			len = sceIoRead(fd, data, PREFETCH_SIZE);
+			stat_io(dev, IO_OP_READ, len > 0 ? len : 0, sceKernelGetProcessTimeWide() - t);
+		}
+		sceIoClose(fd);
+	}
+
+	sceKernelLockMutex(prefetch.mtx, 1, NULL);
+
+	if (len > 0 && !entry->stale) {
+		entry->stat = stat;
+		entry->len = len;
+		entry->data = data;
+		entry->state = PREFETCH_READY;
+	} else {
+		mem_free(data);
+		entry->state = PREFETCH_FREE;
+	}
+
+	sceKernelUnlockMutex(prefetch.mtx, 1);
+}
+
+static int prefetch_thread(SceSize args, void *argp)
+{
+	char path[PATH_MAX];
+	char next[PATH_MAX];
+	int type;
+
+	while (1) {
+		sceKernelWaitSema(prefetch.sema, 1, NULL);
+
+		sceKernelLockMutex(prefetch.mtx, 1, NULL);
+		if (prefetch.head == prefetch.tail) {
+			sceKernelUnlockMutex(prefetch.mtx, 1);
+			if (prefetch.quit)
+				break;
+			continue;
+		}
+		type = prefetch.reqs[prefetch.tail % PREFETCH_QUEUE_SIZE].type;
+		strcpy(path, prefetch.reqs[prefetch.tail % PREFETCH_QUEUE_SIZE].path);
+		prefetch.tail++;
+		sceKernelUnlockMutex(prefetch.mtx, 1);
+
+		if (type == PREFETCH_REQ_NEXT) {
+			if (prefetch_find_next(path, next, sizeof(next)) == 0)
+				prefetch_load(next);
+		} else {
+			prefetch_load(path);
+		}
+	}
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+/* Takes the read-ahead data of the open file, if any and if the file
+ * didn't change since. Returns its length, data must be freed */
+static unsigned int prefetch_take(const char *path, SceUID fd, unsigned char **data)
+{
+	prefetch_entry_t taken;
+	SceIoStat stat;
+	int i, found = 0;
+
+	*data = NULL;
+
+	sceKernelLockMutex(prefetch.mtx, 1, NULL);
+
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (prefetch.entries[i].state == PREFETCH_READY &&
+		    strcmp(prefetch.entries[i].path, path) == 0) {
+			taken.stat = prefetch.entries[i].stat;
+			taken.len = prefetch.entries[i].len;
+			taken.data = prefetch.entries[i].data;
+			prefetch.entries[i].state = PREFETCH_FREE;
+			found = 1;
+			break;
+		}
+	}
+
+	sceKernelUnlockMutex(prefetch.mtx, 1);
+
+	if (found && cache_policy(path) != FTPVITA_CACHE_TRUST &&
+	    (sceIoGetstatByFd(fd, &stat) < 0 ||
+	    stat.st_size != taken.stat.st_size ||
+	    memcmp(&stat.st_mtime, &taken.stat.st_mtime, sizeof(stat.st_mtime)) != 0)) {
+		/* Modified by someone else */
+		STAT_INC(prefetch_wasted);
+		mem_free(taken.data);
+		found = 0;
+	}
+
+	if (!found) {
+		STAT_INC(prefetch_misses);
+		return 0;
+	}
+
+	STAT_INC(prefetch_hits);
+	*data = taken.data;
+	return taken.len;
+}
+
+/* Reads ahead the next file when the client downloads a directory in order */
+static void prefetch_predict(ftpvita_client_info_t *client, const char *path)
+{
+	const char *name = strrchr(path, '/');
+	int len = name ? name - path : 0;
+
+	if (len > 0 && strlen(client->prefetch_dir) == len &&
+	    strncmp(client->prefetch_dir, path, len) == 0)
+		prefetch_request(PREFETCH_REQ_NEXT, path);
+
+	snprintf(client->prefetch_dir, sizeof(client->prefetch_dir), "%.*s", len, path);
+}
+
+/* Drops the read-ahead of path and of everything below it */
+static void prefetch_invalidate(const char *path)
+{
+	unsigned int len = strlen(path);
+	int i;
+
+	sceKernelLockMutex(prefetch.mtx, 1, NULL);
+
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (prefetch.entries[i].state == PREFETCH_FREE ||
+		    !prefetch_matches(prefetch.entries[i].path, path, len))
+			continue;
+
+		if (prefetch.entries[i].state == PREFETCH_LOADING) {
+			prefetch.entries[i].stale = 1;
+		} else {
+			STAT_INC(prefetch_wasted);
+			mem_free(prefetch.entries[i].data);
+			prefetch.entries[i].state = PREFETCH_FREE;
+		}
+	}
+
+	sceKernelUnlockMutex(prefetch.mtx, 1);
+}
+
+/* Drops the loaded read-ahead data, the files being loaded are left
+ * alone. Returns the bytes freed */
+static unsigned int prefetch_trim()
+{
+	unsigned int freed = 0;
+	int i;
+
+	sceKernelLockMutex(prefetch.mtx, 1, NULL);
+
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (prefetch.entries[i].state == PREFETCH_READY) {
+			STAT_INC(prefetch_wasted);
+			mem_free(prefetch.entries[i].data);
+			prefetch.entries[i].state = PREFETCH_FREE;
+			freed += PREFETCH_SIZE;
+		}
+	}
+
+	sceKernelUnlockMutex(prefetch.mtx, 1);
+
+	return freed;
+}
+
+static void prefetch_init()
+{
+	memset(&prefetch, 0, sizeof(prefetch));
+
+	prefetch.mtx = sceKernelCreateMutex("FTPVita_prefetch_mutex", 0, 0, NULL);
+	prefetch.sema = sceKernelCreateSema("FTPVita_prefetch_sema", 0, 0,
+		PREFETCH_QUEUE_SIZE + 1, NULL);
+
+	/* Low priority, it should only use idle time */
+	prefetch.thid = sceKernelCreateThread("FTPVita_prefetch_thread",
+		prefetch_thread, 0x10000100 + 10, 0x4000, 0, 0, NULL);
+	DEBUG("Prefetch thread UID: 0x%08X\n", prefetch.thid);
+	sceKernelStartThread(prefetch.thid, 0, NULL);
+}
+
+static void prefetch_fini()
+{
+	int i;
+
+	prefetch.quit = 1;
+	sceKernelSignalSema(prefetch.sema, 1);
+	sceKernelWaitThreadEnd(prefetch.thid, NULL, NULL);
+
+	for (i = 0; i < PREFETCH_SLOTS; i++) {
+		if (prefetch.entries[i].state == PREFETCH_READY)
+			mem_free(prefetch.entries[i].data);
+		prefetch.entries[i].state = PREFETCH_FREE;
+	}
+
+	sceKernelDeleteSema(prefetch.sema);
+	sceKernelDeleteMutex(prefetch.mtx);
+}
+#else
+static inline void prefetch_invalidate(const char *path) {}
+#endif
+
+/* The server changed path, drop whatever is cached about it.
+ * Inline, so read-only builds that never call it don't warn */
+static inline void cache_invalidate(const char *path)
+{
+	dir_cache_invalidate(path);
+	prefetch_invalidate(path);
+}
+
+static void cmd_NOOP_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "200 No operation ;)" FTPVITA_EOL);
+}
+
+static void cmd_USER_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "331 Username OK, need password b0ss." FTPVITA_EOL);
+}
+
+static void cmd_PASS_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "230 User logged in!" FTPVITA_EOL);
+}
+
+static void cmd_QUIT_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "221 Goodbye senpai :'(" FTPVITA_EOL);
+}
+
+static void cmd_SYST_func(ftpvita_client_info_t *client)
+{
+	client_send_ctrl_msg(client, "215 UNIX Type: L8" FTPVITA_EOL);
+}
+
+/* Opens the PASV listening socket, addr gets its h1,h2,h3,h4,p1,p2 */
+static void client_listen_data(ftpvita_client_info_t *client, char *addr, size_t size)
+{
+	int ret;
+	UNUSED(ret);
+
+	unsigned int namelen;
+	SceNetSockaddrIn picked;
+
+	/* Create data mode socket name */
+	char data_socket_name[64];
+	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
+		client->num);
+
+	/* Create the data socket */
+	client->data_sockfd = sceNetSocket(data_socket_name,
+		SCE_NET_AF_INET,
+		SCE_NET_SOCK_STREAM,
+		0);
+
+	DEBUG("PASV data socket fd: %d\n", client->data_sockfd);
+
+	/* Fill the data socket address */
+	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
+	client->data_sockaddr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+	/* Let the PSVita choose a port */
+	client->data_sockaddr.sin_port = sceNetHtons(0);
+
+	/* Bind the data socket address to the data socket */
+	ret = sceNetBind(client->data_sockfd,
+		(SceNetSockaddr *)&client->data_sockaddr,
+		sizeof(client->data_sockaddr));
+	DEBUG("sceNetBind(): 0x%08X\n", ret);
+
+	/* Start listening */
+	ret = sceNetListen(client->data_sockfd, 128);
+	DEBUG("sceNetListen(): 0x%08X\n", ret);
+
+	/* Get the port that the PSVita has chosen */
+	namelen = sizeof(picked);
+	sceNetGetsockname(client->data_sockfd, (SceNetSockaddr *)&picked,
+		&namelen);
+
+	DEBUG("PASV mode port: 0x%04X\n", picked.sin_port);
+
+	snprintf(addr, size, "%hhu,%hhu,%hhu,%hhu,%hhu,%hhu",
+		(vita_addr.s_addr >> 0) & 0xFF,
+		(vita_addr.s_addr >> 8) & 0xFF,
+		(vita_addr.s_addr >> 16) & 0xFF,
+		(vita_addr.s_addr >> 24) & 0xFF,
+		(picked.sin_port >> 0) & 0xFF,
+		(picked.sin_port >> 8) & 0xFF);
+
+	/* Set the data connection type to passive! */
+	client->data_con_type = FTP_DATA_CONNECTION_PASSIVE;
+}
+
+static void cmd_PASV_func(ftpvita_client_info_t *client)
+{
+	char addr[32];
+	char cmd[64];
+
+	client_listen_data(client, addr, sizeof(addr));
+
+	/* Build the command */
+	sprintf(cmd, "227 Entering Passive Mode (%s)" FTPVITA_EOL, addr);
+	client_send_ctrl_msg(client, cmd);
+}
+
+#if FTPVITA_FEATURE_MODE_E
+/* Striped passive: a single stripe, the client opens the MODE E
+ * data connections of the next transfer to it */
+static void cmd_SPAS_func(ftpvita_client_info_t *client)
+{
+	char addr[32];
+	char cmd[64];
+
+	client_listen_data(client, addr, sizeof(addr));
+
+	client_send_ctrl_msg(client, "229-Entering Striped Passive Mode" FTPVITA_EOL);
+	sprintf(cmd, " %s" FTPVITA_EOL, addr);
+	client_send_ctrl_msg(client, cmd);
+	client_send_ctrl_msg(client, "229 End" FTPVITA_EOL);
+}
+
+static void cmd_MODE_func(ftpvita_client_info_t *client)
+{
+	char mode;
+	int n_args = sscanf(client->recv_cmd_args, "%c", &mode);
+
+	if (n_args > 0 && (mode == 'S' || mode == 's')) {
+		client->mode_e = 0;
+		client_send_ctrl_msg(client, "200 Mode set to S." FTPVITA_EOL);
+	} else if (n_args > 0 && (mode == 'E' || mode == 'e')) {
+		client->mode_e = 1;
+		client_send_ctrl_msg(client, "200 Mode set to E." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "504 Mode not supported." FTPVITA_EOL);
+	}
+}
+#endif
+
+static void cmd_PORT_func(ftpvita_client_info_t *client)
+{
+	unsigned int data_ip[4];
+	unsigned int porthi, portlo;
+	unsigned short data_port;
+	char ip_str[16];
+	SceNetInAddr data_addr;
+
+	/* Using ints because of newlibc's u8 sscanf bug */
+	sscanf(client->recv_cmd_args, "%d,%d,%d,%d,%d,%d",
+		&data_ip[0], &data_ip[1], &data_ip[2], &data_ip[3],
+		&porthi, &portlo);
+
+	data_port = portlo + porthi*256;
+
+	/* Convert to an X.X.X.X IP string */
+	sprintf(ip_str, "%d.%d.%d.%d",
+		data_ip[0], data_ip[1], data_ip[2], data_ip[3]);
+
+	/* Convert the IP to a SceNetInAddr */
+	sceNetInetPton(SCE_NET_AF_INET, ip_str, &data_addr);
+
+	DEBUG("PORT connection to client's IP: %s Port: %d\n", ip_str, data_port);
+
+	/* Create data mode socket name */
+	char data_socket_name[64];
+	sprintf(data_socket_name, "FTPVita_client_%i_data_socket",
+		client->num);
+
+	/* Create data mode socket */
+	client->data_sockfd = sceNetSocket(data_socket_name,
+		SCE_NET_AF_INET,
+		SCE_NET_SOCK_STREAM,
+		0);
+
+	DEBUG("Client %i data socket fd: %d\n", client->num,
+		client->data_sockfd);
+
+	/* Prepare socket address for the data connection */
+	client->data_sockaddr.sin_family = SCE_NET_AF_INET;
+	client->data_sockaddr.sin_addr = data_addr;
+	client->data_sockaddr.sin_port = sceNetHtons(data_port);
+
+	/* Set the data connection type to active! */
+	client->data_con_type = FTP_DATA_CONNECTION_ACTIVE;
+
+	client_send_ctrl_msg(client, "200 PORT command successful!" FTPVITA_EOL);
+}
+
+static void client_open_data_connection(ftpvita_client_info_t *client)
+{
+	int ret;
+	UNUSED(ret);
+
+	unsigned int addrlen;
+
+	if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
+		/* Connect to the client using the data socket */
+		ret = sceNetConnect(client->data_sockfd,
+			(SceNetSockaddr *)&client->data_sockaddr,
+			sizeof(client->data_sockaddr));
+
+		DEBUG("sceNetConnect(): 0x%08X\n", ret);
+	} else {
+		/* Listen to the client using the data socket */
+		addrlen = sizeof(client->pasv_sockaddr);
+		client->pasv_sockfd = sceNetAccept(client->data_sockfd,
+			(SceNetSockaddr *)&client->pasv_sockaddr,
+			&addrlen);
+		DEBUG("PASV client fd: 0x%08X\n", client->pasv_sockfd);
+	}
+}
+
+static void client_close_data_connection(ftpvita_client_info_t *client)
+{
+	sceNetSocketClose(client->data_sockfd);
+	/* In passive mode we have to close the client pasv socket too */
+	if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE) {
+		sceNetSocketClose(client->pasv_sockfd);
+	}
+	client->data_con_type = FTP_DATA_CONNECTION_NONE;
+}
+
+static int gen_list_format(char *out, int n, int dir, const SceIoStat *stat, const char *filename)
+{
+	static const char num_to_month[][4] = {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+	};
+
+	char yt[6];
+	SceDateTime cdt;
+	sceRtcGetCurrentClockLocalTime(&cdt);
+
+	if  (cdt.year == stat->st_mtime.year) {
+		snprintf(yt, sizeof(yt), "%02d:%02d", stat->st_mtime.hour, stat->st_mtime.minute);
+	}
+	else {
+		snprintf(yt, sizeof(yt), "%04d", stat->st_mtime.year);
+	}
+
+	return snprintf(out, n,
+		"%c%s 1 vita vita %u %s %-2d %s %s" FTPVITA_EOL,
+		dir ? 'd' : '-',
+		dir ? "rwxr-xr-x" : "rw-r--r--",
+		(unsigned int) stat->st_size,
+		num_to_month[stat->st_mtime.month<=0?0:(stat->st_mtime.month-1)%12],
+		stat->st_mtime.day,
+		yt,
+		filename);
+}
+
+static void send_LIST(ftpvita_client_info_t *client, const char *path)
+{
+	int i;
+	char buffer[512];
+	SceUID dir;
+	SceIoDirent dirent;
+	SceIoStat stat;
+	char *devname;
+	int send_devices = 0;
+
+	/* "/" path is a special case, if we are here we have
+	 * to send the list of devices (aka mountpoints). */
+	if (strcmp(path, "/") == 0) {
+		send_devices = 1;
+	}
+
+	if (!send_devices) {
+		dir = sceIoDopen(get_vita_path(path));
+		if (dir < 0) {
+			client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+			return;
+		}
+	}
+
+	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for LIST." FTPVITA_EOL);
+
+	client_open_data_connection(client);
+
+	if (send_devices) {
+		for (i = 0; i < MAX_DEVICES; i++) {
+			if (device_list[i].valid) {
+				devname = device_list[i].name;
+				if (sceIoGetstat(devname, &stat) >= 0) {
+					gen_list_format(buffer, sizeof(buffer),	1, &stat, devname);
+					client_send_data_msg(client, buffer);
+				}
+			}
+		}
+	} else {
+		memset(&dirent, 0, sizeof(dirent));
+
+		while (sceIoDread(dir, &dirent) > 0) {
+			gen_list_format(buffer, sizeof(buffer), SCE_S_ISDIR(dirent.d_stat.st_mode),
+				&dirent.d_stat, dirent.d_name);
+			client_send_data_msg(client, buffer);
+			memset(&dirent, 0, sizeof(dirent));
+			memset(buffer, 0, sizeof(buffer));
+		}
+
+		sceIoDclose(dir);
+	}
+
+	DEBUG("Done sending LIST\n");
+
+	client_close_data_connection(client);
+	client_send_ctrl_msg(client, "226 Transfer complete." FTPVITA_EOL);
+}
+
+static void cmd_LIST_func(ftpvita_client_info_t *client)
+{
+	char list_path[PATH_MAX];
+	int list_cur_path = 1;
+
+	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", list_path);
+
+	if (n > 0 && file_exists(get_vita_path(list_path)))
+		list_cur_path = 0;
+
+	if (list_cur_path)
+		send_LIST(client, client->cur_path);
+	else
+		send_LIST(client, list_path);
+}
+
+static void cmd_PWD_func(ftpvita_client_info_t *client)
+{
+	char msg[PATH_MAX];
+	snprintf(msg, sizeof(msg), "257 \"%s\" is the current directory." FTPVITA_EOL, client->cur_path);
+	client_send_ctrl_msg(client, msg);
+}
+
+static int path_is_at_root(const char *path)
+{
+	return strrchr(path, '/') == (path + strlen(path) - 1);
+}
+
+static void dir_up(char *path)
+{
+	char *pch;
+	size_t len_in = strlen(path);
+	if (len_in == 1) {
+		strcpy(path, "/");
+		return;
+	}
+	if (path_is_at_root(path)) { /* Case root of the device (/foo0:/) */
+		strcpy(path, "/");
+	} else {
+		pch = strrchr(path, '/');
+		size_t s = len_in - (pch - path);
+		memset(pch, '\0', s);
+		/* If the path is like: /foo: add slash */
+		if (strrchr(path, '/') == path)
+			strcat(path, "/");
+	}
+}
+
+static void cmd_CWD_func(ftpvita_client_info_t *client)
+{
+	char cmd_path[PATH_MAX];
+	char tmp_path[PATH_MAX];
+	SceUID pd;
+	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+
+	if (n < 1) {
+		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPVITA_EOL);
+	} else {
+		if (strcmp(cmd_path, "/") == 0) {
+			strcpy(client->cur_path, cmd_path);
+		} else  if (strcmp(cmd_path, "..") == 0) {
+			dir_up(client->cur_path);
+		} else {
+			if (cmd_path[0] == '/') { /* Full path */
+				strcpy(tmp_path, cmd_path);
+			} else { /* Change dir relative to current dir */
+				/* If we are at the root of the device, don't add
+				 * an slash to add new path */
+				if (path_is_at_root(client->cur_path))
+					snprintf(tmp_path, sizeof(tmp_path), "%s%s", client->cur_path, cmd_path);
+				else
+					snprintf(tmp_path, sizeof(tmp_path), "%s/%s", client->cur_path, cmd_path);
+			}
+
+			/* If the path is like: /foo: add an slash */
+			if (strrchr(tmp_path, '/') == tmp_path)
+				strcat(tmp_path, "/");
+
+			/* If the path is not "/", check if it exists */
+			if (strcmp(tmp_path, "/") != 0) {
+				/* Check if the path exists */
+				pd = sceIoDopen(get_vita_path(tmp_path));
+				if (pd < 0) {
+					client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+					return;
+				}
+				sceIoDclose(pd);
+			}
+			strcpy(client->cur_path, tmp_path);
+		}
+		client_send_ctrl_msg(client, "250 Requested file action okay, completed." FTPVITA_EOL);
+	}
+}
+
+static void cmd_TYPE_func(ftpvita_client_info_t *client)
+{
+	char data_type;
+	char format_control[8];
+	int n_args = sscanf(client->recv_cmd_args, "%c %s", &data_type, format_control);
+
+	if (n_args > 0) {
+		switch(data_type) {
+		case 'A':
+		case 'I':
+			/* MODE E transfers are always binary */
+			client->type_ascii = data_type == 'A';
+			client_send_ctrl_msg(client, "200 Okay" FTPVITA_EOL);
+			break;
+		case 'E':
+		case 'L':
+		default:
+			client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
+			break;
+		}
+	} else {
+		client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
+	}
+}
+
+static void cmd_CDUP_func(ftpvita_client_info_t *client)
+{
+	dir_up(client->cur_path);
+	client_send_ctrl_msg(client, "200 Command okay." FTPVITA_EOL);
+}
+
+#if FTPVITA_FEATURE_MODE_E
+/* Extended block mode (MODE E, as in GridFTP): a transfer is striped
+ * across several data connections. Each block starts with a header
+ * holding its offset in the file, so blocks can come in any order on
+ * any connection and are read or written with positional I/O. Every
+ * connection ends with an EOD block; the EOF block carries the number
+ * of connections of the transfer in its offset field. */
+
+#define MODE_E_HEADER_SIZE 17
+#define MODE_E_BLOCK_SIZE  FTPVITA_MODE_E_BLOCK_SIZE
+#define MODE_E_DESC_EOF    0x40
+#define MODE_E_DESC_EOD    0x08
+#define MODE_E_DESC_CLOSE  0x04
+
+struct mode_e_stream;
+
+typedef struct {
+	ftpvita_client_info_t *client;
+	SceUID fd;
+	int dev;
+	/* RETR: next offset to send and size of the file */
+	unsigned long long next;
+	unsigned long long end;
+	/* STOR: EOD blocks received and number of connections announced
+	 * by the EOF block, -1 until it comes */
+	unsigned int eods;
+	int eodc;
+	unsigned long long bytes;
+	int failed;
+	void (*func)(struct mode_e_stream *s);
+} mode_e_xfer_t;
+
+typedef struct mode_e_stream {
+	mode_e_xfer_t *xfer;
+	int sockfd;
+} mode_e_stream_t;
+
+static void mode_e_header(unsigned char *h, int desc, unsigned long long count,
+			  unsigned long long offset)
+{
+	int i;
+
+	h[0] = desc;
+	for (i = 0; i < 8; i++) {
+		h[1 + i] = count >> (56 - 8 * i);
+		h[9 + i] = offset >> (56 - 8 * i);
+	}
+}
+
+/* Stops all the streams, the ones blocked on their socket included */
+static void mode_e_fail(mode_e_xfer_t *x)
+{
+	int i;
+
+	if (__atomic_exchange_n(&x->failed, 1, __ATOMIC_ACQ_REL))
+		return;
+	for (i = 0; i < x->client->n_streams; i++) {
+		sceNetSocketAbort(x->client->stream_sockfd[i],
+			SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION |
+			SCE_NET_SOCKET_ABORT_FLAG_SND_PRESERVATION);
+	}
+}
+
+static int mode_e_failed(mode_e_xfer_t *x)
+{
+	return __atomic_load_n(&x->failed, __ATOMIC_ACQUIRE);
+}
+
+/* Sends blocks until the whole file has been taken by the streams */
+static void mode_e_send_stream(mode_e_stream_t *s)
+{
+	mode_e_xfer_t *x = s->xfer;
+	unsigned char *buf;
+	unsigned long long off;
+	unsigned int len;
+	SceUInt64 t;
+	int n;
+
+	buf = mem_alloc(FTPVITA_MEM_XFER, MODE_E_HEADER_SIZE + MODE_E_BLOCK_SIZE);
+	if (buf == NULL) {
+		mode_e_fail(x);
+		return;
+	}
+
+	while (!mode_e_failed(x)) {
+		off = __atomic_fetch_add(&x->next, MODE_E_BLOCK_SIZE, __ATOMIC_RELAXED);
+		if (off >= x->end)
+			break;
+		len = x->end - off < MODE_E_BLOCK_SIZE ? x->end - off : MODE_E_BLOCK_SIZE;
+
+		t = sceKernelGetProcessTimeWide();
+		n = sceIoPread(x->fd, buf + MODE_E_HEADER_SIZE, len, off);
+		stat_io(x->dev, IO_OP_READ, n > 0 ? n : 0, sceKernelGetProcessTimeWide() - t);
+		/* A short read would leave a hole in the file */
+		if (n != len) {
+			mode_e_fail(x);
+			break;
+		}
+
+		mode_e_header(buf, 0, len, off);
+		/* A short send would cut the block and desync the stream */
+		if (send_all(s->sockfd, buf, MODE_E_HEADER_SIZE + len) < 0) {
+			mode_e_fail(x);
+			break;
+		}
+		STAT_ADD(bytes_sent, len);
+		__atomic_fetch_add(&x->client->bytes_sent, len, __ATOMIC_RELAXED);
+	}
+
+	mem_free(buf);
+}
+
+#if FTPVITA_FEATURE_WRITE
+static unsigned long long mode_e_field(const unsigned char *p)
+{
+	unsigned long long v = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+static int recv_all(int sockfd, void *buf, unsigned int len)
+{
+	unsigned int done = 0;
+	int ret;
+
+	while (done < len) {
+		ret = sceNetRecv(sockfd, (char *)buf + done, len - done, 0);
+		if (ret <= 0)
+			return -1;
+		done += ret;
+	}
+	return 0;
+}
+
+/* Writes the blocks of the connection until its EOD block */
+static void mode_e_recv_stream(mode_e_stream_t *s)
+{
+	mode_e_xfer_t *x = s->xfer;
+	unsigned char hdr[MODE_E_HEADER_SIZE];
+	unsigned char *buf;
+	unsigned long long count, off;
+	unsigned int len;
+	SceUInt64 t;
+	int desc;
+
+	buf = mem_alloc(FTPVITA_MEM_XFER, MODE_E_BLOCK_SIZE);
+	if (buf == NULL) {
+		mode_e_fail(x);
+		return;
+	}
+
+	while (!mode_e_failed(x)) {
+		if (recv_all(s->sockfd, hdr, sizeof(hdr)) < 0) {
+			mode_e_fail(x);
+			break;
+		}
+		desc = hdr[0];
+		count = mode_e_field(hdr + 1);
+		off = mode_e_field(hdr + 9);
+
+		if (desc & MODE_E_DESC_EOF) {
+			/* The offset is the number of connections, no data */
+			if (count != 0) {
+				mode_e_fail(x);
+				break;
+			}
+			x->eodc = off;
+		}
+
+		while (count > 0) {
+			len = count < MODE_E_BLOCK_SIZE ? count : MODE_E_BLOCK_SIZE;
+			if (recv_all(s->sockfd, buf, len) < 0) {
+				mode_e_fail(x);
+				goto out;
+			}
+			STAT_ADD(bytes_received, len);
+			__atomic_fetch_add(&x->client->bytes_received, len, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&x->bytes, len, __ATOMIC_RELAXED);
+
+			t = sceKernelGetProcessTimeWide();
+			if (sceIoPwrite(x->fd, buf, len, off) != len) {
+				mode_e_fail(x);
+				goto out;
+			}
+			stat_io(x->dev, IO_OP_WRITE, len, sceKernelGetProcessTimeWide() - t);
+
+			off += len;
+			count -= len;
+		}
+
+		if (desc & MODE_E_DESC_EOD) {
+			__atomic_fetch_add(&x->eods, 1, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+out:
+	mem_free(buf);
+}
+#endif
+
+static int mode_e_stream_thread(SceSize args, void *argp)
+{
+	mode_e_stream_t *s = *(mode_e_stream_t **)argp;
+
+	s->xfer->func(s);
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+/* Accepts a connection on the PASV socket, made non-blocking by the
+ * caller, giving up at the deadline */
+static int mode_e_accept(int sockfd, SceUInt64 deadline)
+{
+	SceNetSockaddrIn addr;
+	unsigned int addrlen;
+	int ret, nbio = 0;
+
+	while (1) {
+		addrlen = sizeof(addr);
+		ret = sceNetAccept(sockfd, (SceNetSockaddr *)&addr, &addrlen);
+		if (ret != SCE_NET_ERROR_EWOULDBLOCK)
+			break;
+		if (sceKernelGetProcessTimeWide() >= deadline)
+			return -1;
+		sceKernelDelayThread(10*1000);
+	}
+
+	/* The new socket inherits the listening socket's mode */
+	if (ret >= 0)
+		sceNetSetsockopt(ret, SCE_NET_SOL_SOCKET, SCE_NET_SO_NBIO, &nbio, sizeof(nbio));
+	return ret;
+}
+
+/* Opens the data connections of a MODE E transfer: the client connects
+ * parallelism times to the PASV port, or we connect as many times to
+ * its PORT address. Returns how many were opened */
+static int mode_e_open_streams(ftpvita_client_info_t *client)
+{
+	SceUInt64 deadline;
+	char name[64];
+	int i, sockfd, nbio = 1;
+
+	client_open_data_connection(client);
+	client->stream_sockfd[0] = client->data_con_type == FTP_DATA_CONNECTION_ACTIVE ?
+		client->data_sockfd : client->pasv_sockfd;
+	client->n_streams = 1;
+	deadline = sceKernelGetProcessTimeWide() + FTPVITA_MODE_E_ACCEPT_TIMEOUT;
+
+	/* Carry on with the connections made if the client opens fewer */
+	if (client->data_con_type == FTP_DATA_CONNECTION_PASSIVE && client->parallelism > 1)
+		sceNetSetsockopt(client->data_sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_NBIO,
+			&nbio, sizeof(nbio));
+
+	for (i = 1; i < client->parallelism; i++) {
+		if (client->data_con_type == FTP_DATA_CONNECTION_ACTIVE) {
+			sprintf(name, "FTPVita_client_%i_stream_%i", client->num, i);
+			sockfd = sceNetSocket(name, SCE_NET_AF_INET, SCE_NET_SOCK_STREAM, 0);
+			if (sockfd >= 0 && sceNetConnect(sockfd, (SceNetSockaddr *)&client->data_sockaddr,
+			    sizeof(client->data_sockaddr)) < 0) {
+				sceNetSocketClose(sockfd);
+				sockfd = -1;
+			}
+		} else {
+			sockfd = mode_e_accept(client->data_sockfd, deadline);
+		}
+		if (sockfd < 0)
+			break;
+		client->stream_sockfd[client->n_streams++] = sockfd;
+	}
+
+	DEBUG("MODE E: %i data connections\n", client->n_streams);
+
+	return client->n_streams;
+}
+
+static void mode_e_close_streams(ftpvita_client_info_t *client)
+{
+	int i;
+
+	/* The first one is the usual data connection */
+	for (i = 1; i < client->n_streams; i++)
+		sceNetSocketClose(client->stream_sockfd[i]);
+	client->n_streams = 0;
+
+	client_close_data_connection(client);
+}
+
+/* Runs x->func on every data connection, the first one in this thread */
+static void mode_e_run(mode_e_xfer_t *x)
+{
+	ftpvita_client_info_t *client = x->client;
+	mode_e_stream_t streams[FTPVITA_MAX_STREAMS], *sp;
+	SceUID thids[FTPVITA_MAX_STREAMS];
+	int i;
+
+	for (i = 0; i < client->n_streams; i++) {
+		streams[i].xfer = x;
+		streams[i].sockfd = client->stream_sockfd[i];
+	}
+
+	for (i = 1; i < client->n_streams; i++) {
+		sp = &streams[i];
+		thids[i] = sceKernelCreateThread("FTPVita_stream_thread",
+			mode_e_stream_thread, 0x10000100, 0x4000, 0, 0, NULL);
+		if (thids[i] >= 0 && sceKernelStartThread(thids[i], sizeof(sp), &sp) < 0) {
+			sceKernelDeleteThread(thids[i]);
+			thids[i] = -1;
+		}
+		/* Nobody would read or write that connection, and the
+		 * client may block on it: abort the whole transfer */
+		if (thids[i] < 0)
+			mode_e_fail(x);
+	}
+
+	x->func(&streams[0]);
+
+	for (i = 1; i < client->n_streams; i++) {
+		if (thids[i] >= 0)
+			sceKernelWaitThreadEnd(thids[i], NULL, NULL);
+	}
+}
+
+static void mode_e_send_file(ftpvita_client_info_t *client, const char *path, SceUID fd)
+{
+	unsigned char hdr[MODE_E_HEADER_SIZE];
+	mode_e_xfer_t x;
+	SceIoStat stat;
+	char msg[128];
+	int i;
+	SceUInt64 start = sceKernelGetProcessTimeWide();
+	unsigned long long sent = client->bytes_sent;
+
+	if (sceIoGetstatByFd(fd, &stat) < 0) {
+		sceIoClose(fd);
+		client_send_ctrl_msg(client, "550 Could not get file status." FTPVITA_EOL);
+		return;
+	}
+
+	memset(&x, 0, sizeof(x));
+	x.client = client;
+	x.fd = fd;
+	x.dev = device_index(path);
+	x.next = client->restore_point;
+	x.end = stat.st_size;
+	x.func = mode_e_send_stream;
+
+	mode_e_open_streams(client);
+	snprintf(msg, sizeof(msg), "150 Opening extended block mode data transfer"
+		" on %i connections." FTPVITA_EOL, client->n_streams);
+	client_send_ctrl_msg(client, msg);
+	client_set_xfer_path(client, path);
+
+	mode_e_run(&x);
+
+	/* Only announce the EOF once every block went out */
+	for (i = 0; i < client->n_streams && !x.failed; i++) {
+		if (i == 0)
+			mode_e_header(hdr, MODE_E_DESC_EOF | MODE_E_DESC_EOD | MODE_E_DESC_CLOSE,
+				0, client->n_streams);
+		else
+			mode_e_header(hdr, MODE_E_DESC_EOD | MODE_E_DESC_CLOSE, 0, 0);
+		if (send_all(client->stream_sockfd[i], hdr, sizeof(hdr)) < 0)
+			x.failed = 1;
+	}
+
+	client_set_xfer_path(client, NULL);
+	sceIoClose(fd);
+	client->restore_point = 0;
+	xferlog_post(client, path, 'o', client->bytes_sent - sent, start, !x.failed);
+	if (!x.failed) {
+		STAT_INC(files_sent);
+		client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+	}
+	mode_e_close_streams(client);
+}
+
+#if FTPVITA_FEATURE_WRITE
+static void mode_e_receive_file(ftpvita_client_info_t *client, const char *path, SceUID fd)
+{
+	mode_e_xfer_t x;
+	char msg[128];
+	int complete;
+	SceUInt64 start = sceKernelGetProcessTimeWide();
+
+	memset(&x, 0, sizeof(x));
+	x.client = client;
+	x.fd = fd;
+	x.dev = device_index(path);
+	x.eodc = -1;
+	x.func = mode_e_recv_stream;
+
+	mode_e_open_streams(client);
+	snprintf(msg, sizeof(msg), "150 Opening extended block mode data transfer"
+		" on %i connections." FTPVITA_EOL, client->n_streams);
+	client_send_ctrl_msg(client, msg);
+	client_set_xfer_path(client, path);
+
+	mode_e_run(&x);
+
+	client_set_xfer_path(client, NULL);
+	sceIoClose(fd);
+	client->restore_point = 0;
+	cache_invalidate(path);
+
+	/* Complete when every connection got its EOD, as the EOF said */
+	complete = !x.failed && x.eodc == client->n_streams && x.eods == x.eodc;
+	xferlog_post(client, path, 'i', x.bytes, start, complete);
+	if (complete) {
+		STAT_INC(files_received);
+		client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
+#if FTPVITA_FEATURE_EVENTS
+		/* The blocks came in any order, so no hash */
+		event_post_upload(client, path, x.bytes, 0, 0);
+#endif
+	} else {
+		sceIoRemove(path);
+		client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+	}
+	mode_e_close_streams(client);
+}
+#endif
+#endif
+
+/* TYPE A: the file's line endings are sent as CRLF and the received
+ * CRLFs are stored as LF. Line ends that already are CRLF in the file
+ * are sent as they are, and lone CRs are kept both ways. The state
+ * carries a CR seen at the end of a buffer over to the next one. */
+typedef struct {
+	int cr;
+} ascii_state_t;
+
+/* Returns the first c in [p, end), or end. Scans 16 bytes at a time */
+static const unsigned char *scan_byte(const unsigned char *p, const unsigned char *end,
+				      unsigned char c)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	uint8x16_t needle = vdupq_n_u8(c);
+	uint8x16_t eq;
+	uint8x8_t any;
+
+	for (; end - p >= 16; p += 16) {
+		eq = vceqq_u8(vld1q_u8(p), needle);
+		any = vorr_u8(vget_low_u8(eq), vget_high_u8(eq));
+		if (vget_lane_u64(vreinterpret_u64_u8(any), 0))
+			break;
+	}
+	/* The rest, or the 16 bytes where it is */
+	while (p < end && *p != c)
+		p++;
+	return p;
+#elif defined(__SSE2__)
+	__m128i needle = _mm_set1_epi8(c);
+	int mask;
+
+	for (; end - p >= 16; p += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)p), needle));
+		if (mask)
+			return p + __builtin_ctz(mask);
+	}
+	while (p < end && *p != c)
+		p++;
+	return p;
+#else
+	const unsigned char *found = memchr(p, c, end - p);
+	return found ? found : end;
+#endif
+}
+
+/* LF -> CRLF. The output can be up to twice the input and may overlap
+ * it as long as out <= in - len, see send_read_off() */
+static unsigned int ascii_encode(ascii_state_t *st, const unsigned char *in, unsigned int len,
+				 unsigned char *out)
+{
+	const unsigned char *start = in, *end = in + len, *lf;
+	unsigned char *o = out;
+	int cr;
+
+	while (in < end) {
+		lf = scan_byte(in, end, '\n');
+		memmove(o, in, lf - in);
+		o += lf - in;
+		if (lf == end)
+			break;
+
+		cr = lf > start ? lf[-1] == '\r' : st->cr;
+		if (!cr)
+			*o++ = '\r';
+		*o++ = '\n';
+		in = lf + 1;
+	}
+
+	if (len > 0)
+		st->cr = end[-1] == '\r';
+	return o - out;
+}
+
+#if FTPVITA_FEATURE_WRITE
+/* CRLF -> LF. The output is at most the input plus a CR held from the
+ * last buffer, so out can be in - 1. A CR at the end of the input is
+ * held until the next buffer tells whether it's part of a CRLF */
+static unsigned int ascii_decode(ascii_state_t *st, const unsigned char *in, unsigned int len,
+				 unsigned char *out)
+{
+	const unsigned char *end = in + len, *cr;
+	unsigned char *o = out;
+
+	if (len == 0)
+		return 0;
+
+	if (st->cr) {
+		if (in[0] != '\n')
+			*o++ = '\r';
+		st->cr = 0;
+	}
+
+	while (in < end) {
+		cr = scan_byte(in, end, '\r');
+		memmove(o, in, cr - in);
+		o += cr - in;
+		if (cr == end)
+			break;
+
+		if (cr + 1 == end) {
+			st->cr = 1;
+			break;
+		}
+		if (cr[1] != '\n')
+			*o++ = '\r';
+		in = cr + 1;
+	}
+
+	return o - out;
+}
+#endif
+
+/* In ASCII mode the file is read into the upper half of the buffer,
+ * so it can be encoded into the buffer from its start */
+static inline unsigned int send_read_off(const xfer_buf_t *buf, const ascii_state_t *ascii)
+{
+	return ascii ? buf->size / 2 : 0;
+}
+
+/* Sends len bytes read at send_read_off(), returns < 0 if the send failed */
+static int send_block(ftpvita_client_info_t *client, xfer_buf_t *buf, unsigned int len,
+		      ascii_state_t *ascii)
+{
+	unsigned char *data = buf->data + send_read_off(buf, ascii);
+
+	if (ascii) {
+		len = ascii_encode(ascii, data, len, buf->data);
+		data = buf->data;
+	}
+
+	if (client_send_data_raw(client, data, len) < 0)
+		return -1;
+	STAT_ADD(bytes_sent, len);
+	__atomic_fetch_add(&client->bytes_sent, len, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* Async storage I/O: the card reads (or writes) one buffer in the
+ * background while the other is sent (or received), so the transfer
+ * runs at the speed of the slowest of the two instead of their sum.
+ * Returns 0 when done, -1 if the transfer must go on blocking from
+ * the current file offset and -2 if it failed */
+static int send_file_data_async(ftpvita_client_info_t *client, SceUID fd, int dev,
+				xfer_buf_t *buf0, xfer_buf_t *buf1, ascii_state_t *ascii)
+{
+	xfer_buf_t *bufs[2] = {buf0, buf1};
+	SceInt64 res;
+	SceUInt64 t;
+	int cur = 0;
+	int pending;
+	unsigned int off;
+
+	t = sceKernelGetProcessTimeWide();
+	off = send_read_off(bufs[cur], ascii);
+	if (sceIoReadAsync(fd, bufs[cur]->data + off, bufs[cur]->size - off) < 0)
+		return -1;
+
+	while (1) {
+		if (sceIoWaitAsync(fd, &res) < 0)
+			res = -1;
+		stat_io(dev, IO_OP_READ, res > 0 ? res : 0, sceKernelGetProcessTimeWide() - t);
+		if (res <= 0)
+			return res < 0 ? -2 : 0;
+
+		/* Read the next block while this one is sent */
+		t = sceKernelGetProcessTimeWide();
+		off = send_read_off(bufs[cur ^ 1], ascii);
+		pending = sceIoReadAsync(fd, bufs[cur ^ 1]->data + off,
+			bufs[cur ^ 1]->size - off) >= 0;
+
+		if (send_block(client, bufs[cur], res, ascii) < 0) {
+			/* The buffer can't be given back with a read in flight */
+			if (pending)
+				sceIoWaitAsync(fd, &res);
+			return -2;
+		}
+
+		if (!pending)
+			return -1;
+		cur ^= 1;
+	}
+}
+
+/* Copies the file, from its current offset to the end, to the data
+ * connection. This is the file-to-socket operation of the server: a
+ * platform with a zero-copy call (like sendfile(2)) would use it here,
+ * the PSVita has none so the data goes through the transfer buffer.
+ * Returns 0 once the whole file is sent, < 0 if reading or sending failed */
+static int send_file_data(ftpvita_client_info_t *client, SceUID fd, int dev, xfer_buf_t *buf,
+			  ascii_state_t *ascii)
+{
+	xfer_buf_t *buf2;
+	int bytes_read;
+	unsigned int off = send_read_off(buf, ascii);
+	SceUInt64 t;
+
+	if (io_mode == FTPVITA_IO_ASYNC && (buf2 = xfer_buf_get()) != NULL) {
+		bytes_read = send_file_data_async(client, fd, dev, buf, buf2, ascii);
+		xfer_buf_put(buf2);
+		if (bytes_read != -1)
+			return bytes_read;
+		STAT_INC(io_async_fallbacks);
+	}
+
+	while (1) {
+		t = sceKernelGetProcessTimeWide();
+		bytes_read = sceIoRead(fd, buf->data + off, buf->size - off);
+		stat_io(dev, IO_OP_READ, bytes_read > 0 ? bytes_read : 0,
+			sceKernelGetProcessTimeWide() - t);
+		if (bytes_read <= 0)
+			return bytes_read;
+		if (send_block(client, buf, bytes_read, ascii) < 0)
+			return -1;
+	}
+}
+
+static void send_file(ftpvita_client_info_t *client, const char *path)
+{
+	xfer_buf_t *buf;
+	SceUID fd;
+	int dev = device_index(path);
+	SceUInt64 start = sceKernelGetProcessTimeWide();
+	unsigned long long sent = client->bytes_sent;
+	ascii_state_t ascii = {0};
+	/* Start of the file already in memory */
+	unsigned char *ahead = NULL;
+	unsigned int ahead_len = 0;
+	int ret = 0;
+
+	DEBUG("Opening: %s\n", path);
+
+	if ((fd = sceIoOpen(path, SCE_O_RDONLY, 0777)) >= 0) {
+
+#if FTPVITA_FEATURE_MODE_E
+		if (client->mode_e) {
+			mode_e_send_file(client, path, fd);
+			return;
+		}
+#endif
+
+#if FTPVITA_FEATURE_PREFETCH
+		/* The read-ahead is sent as is, so only in binary mode */
+		if (!client->type_ascii)
+			ahead_len = prefetch_take(path, fd, &ahead);
+		if (ahead_len <= client->restore_point) {
+			mem_free(ahead);
+			ahead = NULL;
+			ahead_len = 0;
+		}
+		prefetch_predict(client, path);
+#endif
+
+		sceIoLseek32(fd, ahead ? ahead_len : client->restore_point, SCE_SEEK_SET);
+
+		buf = xfer_buf_get();
+		if (buf == NULL) {
+			sceIoClose(fd);
+			mem_free(ahead);
+			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+			return;
+		}
+
+		client_open_data_connection(client);
+		client_send_ctrl_msg(client, client->type_ascii ?
+			"150 Opening ASCII mode data transfer." FTPVITA_EOL :
+			"150 Opening Image mode data transfer." FTPVITA_EOL);
+		client_set_xfer_path(client, path);
+
+		if (ahead) {
+			ret = client_send_data_raw(client, ahead + client->restore_point,
+				ahead_len - client->restore_point);
+			if (ret == 0) {
+				STAT_ADD(bytes_sent, ahead_len - client->restore_point);
+				STAT_ADD(prefetch_bytes, ahead_len - client->restore_point);
+				__atomic_fetch_add(&client->bytes_sent, ahead_len - client->restore_point,
+					__ATOMIC_RELAXED);
+			}
+			mem_free(ahead);
+		}
+
+		if (ret == 0)
+			ret = send_file_data(client, fd, dev, buf, client->type_ascii ? &ascii : NULL);
+
+		client_set_xfer_path(client, NULL);
+		sceIoClose(fd);
+		xfer_buf_put(buf);
+		xferlog_post(client, path, 'o', client->bytes_sent - sent, start, ret == 0);
+		client->restore_point = 0;
+		if (ret == 0) {
+			STAT_INC(files_sent);
+			client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
+		} else {
+			client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+		}
+		client_close_data_connection(client);
+
+	} else {
+		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	}
+}
+
+/* Generates an FTP full-path from a path relative to cur_path or absolute */
+static void gen_fullpath(const char *cur_path, const char *cmd_path, char *path, size_t path_size)
+{
+	if (cmd_path[0] == '/') {
+		/* Full path */
+		strncpy(path, cmd_path, path_size);
+	} else {
+		if (strlen(cmd_path) >= 5 && cmd_path[3] == ':' && cmd_path[4] == '/') {
+			/* Case "ux0:/foo */
+			snprintf(path, path_size, "/%s", cmd_path);
+		} else {
+			/* The file is relative to current dir, so
+			 * append the file to the current path */
+			snprintf(path, path_size, "%s/%s", cur_path, cmd_path);
+		}
+	}
+}
+
+/* This function generates an FTP full-path with the input path (relative or absolute)
+ * from RETR, STOR, DELE, RMD, MKD, RNFR and RNTO commands */
+static void gen_ftp_fullpath(ftpvita_client_info_t *client, char *path, size_t path_size)
+{
+	char cmd_path[PATH_MAX];
+	sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+	gen_fullpath(client->cur_path, cmd_path, path, path_size);
+}
+
+#if FTPVITA_FEATURE_METRICS
+/* Metrics in the Prometheus text exposition format, available
+ * through RETR of METRICS_PATH, SITE STATS and the optional HTTP
+ * endpoint. Everything is read from the atomic counters. */
+
+typedef struct {
+	char *buf;
+	unsigned int size;
+	unsigned int len;
+	/* Out of memory, the text is incomplete */
+	int failed;
+} metrics_buf_t;
+
+/* Appends to the text, growing the buffer when it doesn't fit: a
+ * truncated line would make the whole exposition invalid */
+static void metrics_printf(metrics_buf_t *mb, const char *s, ...)
+{
+	va_list argptr;
+	unsigned int size;
+	char *buf;
+	int n;
+
+	if (mb->failed)
+		return;
+
+	while (1) {
+		va_start(argptr, s);
+		n = vsnprintf(mb->buf + mb->len, mb->size - mb->len, s, argptr);
+		va_end(argptr);
+		if (n < 0) {
+			mb->failed = 1;
+			return;
+		}
+		if ((unsigned int)n < mb->size - mb->len)
+			break;
+
+		for (size = mb->size * 2; size - mb->len <= (unsigned int)n; size *= 2)
+			;
+		buf = mem_realloc(FTPVITA_MEM_METRICS, mb->buf, size);
+		if (buf == NULL) {
+			mb->failed = 1;
+			return;
+		}
+		mb->buf = buf;
+		mb->size = size;
+	}
+
+	mb->len += n;
+}
+
+static void metrics_counter(metrics_buf_t *mb, const char *name, const char *help,
+			    unsigned long long value)
+{
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+		name, help, name, name, value);
+}
+
+static void metrics_latency(metrics_buf_t *mb, int dev, int op)
+{
+	static const char *op_name[IO_OP_MAX] = {"read", "write"};
+	const io_latency_hist_t *hist = &stats.io_latency[dev][op];
+	const char *devname = device_list[dev].name;
+	unsigned long long sum_us;
+	unsigned int cumulative = 0;
+	int i;
+
+	for (i = 0; i < IO_LATENCY_BUCKETS - 1; i++) {
+		cumulative += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+		metrics_printf(mb,
+			"ftpvita_io_latency_seconds_bucket{device=\"%s\",op=\"%s\",le=\"%u.%06u\"} %u\n",
+			devname, op_name[op],
+			io_latency_bounds_us[i] / 1000000, io_latency_bounds_us[i] % 1000000,
+			cumulative);
+	}
+	cumulative += __atomic_load_n(&hist->bucket[i], __ATOMIC_RELAXED);
+
+	sum_us = __atomic_load_n(&hist->sum_us, __ATOMIC_RELAXED);
+	metrics_printf(mb,
+		"ftpvita_io_latency_seconds_bucket{device=\"%s\",op=\"%s\",le=\"+Inf\"} %u\n"
+		"ftpvita_io_latency_seconds_sum{device=\"%s\",op=\"%s\"} %llu.%06llu\n"
+		"ftpvita_io_latency_seconds_count{device=\"%s\",op=\"%s\"} %u\n",
+		devname, op_name[op], cumulative,
+		devname, op_name[op], sum_us / 1000000, sum_us % 1000000,
+		devname, op_name[op], __atomic_load_n(&hist->count, __ATOMIC_RELAXED));
+}
+
+/* Generates the metrics into a buffer the caller frees with mem_free().
+ * Returns their length, or < 0 without memory */
+static int gen_metrics(char **out)
+{
+	metrics_buf_t mb;
+	SceNetStatisticsInfo net_info;
+	unsigned int n;
+	int i, op;
+
+	mb.buf = mem_alloc(FTPVITA_MEM_METRICS, METRICS_BUF_SIZE);
+	if (mb.buf == NULL)
+		return -1;
+	mb.size = METRICS_BUF_SIZE;
+	mb.len = 0;
+	mb.failed = 0;
+	mb.buf[0] = '\0';
+
+	metrics_counter(&mb, "ftpvita_bytes_sent_total",
+		"Bytes sent over data connections.", STAT_LOAD(bytes_sent));
+	metrics_counter(&mb, "ftpvita_bytes_received_total",
+		"Bytes received over data connections.", STAT_LOAD(bytes_received));
+	metrics_counter(&mb, "ftpvita_files_sent_total",
+		"Files sent to clients.", STAT_LOAD(files_sent));
+	metrics_counter(&mb, "ftpvita_files_received_total",
+		"Files received from clients.", STAT_LOAD(files_received));
+	metrics_counter(&mb, "ftpvita_sessions_accepted_total",
+		"Control connections accepted.", STAT_LOAD(sessions_accepted));
+	metrics_counter(&mb, "ftpvita_sessions_rejected_total",
+		"Control connections rejected by the session limits.", STAT_LOAD(sessions_rejected));
+	metrics_counter(&mb, "ftpvita_commands_total",
+		"Control commands received.", STAT_LOAD(commands));
+	metrics_counter(&mb, "ftpvita_commands_unknown_total",
+		"Control commands not implemented.", STAT_LOAD(commands_unknown));
+	metrics_counter(&mb, "ftpvita_events_dropped_total",
+		"Events dropped because the event queue was full.", STAT_LOAD(events_dropped));
+#if FTPVITA_FEATURE_XFERLOG
+	metrics_counter(&mb, "ftpvita_xferlog_dropped_total",
+		"Transfer log lines lost.", STAT_LOAD(xferlog_dropped));
+#endif
+	metrics_counter(&mb, "ftpvita_io_async_fallbacks_total",
+		"Transfers that fell back to blocking storage I/O.", STAT_LOAD(io_async_fallbacks));
+#if FTPVITA_FEATURE_PREFETCH
+	metrics_counter(&mb, "ftpvita_prefetch_hits_total",
+		"RETRs that started from read-ahead data.", STAT_LOAD(prefetch_hits));
+	metrics_counter(&mb, "ftpvita_prefetch_misses_total",
+		"RETRs without read-ahead data.", STAT_LOAD(prefetch_misses));
+	metrics_counter(&mb, "ftpvita_prefetch_wasted_total",
+		"Read-ahead files dropped without being used.", STAT_LOAD(prefetch_wasted));
+	metrics_counter(&mb, "ftpvita_prefetch_bytes_total",
+		"Bytes sent from read-ahead data.", STAT_LOAD(prefetch_bytes));
+#endif
+#if FTPVITA_FEATURE_THUMBS
+	metrics_counter(&mb, "ftpvita_thumb_hits_total",
+		"Thumbnails served from the disk cache.", STAT_LOAD(thumb_hits));
+	metrics_counter(&mb, "ftpvita_thumb_misses_total",
+		"Thumbnails that had to be generated.", STAT_LOAD(thumb_misses));
+#endif
+#if FTPVITA_FEATURE_DIR_CACHE
+	metrics_counter(&mb, "ftpvita_dir_cache_hits_total",
+		"Directory cache hits.", STAT_LOAD(dir_cache_hits));
+	metrics_counter(&mb, "ftpvita_dir_cache_misses_total",
+		"Directory cache misses.", STAT_LOAD(dir_cache_misses));
+	metrics_counter(&mb, "ftpvita_dir_cache_stale_total",
+		"Directory cache entries changed on the device by someone else.",
+		STAT_LOAD(dir_cache_stale));
+#endif
+
+	metrics_printf(&mb,
+		"# HELP ftpvita_error_replies_total Error replies sent, by reply code.\n"
+		"# TYPE ftpvita_error_replies_total counter\n");
+	for (i = 0; i < 200; i++) {
+		n = STAT_LOAD(error_replies[i]);
+		if (n > 0)
+			metrics_printf(&mb, "ftpvita_error_replies_total{code=\"%d\"} %u\n",
+				i + 400, n);
+	}
+
+	metrics_printf(&mb,
+		"# HELP ftpvita_active_sessions Connected control sessions.\n"
+		"# TYPE ftpvita_active_sessions gauge\n"
+		"ftpvita_active_sessions %d\n"
+		"# HELP ftpvita_transfer_buffers Transfer buffers in the pool.\n"
+		"# TYPE ftpvita_transfer_buffers gauge\n"
+		"ftpvita_transfer_buffers{state=\"in_use\"} %u\n"
+		"ftpvita_transfer_buffers{state=\"idle\"} %u\n",
+		__atomic_load_n(&number_clients, __ATOMIC_RELAXED),
+		STAT_LOAD(buffers_in_use), STAT_LOAD(buffers_idle));
+
+	if (sceNetGetStatisticsInfo(&net_info, 0) >= 0) {
+		metrics_printf(&mb,
+			"# HELP ftpvita_net_pool_free_bytes Free memory in the network pool.\n"
+			"# TYPE ftpvita_net_pool_free_bytes gauge\n"
+			"ftpvita_net_pool_free_bytes %d\n"
+			"# HELP ftpvita_net_pool_free_min_bytes Lowest free memory seen in the network pool.\n"
+			"# TYPE ftpvita_net_pool_free_min_bytes gauge\n"
+			"ftpvita_net_pool_free_min_bytes %d\n",
+			net_info.libnet_mem_free_size, net_info.libnet_mem_free_min);
+	}
+
+	metrics_printf(&mb,
+		"# HELP ftpvita_memory_bytes Memory allocated by the library.\n"
+		"# TYPE ftpvita_memory_bytes gauge\n");
+	for (i = 0; i < FTPVITA_MEM_TAG_MAX; i++)
+		metrics_printf(&mb, "ftpvita_memory_bytes{tag=\"%s\"} %u\n", mem_tag_names[i],
+			__atomic_load_n(&mem_stats[i].current, __ATOMIC_RELAXED));
+	metrics_printf(&mb,
+		"# HELP ftpvita_memory_peak_bytes Most memory allocated by the library at once.\n"
+		"# TYPE ftpvita_memory_peak_bytes gauge\n");
+	for (i = 0; i < FTPVITA_MEM_TAG_MAX; i++)
+		metrics_printf(&mb, "ftpvita_memory_peak_bytes{tag=\"%s\"} %u\n", mem_tag_names[i],
+			__atomic_load_n(&mem_stats[i].peak, __ATOMIC_RELAXED));
+
+	metrics_printf(&mb,
+		"# HELP ftpvita_io_latency_seconds Device I/O call latency.\n"
+		"# TYPE ftpvita_io_latency_seconds histogram\n");
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (!device_list[i].valid)
+			continue;
+		for (op = 0; op < IO_OP_MAX; op++)
+			metrics_latency(&mb, i, op);
+	}
+
+	if (mb.failed) {
+		mem_free(mb.buf);
+		return -1;
+	}
+
+	*out = mb.buf;
+	return mb.len;
+}
+
+static void send_metrics(ftpvita_client_info_t *client)
+{
+	char *buffer;
+	int len;
+
+	len = gen_metrics(&buffer);
+	if (len < 0) {
+		client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for metrics." FTPVITA_EOL);
+	client_open_data_connection(client);
+	client_send_data_raw(client, buffer, len);
+	client_close_data_connection(client);
+	client_send_ctrl_msg(client, "226 Transfer complete." FTPVITA_EOL);
+
+	mem_free(buffer);
+}
+#endif
+
+static void cmd_RETR_func(ftpvita_client_info_t *client)
+{
+	char dest_path[PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+
+#if FTPVITA_FEATURE_METRICS
+	if (strcmp(dest_path, METRICS_PATH) == 0) {
+		send_metrics(client);
+		return;
+	}
+#endif
+
+	send_file(client, get_vita_path(dest_path));
+}
+
+#if FTPVITA_FEATURE_WRITE
+/* Accounts for bytes_recv bytes received at the start of the buffer,
+ * or after its first byte in ASCII mode. Returns how many bytes are to
+ * be written from the start of the buffer */
+static int receive_block(ftpvita_client_info_t *client, xfer_buf_t *buf, int bytes_recv,
+			 ascii_state_t *ascii, unsigned int *crc, unsigned long long *total)
+{
+	int len = bytes_recv;
+
+	STAT_ADD(bytes_received, bytes_recv);
+	__atomic_fetch_add(&client->bytes_received, bytes_recv, __ATOMIC_RELAXED);
+
+	if (ascii)
+		len = ascii_decode(ascii, buf->data + 1, bytes_recv, buf->data);
+
+	*total += len;
+#if FTPVITA_FEATURE_HASH
+	if (crc)
+		*crc = crc32_update(*crc, buf->data, len);
+#endif
+	return len;
+}
+
+/* Result of receive_file_data() when the file couldn't be written */
+#define RECV_WRITE_FAILED -1
+
+/* Receives the data connection into the file until it's closed, ascii
+ * is NULL in binary mode. crc, if not NULL, is updated with the data.
+ * Returns the last receive result: 0 if the client closed the
+ * connection, < 0 on errors, or RECV_WRITE_FAILED */
+static int receive_file_data(ftpvita_client_info_t *client, SceUID fd, int dev, xfer_buf_t *buf,
+			     ascii_state_t *ascii, unsigned int *crc, unsigned long long *total)
+{
+	xfer_buf_t *bufs[2] = {buf, NULL};
+	int async = io_mode == FTPVITA_IO_ASYNC;
+	/* Room for a CR held from the previous buffer */
+	int off = ascii ? 1 : 0;
+	int bytes_recv, len;
+	int pending = 0;
+	int cur = 0;
+	SceInt64 res;
+	SceUInt64 t = 0;
+	int written;
+
+	if (async && (bufs[1] = xfer_buf_get()) == NULL)
+		async = 0;
+
+	while ((bytes_recv = client_recv_data_raw(client, bufs[cur]->data + off,
+						  bufs[cur]->size - off)) > 0) {
+		len = receive_block(client, bufs[cur], bytes_recv, ascii, crc, total);
+		if (len == 0)
+			continue;
+
+		/* The previous block was written in the background meanwhile */
+		if (pending) {
+			if (sceIoWaitAsync(fd, &res) < 0)
+				res = -1;
+			stat_io(dev, IO_OP_WRITE, res > 0 ? res : 0, sceKernelGetProcessTimeWide() - t);
+			written = res == pending;
+			pending = 0;
+			if (!written) {
+				bytes_recv = RECV_WRITE_FAILED;
+				break;
+			}
+		}
+
+		t = sceKernelGetProcessTimeWide();
+		if (async && sceIoWriteAsync(fd, bufs[cur]->data, len) >= 0) {
+			pending = len;
+			cur ^= 1;
+			continue;
+		}
+		if (async) {
+			/* No async I/O here, go on blocking */
+			STAT_INC(io_async_fallbacks);
+			async = 0;
+		}
+
+		written = sceIoWrite(fd, bufs[cur]->data, len);
+		stat_io(dev, IO_OP_WRITE, written > 0 ? written : 0, sceKernelGetProcessTimeWide() - t);
+		if (written != len) {
+			bytes_recv = RECV_WRITE_FAILED;
+			break;
+		}
+	}
+
+	if (pending) {
+		if (sceIoWaitAsync(fd, &res) < 0)
+			res = -1;
+		stat_io(dev, IO_OP_WRITE, res > 0 ? res : 0, sceKernelGetProcessTimeWide() - t);
+		if (res != pending && bytes_recv == 0)
+			bytes_recv = RECV_WRITE_FAILED;
+	}
+
+	/* The file ends with a lone CR */
+	if (bytes_recv == 0 && ascii && ascii->cr) {
+		if (sceIoWrite(fd, "\r", 1) == 1)
+			(*total)++;
+		else
+			bytes_recv = RECV_WRITE_FAILED;
+	}
+
+	if (bufs[1])
+		xfer_buf_put(bufs[1]);
+
+	return bytes_recv;
+}
+
+static void receive_file(ftpvita_client_info_t *client, const char *path)
+{
+	xfer_buf_t *buf;
+	SceUID fd;
+	int bytes_recv;
+	int dev = device_index(path);
+	SceUInt64 start = sceKernelGetProcessTimeWide();
+	unsigned long long total = 0;
+	ascii_state_t ascii = {0};
+#if FTPVITA_FEATURE_EVENTS && FTPVITA_FEATURE_HASH
+	unsigned int crc = 0;
+	/* The hash is only meaningful if we write the whole file */
+	int do_crc = event_cb != NULL && client->restore_point == 0;
+#endif
+
+	DEBUG("Opening: %s\n", path);
+
+	int mode = SCE_O_CREAT | SCE_O_RDWR;
+	/* if we resume broken - append missing part
+	 * else - overwrite file */
+	if (client->restore_point) {
+		mode = mode | SCE_O_APPEND;
+	}
+	else {
+		mode = mode | SCE_O_TRUNC;
+	}
+#if FTPVITA_FEATURE_MODE_E
+	/* The blocks carry their offset, appending would ignore it */
+	if (client->mode_e)
+		mode &= ~SCE_O_APPEND;
+#endif
+
+	if ((fd = sceIoOpen(path, mode, 0777)) >= 0) {
+
+#if FTPVITA_FEATURE_MODE_E
+		if (client->mode_e) {
+			mode_e_receive_file(client, path, fd);
+			return;
+		}
+#endif
+
+		buf = xfer_buf_get();
+		if (buf == NULL) {
+			sceIoClose(fd);
+			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
+			return;
+		}
+
+		client_open_data_connection(client);
+		client_send_ctrl_msg(client, client->type_ascii ?
+			"150 Opening ASCII mode data transfer." FTPVITA_EOL :
+			"150 Opening Image mode data transfer." FTPVITA_EOL);
+		client_set_xfer_path(client, path);
+
+#if FTPVITA_FEATURE_EVENTS && FTPVITA_FEATURE_HASH
+		bytes_recv = receive_file_data(client, fd, dev, buf, client->type_ascii ? &ascii : NULL,
+			do_crc ? &crc : NULL, &total);
+#else
+		bytes_recv = receive_file_data(client, fd, dev, buf, client->type_ascii ? &ascii : NULL,
+			NULL, &total);
+#endif
+
+		client_set_xfer_path(client, NULL);
+		sceIoClose(fd);
+		xfer_buf_put(buf);
+		client->restore_point = 0;
+		cache_invalidate(path);
+		xferlog_post(client, path, 'i', total, start, bytes_recv == 0);
+		if (bytes_recv == 0) {
+			STAT_INC(files_received);
+			client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
+#if FTPVITA_FEATURE_EVENTS && FTPVITA_FEATURE_HASH
+			event_post_upload(client, path, total, do_crc, crc);
+#elif FTPVITA_FEATURE_EVENTS
+			event_post_upload(client, path, total, 0, 0);
+#endif
+		} else if (bytes_recv == RECV_WRITE_FAILED) {
+			sceIoRemove(path);
+			client_send_ctrl_msg(client, "452 Could not write the file." FTPVITA_EOL);
+		} else {
+			sceIoRemove(path);
+			client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+		}
+		client_close_data_connection(client);
+
+	} else {
+		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	}
+}
+
+static void cmd_STOR_func(ftpvita_client_info_t *client)
+{
+	char dest_path[PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	receive_file(client, get_vita_path(dest_path));
+}
+
+static void delete_file(ftpvita_client_info_t *client, const char *path)
+{
+	DEBUG("Deleting: %s\n", path);
+
+	if (sceIoRemove(path) >= 0) {
+		cache_invalidate(path);
+		client_send_ctrl_msg(client, "226 File deleted." FTPVITA_EOL);
+		event_post(FTPVITA_EVENT_DELETE, client, path, NULL);
+	} else {
+		client_send_ctrl_msg(client, "550 Could not delete the file." FTPVITA_EOL);
+	}
+}
+
+static void cmd_DELE_func(ftpvita_client_info_t *client)
+{
+	char dest_path[PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	delete_file(client, get_vita_path(dest_path));
+}
+
+static void delete_dir(ftpvita_client_info_t *client, const char *path)
+{
+	int ret;
+	DEBUG("Deleting: %s\n", path);
+	ret = sceIoRmdir(path);
+	if (ret >= 0) {
+		cache_invalidate(path);
+		client_send_ctrl_msg(client, "226 Directory deleted." FTPVITA_EOL);
+		event_post(FTPVITA_EVENT_RMDIR, client, path, NULL);
+	} else if (ret == 0x8001005A) { /* DIRECTORY_IS_NOT_EMPTY */
+		client_send_ctrl_msg(client, "550 Directory is not empty." FTPVITA_EOL);
+	} else {
+		client_send_ctrl_msg(client, "550 Could not delete the directory." FTPVITA_EOL);
+	}
+}
+
+static void cmd_RMD_func(ftpvita_client_info_t *client)
+{
+	char dest_path[PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	delete_dir(client, get_vita_path(dest_path));
+}
+
+static void create_dir(ftpvita_client_info_t *client, const char *path)
+{
+	DEBUG("Creating: %s\n", path);
+
+	if (sceIoMkdir(path, 0777) >= 0) {
+		cache_invalidate(path);
+		client_send_ctrl_msg(client, "226 Directory created." FTPVITA_EOL);
+		event_post(FTPVITA_EVENT_MKDIR, client, path, NULL);
+	} else {
+		client_send_ctrl_msg(client, "550 Could not create the directory." FTPVITA_EOL);
+	}
+}
+
+static void cmd_MKD_func(ftpvita_client_info_t *client)
+{
+	char dest_path[PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	create_dir(client, get_vita_path(dest_path));
+}
+
+static void cmd_RNFR_func(ftpvita_client_info_t *client)
+{
+	char path_src[PATH_MAX];
+	const char *vita_path_src;
+	/* Get the origin filename */
+	gen_ftp_fullpath(client, path_src, sizeof(path_src));
+	vita_path_src = get_vita_path(path_src);
+
+	/* Check if the file exists */
+	if (!file_exists(vita_path_src)) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+	/* The file to be renamed is the received path */
+	strcpy(client->rename_path, vita_path_src);
+	client_send_ctrl_msg(client, "350 I need the destination name b0ss." FTPVITA_EOL);
+}
+
+static void cmd_RNTO_func(ftpvita_client_info_t *client)
+{
+	char path_dst[PATH_MAX];
+	const char *vita_path_dst;
+	/* Get the destination filename */
+	gen_ftp_fullpath(client, path_dst,sizeof(path_dst));
+	vita_path_dst = get_vita_path(path_dst);
+
+	DEBUG("Renaming: %s to %s\n", client->rename_path, vita_path_dst);
+
+	if (sceIoRename(client->rename_path, vita_path_dst) < 0) {
+		client_send_ctrl_msg(client, "550 Error renaming the file." FTPVITA_EOL);
+		return;
+	}
+
+	cache_invalidate(client->rename_path);
+	cache_invalidate(vita_path_dst);
+
+	client_send_ctrl_msg(client, "226 Rename completed." FTPVITA_EOL);
+	event_post(FTPVITA_EVENT_RENAME, client, vita_path_dst, client->rename_path);
+}
+#endif
+
+static void cmd_SIZE_func(ftpvita_client_info_t *client)
+{
+	SceIoStat stat;
+	char path[PATH_MAX];
+	char cmd[64];
+	/* Get the filename to retrieve its size */
+	gen_ftp_fullpath(client, path, sizeof(path));
+
+	/* Check if the file exists */
+	if (sceIoGetstat(get_vita_path(path), &stat) < 0) {
+		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+		return;
+	}
+	/* Send the size of the file */
+	sprintf(cmd, "213 %lld" FTPVITA_EOL, stat.st_size);
+	client_send_ctrl_msg(client, cmd);
+}
+
+#if FTPVITA_FEATURE_HASH
+/* Builds the reply to XCRC ("path" [start [end]]) or HASH (path),
+ * an empty reply means the command was cancelled */
+static void hash_cmd(int xcrc, const char *args, const char *cur_path,
+		     volatile int *cancelled, char *reply, size_t reply_size)
+{
+	char cmd_path[PATH_MAX];
+	char path[PATH_MAX];
+	unsigned long long start = 0;
+	unsigned long long len;
+	long long end = -1;
+	unsigned int crc;
+	const char *p;
+	SceIoStat stat;
+	int ret;
+
+	cmd_path[0] = '\0';
+	if (args[0] == '"' && (p = strchr(args + 1, '"'))) {
+		snprintf(cmd_path, sizeof(cmd_path), "%.*s", (int)(p - args - 1), args + 1);
+		if (xcrc)
+			sscanf(p + 1, "%llu %lld", &start, &end);
+	} else {
+		sscanf(args, "%[^\r\n\t]", cmd_path);
+	}
+
+	if (cmd_path[0] == '\0') {
+		snprintf(reply, reply_size, "501 Syntax error in parameters." FTPVITA_EOL);
+		return;
+	}
+
+	gen_fullpath(cur_path, cmd_path, path, sizeof(path));
+
+	/* Whole files go through the hash cache */
+	if (start == 0 && end < 0 && get_vita_path(path) &&
+	    sceIoGetstat(get_vita_path(path), &stat) >= 0 && !SCE_S_ISDIR(stat.st_mode)) {
+		ret = hash_file_cached(get_vita_path(path), &stat, cancelled, &crc);
+		len = stat.st_size;
+	} else {
+		ret = hash_crc32_file(get_vita_path(path), start, end, cancelled, &crc, &len);
+	}
+
+	switch (ret) {
+	case 0:
+		if (xcrc)
+			snprintf(reply, reply_size, "250 %08X" FTPVITA_EOL, crc);
+		else
+			snprintf(reply, reply_size, "213 CRC32 %llu-%llu %08x %s" FTPVITA_EOL,
+				start, start + len, crc, cmd_path);
+		break;
+	case -2:
+		snprintf(reply, reply_size, "451 Could not allocate memory." FTPVITA_EOL);
+		break;
+	case -3:
+		reply[0] = '\0';
+		break;
+	default:
+		snprintf(reply, reply_size, "550 Could not read the file." FTPVITA_EOL);
+		break;
+	}
+}
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+/* Hashing large files takes a while, run it on the worker pool
+ * so the session can still be ABORted */
+static int cmd_XCRC_async(ftpvita_async_cmd_t *cmd)
+{
+	char reply[PATH_MAX + 64];
+
+	hash_cmd(1, cmd->args, cmd->cur_path, &cmd->cancelled, reply, sizeof(reply));
+	if (reply[0])
+		ftpvita_ext_async_reply(cmd, reply);
+	return 0;
+}
+
+static int cmd_HASH_async(ftpvita_async_cmd_t *cmd)
+{
+	char reply[PATH_MAX + 64];
+
+	hash_cmd(0, cmd->args, cmd->cur_path, &cmd->cancelled, reply, sizeof(reply));
+	if (reply[0])
+		ftpvita_ext_async_reply(cmd, reply);
+	return 0;
+}
+#else
+static void hash_cmd_sync(ftpvita_client_info_t *client, int xcrc)
+{
+	char reply[PATH_MAX + 64];
+	const char *args = client->recv_cmd_args;
+
+	if (args == client->recv_buffer)
+		args = "";
+
+	hash_cmd(xcrc, args, client->cur_path, NULL, reply, sizeof(reply));
+	client_send_ctrl_msg(client, reply);
+}
+
+static void cmd_XCRC_func(ftpvita_client_info_t *client)
+{
+	hash_cmd_sync(client, 1);
+}
+
+static void cmd_HASH_func(ftpvita_client_info_t *client)
+{
+	hash_cmd_sync(client, 0);
+}
+#endif
+#endif
+
+static void cmd_REST_func(ftpvita_client_info_t *client)
+{
+	char cmd[64];
+	sscanf(client->recv_buffer, "%*[^ ] %d", &client->restore_point);
+	sprintf(cmd, "350 Resuming at %d" FTPVITA_EOL, client->restore_point);
+	client_send_ctrl_msg(client, cmd);
+}
+
+static void cmd_FEAT_func(ftpvita_client_info_t *client)
+{
+	/*So client would know that we support resume */
+	client_send_ctrl_msg(client, "211-extensions" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " REST STREAM" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " UTF8" FTPVITA_EOL);
+#if FTPVITA_FEATURE_HASH
+	client_send_ctrl_msg(client, " HASH CRC32*" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " XCRC" FTPVITA_EOL);
+#endif
+#if FTPVITA_FEATURE_MODE_E
+	client_send_ctrl_msg(client, " PARALLEL" FTPVITA_EOL);
+	client_send_ctrl_msg(client, " SPAS" FTPVITA_EOL);
+#endif
+	client_send_ctrl_msg(client, "211 end" FTPVITA_EOL);
+}
+
+static void cmd_OPTS_func(ftpvita_client_info_t *client)
+{
+#if FTPVITA_FEATURE_HASH
+	char algo[16];
+	int n;
+
+	/* CRC32 is the only HASH algorithm */
+	n = sscanf(client->recv_cmd_args, "%*s %15s", algo);
+	if (strncasecmp(client->recv_cmd_args, "HASH", 4) == 0 &&
+	    (n < 1 || strcasecmp(algo, "CRC32") == 0)) {
+		client_send_ctrl_msg(client, "200 CRC32" FTPVITA_EOL);
+		return;
+	}
+#endif
+#if FTPVITA_FEATURE_MODE_E
+	char msg[64];
+	int streams;
+
+	/* OPTS RETR Parallelism=<start>,<min>,<max>; sets the data
+	 * connections of the MODE E transfers, both ways */
+	if (sscanf(client->recv_cmd_args, "RETR Parallelism=%d", &streams) == 1) {
+		if (streams < 1)
+			streams = 1;
+		if (streams > FTPVITA_MAX_STREAMS)
+			streams = FTPVITA_MAX_STREAMS;
+		client->parallelism = streams;
+		snprintf(msg, sizeof(msg), "200 Parallel streams set to %d." FTPVITA_EOL, streams);
+		client_send_ctrl_msg(client, msg);
+		return;
+	}
+#endif
+	client_send_ctrl_msg(client, "501 bad OPTS" FTPVITA_EOL);
+}
+
+#if FTPVITA_FEATURE_WRITE
+static void cmd_APPE_func(ftpvita_client_info_t *client)
+{
+	/* set restore point to not 0
+	restore point numeric value only matters if we RETR file from vita.
+	If we STOR or APPE, it is only used to indicate that we want to resume
+	a broken transfer */
+	client->restore_point = -1;
+	char dest_path[PATH_MAX];
+	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
+	receive_file(client, get_vita_path(dest_path));
+}
+#endif
+
+#if FTPVITA_FEATURE_RESUME
+/* Resume tokens: when a session that requested a token ends, its state
+ * is kept for a while so a new connection from the same IP can pick it
+ * up with a single SITE RESUME instead of replaying CWD, REST and RNFR */
+
+static struct {
+	unsigned long long token;
+	SceNetInAddr addr;
+	SceUInt64 closed_time;
+	char cur_path[PATH_MAX];
+	char rename_path[PATH_MAX];
+	unsigned int restore_point;
+	int valid;
+} resume_cache[FTPVITA_RESUME_CACHE_SIZE];
+
+static SceUID resume_cache_mtx;
+static unsigned long long resume_rng_state;
+
+static int resume_entry_expired(int i, SceUInt64 now)
+{
+	return now - resume_cache[i].closed_time > FTPVITA_RESUME_TTL * 1000000ULL;
+}
+
+/* Must be called with resume_cache_mtx locked */
+static unsigned long long resume_token_gen()
+{
+	unsigned long long x = resume_rng_state;
+
+	do {
+		/* xorshift64* */
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		resume_rng_state = x;
+		x *= 0x2545F4914F6CDD1DULL;
+	} while (x == 0);
+
+	return x;
+}
+
+static void resume_cache_init()
+{
+	SceRtcTick tick;
+	int i;
+
+	resume_cache_mtx = sceKernelCreateMutex("FTPVita_resume_mutex", 0, 0, NULL);
+
+	sceRtcGetCurrentTick(&tick);
+	resume_rng_state = (tick.tick << 20) ^ sceKernelGetProcessTimeWide() ^ 0x9E3779B97F4A7C15ULL;
+
+	for (i = 0; i < FTPVITA_RESUME_CACHE_SIZE; i++)
+		resume_cache[i].valid = 0;
+}
+
+static void resume_cache_fini()
+{
+	sceKernelDeleteMutex(resume_cache_mtx);
+}
+
+/* Called when a session ends */
+static void resume_cache_save(const ftpvita_client_info_t *client)
+{
+	SceUInt64 now;
+	int i, slot = 0;
+
+	if (client->resume_token == 0)
+		return;
+
+	now = sceKernelGetProcessTimeWide();
+
+	sceKernelLockMutex(resume_cache_mtx, 1, NULL);
+
+	/* Use a free or expired slot, or else evict the oldest entry */
+	for (i = 0; i < FTPVITA_RESUME_CACHE_SIZE; i++) {
+		if (!resume_cache[i].valid || resume_entry_expired(i, now)) {
+			slot = i;
+			break;
+		}
+		if (resume_cache[i].closed_time < resume_cache[slot].closed_time)
+			slot = i;
+	}
+
+	resume_cache[slot].token = client->resume_token;
+	resume_cache[slot].addr = client->addr.sin_addr;
+	resume_cache[slot].closed_time = now;
+	strcpy(resume_cache[slot].cur_path, client->cur_path);
+	strcpy(resume_cache[slot].rename_path, client->rename_path);
+	resume_cache[slot].restore_point = client->restore_point;
+	resume_cache[slot].valid = 1;
+
+	sceKernelUnlockMutex(resume_cache_mtx, 1);
+}
+
+static void cmd_SITE_TOKEN_func(ftpvita_client_info_t *client)
+{
+	char msg[64];
+
+	if (client->resume_token == 0) {
+		sceKernelLockMutex(resume_cache_mtx, 1, NULL);
+		client->resume_token = resume_token_gen();
+		sceKernelUnlockMutex(resume_cache_mtx, 1);
+	}
+
+	snprintf(msg, sizeof(msg), "200 %016llx" FTPVITA_EOL, client->resume_token);
+	client_send_ctrl_msg(client, msg);
+}
+
+static void cmd_SITE_RESUME_func(ftpvita_client_info_t *client)
+{
+	unsigned long long token;
+	char msg[PATH_MAX + 64];
+	SceUInt64 now;
+	int i;
+
+	if (sscanf(client->recv_cmd_args, "%llx", &token) != 1 || token == 0) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters." FTPVITA_EOL);
+		return;
+	}
+
+	now = sceKernelGetProcessTimeWide();
+
+	sceKernelLockMutex(resume_cache_mtx, 1, NULL);
+
+	for (i = 0; i < FTPVITA_RESUME_CACHE_SIZE; i++) {
+		if (resume_cache[i].valid && resume_cache[i].token == token &&
+		    resume_cache[i].addr.s_addr == client->addr.sin_addr.s_addr &&
+		    !resume_entry_expired(i, now))
+			break;
+	}
+
+	if (i == FTPVITA_RESUME_CACHE_SIZE) {
+		sceKernelUnlockMutex(resume_cache_mtx, 1);
+		client_send_ctrl_msg(client, "550 Invalid or expired token." FTPVITA_EOL);
+		return;
+	}
+
+	strcpy(client->cur_path, resume_cache[i].cur_path);
+	strcpy(client->rename_path, resume_cache[i].rename_path);
+	client->restore_point = resume_cache[i].restore_point;
+	/* The token stays valid for the next reconnection */
+	client->resume_token = token;
+	resume_cache[i].valid = 0;
+
+	sceKernelUnlockMutex(resume_cache_mtx, 1);
+
+	snprintf(msg, sizeof(msg), "200 Session resumed, \"%s\" is the current directory." FTPVITA_EOL,
+		client->cur_path);
+	client_send_ctrl_msg(client, msg);
+}
+#endif
+
+static void cmd_ABOR_func(ftpvita_client_info_t *client)
+{
+	if (async_cmd_cancel(client))
+		client_send_ctrl_msg(client, "226 Abort successful." FTPVITA_EOL);
+	else
+		client_send_ctrl_msg(client, "225 No command in progress." FTPVITA_EOL);
+}
+
+#if FTPVITA_FEATURE_METRICS
+static void cmd_SITE_STATS_func(ftpvita_client_info_t *client)
+{
+	char *buffer, *line, *eol;
+	char msg[256];
+	int len;
+
+	if (gen_metrics(&buffer) < 0) {
+		client_send_ctrl_msg(client, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+
+	client_send_ctrl_msg(client, "211-FTPVita statistics:" FTPVITA_EOL);
+	for (line = buffer; (eol = strchr(line, '\n')); line = eol + 1) {
+		/* Cut overlong lines, but always end them */
+		len = eol - line;
+		if (len > sizeof(msg) - sizeof(FTPVITA_EOL))
+			len = sizeof(msg) - sizeof(FTPVITA_EOL);
+		snprintf(msg, sizeof(msg), "%.*s" FTPVITA_EOL, len, line);
+		client_send_ctrl_msg(client, msg);
+	}
+	client_send_ctrl_msg(client, "211 End" FTPVITA_EOL);
+
+	mem_free(buffer);
+}
+#endif
+
+#if FTPVITA_FEATURE_DU
+/* Interval between partial results, in units of 100 ms */
+#define DU_PROGRESS_TICKS 10
+
+static void site_du(ftpvita_client_info_t *client, const char *args,
+		    const char *cur_path, volatile int *cancelled)
+{
+	char cmd_path[PATH_MAX];
+	char path[PATH_MAX];
+	char msg[128];
+	const char *vita_path;
+	SceIoStat stat;
+	SceUID thids[WALK_WORKERS];
+	walk_t w, *wp = &w;
+	int i, started, ticks = 0;
+
+	cmd_path[0] = '\0';
+	sscanf(args, "%[^\r\n\t]", cmd_path);
+	if (cmd_path[0])
+		gen_fullpath(cur_path, cmd_path, path, sizeof(path));
+	else
+		strcpy(path, cur_path);
+
+	vita_path = get_vita_path(path);
+	if (vita_path == NULL || sceIoGetstat(vita_path, &stat) < 0) {
+		job_reply(client, cancelled, "550 No such file or directory." FTPVITA_EOL);
+		return;
+	}
+
+	memset(&w, 0, sizeof(w));
+	if (SCE_S_ISDIR(stat.st_mode)) {
+		w.dev = device_index(vita_path);
+		w.cancelled = cancelled;
+		w.mtx = sceKernelCreateMutex("FTPVita_walk_mutex", 0, 0, NULL);
+		w.sema = sceKernelCreateSema("FTPVita_walk_sema", 0, 0, 0x7FFFFFFF, NULL);
+
+		walk_push(&w, vita_path);
+
+		started = 0;
+		for (i = 0; i < WALK_WORKERS; i++) {
+			thids[i] = sceKernelCreateThread("FTPVita_walk_thread",
+				walk_worker_thread, 0x10000100, 0x8000, 0, 0, NULL);
+			if (thids[i] >= 0 && sceKernelStartThread(thids[i], sizeof(wp), &wp) < 0) {
+				sceKernelDeleteThread(thids[i]);
+				thids[i] = -1;
+			}
+			if (thids[i] >= 0)
+				started++;
+		}
+
+		/* Without workers the walk is done here, without progress */
+		if (started == 0)
+			walk_run(&w);
+
+		/* Stream the partial totals while the walk goes on */
+		while (__atomic_load_n(&w.pending, __ATOMIC_ACQUIRE) > 0) {
+			sceKernelDelayThread(100 * 1000);
+			if (++ticks % DU_PROGRESS_TICKS == 0) {
+				snprintf(msg, sizeof(msg),
+					"211-%llu bytes, %u files, %u directories so far" FTPVITA_EOL,
+					__atomic_load_n(&w.bytes, __ATOMIC_RELAXED),
+					__atomic_load_n(&w.files, __ATOMIC_RELAXED),
+					__atomic_load_n(&w.dirs, __ATOMIC_RELAXED));
+				job_reply(client, cancelled, msg);
+			}
+		}
+
+		for (i = 0; i < WALK_WORKERS; i++) {
+			if (thids[i] >= 0)
+				sceKernelWaitThreadEnd(thids[i], NULL, NULL);
+		}
+
+		sceKernelDeleteSema(w.sema);
+		sceKernelDeleteMutex(w.mtx);
+	} else {
+		w.files = 1;
+		w.bytes = stat.st_size;
+	}
+
+	snprintf(msg, sizeof(msg), "211-Bytes: %llu" FTPVITA_EOL, w.bytes);
+	job_reply(client, cancelled, msg);
+	snprintf(msg, sizeof(msg), "211-Files: %u" FTPVITA_EOL, w.files);
+	job_reply(client, cancelled, msg);
+	snprintf(msg, sizeof(msg), "211-Directories: %u" FTPVITA_EOL, w.dirs);
+	job_reply(client, cancelled, msg);
+	if (w.errors) {
+		snprintf(msg, sizeof(msg), "211-Unreadable: %u" FTPVITA_EOL, w.errors);
+		job_reply(client, cancelled, msg);
+	}
+	job_reply(client, cancelled, "211 End" FTPVITA_EOL);
+}
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+static int cmd_SITE_DU_async(ftpvita_async_cmd_t *cmd)
+{
+	site_du(cmd->client, cmd->args, cmd->cur_path, &cmd->cancelled);
+	return 0;
+}
+#else
+static void cmd_SITE_DU_func(ftpvita_client_info_t *client)
+{
+	site_du(client, client->recv_cmd_args, client->cur_path, NULL);
+}
+#endif
+#endif
+
+#if FTPVITA_FEATURE_TREEHASH
+/* SHA-256 (FIPS 180-4) for the tree digests */
+
+typedef struct {
+	unsigned int h[8];
+	unsigned char buf[64];
+	unsigned int len;
+	unsigned long long total;
+} sha256_t;
+
+static const unsigned int sha256_k[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init(sha256_t *s)
+{
+	static const unsigned int h0[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+		0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+	};
+
+	memcpy(s->h, h0, sizeof(h0));
+	s->len = 0;
+	s->total = 0;
+}
+
+static void sha256_block(sha256_t *s, const unsigned char *p)
+{
+	unsigned int w[64];
+	unsigned int a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((unsigned int)p[i * 4] << 24) | (p[i * 4 + 1] << 16) |
+			(p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+			(ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			(ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) +
+			sha256_k[i] + w[i];
+		t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_update(sha256_t *s, const void *data, unsigned int len)
+{
+	const unsigned char *p = data;
+	unsigned int n;
+
+	s->total += len;
+	while (len > 0) {
+		n = 64 - s->len;
+		if (n > len)
+			n = len;
+		memcpy(s->buf + s->len, p, n);
+		s->len += n;
+		p += n;
+		len -= n;
+		if (s->len == 64) {
+			sha256_block(s, s->buf);
+			s->len = 0;
+		}
+	}
+}
+
+static void sha256_final(sha256_t *s, unsigned char digest[32])
+{
+	unsigned long long bits = s->total * 8;
+	unsigned char pad[8];
+	int i;
+
+	sha256_update(s, "\x80", 1);
+	while (s->len != 56)
+		sha256_update(s, "", 1);
+	for (i = 0; i < 8; i++)
+		pad[i] = bits >> (56 - i * 8);
+	sha256_update(s, pad, 8);
+
+	for (i = 0; i < 32; i++)
+		digest[i] = s->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+/* SITE TREEHASH [-depth] [path]: Merkle digest of a directory tree.
+ * The digest of a directory is the SHA-256 of one line per entry,
+ * sorted by name (byte order):
+ *     f <size> <CRC32 as 8 lowercase hex digits> <name>\n
+ *     d <digest as 64 lowercase hex digits> <name>\n
+ * so two trees have the same digest only if they have the same names,
+ * sizes and contents. With -depth the subdirectories up to that depth
+ * get their own "<digest> <relative path>" line, each one after its
+ * own subdirectories, letting a client narrow down where two trees
+ * differ. File CRC32s come from the hash cache, so after the first
+ * run only changed files are read again. */
+
+#define TREEHASH_MAX_DEPTH 64
+/* Interval between progress lines, in microseconds */
+#define TREEHASH_PROGRESS_INTERVAL (1000 * 1000)
+
+typedef struct {
+	ftpvita_client_info_t *client;
+	volatile int *cancelled;
+	int report_depth;
+	/* Device path being hashed, the root's being root_len long */
+	char path[PATH_MAX];
+	unsigned int root_len;
+	/* Digest lines, kept here to keep the recursion's frames small */
+	char line[PATH_MAX + 96];
+	unsigned int files;
+	unsigned int unreadable;
+	SceUInt64 last_progress;
+} treehash_t;
+
+typedef struct {
+	char *name;
+	int dir;
+	SceIoStat stat;
+} treehash_entry_t;
+
+static int treehash_cmp(const void *a, const void *b)
+{
+	return strcmp(((const treehash_entry_t *)a)->name, ((const treehash_entry_t *)b)->name);
+}
+
+static void treehash_hex(const unsigned char digest[32], char *hex)
+{
+	int i;
+
+	for (i = 0; i < 32; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+static void treehash_progress(treehash_t *t)
+{
+	char msg[64];
+	SceUInt64 now = sceKernelGetProcessTimeWide();
+
+	if (now - t->last_progress < TREEHASH_PROGRESS_INTERVAL)
+		return;
+	t->last_progress = now;
+
+	snprintf(msg, sizeof(msg), "211-%u files so far" FTPVITA_EOL, t->files);
+	job_reply(t->client, t->cancelled, msg);
+}
+
+/* Reads the entries of the directory at t->path, NULL if it can't be read */
+static treehash_entry_t *treehash_read_dir(treehash_t *t, unsigned int *n)
+{
+	treehash_entry_t *entries = NULL, *p;
+	unsigned int size = 0, i;
+	SceIoDirent dirent;
+	SceUID dir;
+	int complete = 1;
+
+	*n = 0;
+	dir = sceIoDopen(t->path);
+	if (dir < 0)
+		return NULL;
+
+	memset(&dirent, 0, sizeof(dirent));
+	while (sceIoDread(dir, &dirent) > 0) {
+		if (strcmp(dirent.d_name, ".") == 0 || strcmp(dirent.d_name, "..") == 0)
+			continue;
+
+		if (*n == size) {
+			size = size ? size * 2 : 32;
+			p = mem_realloc(FTPVITA_MEM_WALK, entries, size * sizeof(*entries));
+			if (p == NULL) {
+				complete = 0;
+				break;
+			}
+			entries = p;
+		}
+		entries[*n].name = mem_strdup(FTPVITA_MEM_WALK, dirent.d_name);
+		if (entries[*n].name == NULL) {
+			complete = 0;
+			break;
+		}
+		entries[*n].dir = SCE_S_ISDIR(dirent.d_stat.st_mode);
+		entries[*n].stat = dirent.d_stat;
+		(*n)++;
+	}
+
+	sceIoDclose(dir);
+
+	/* Part of a directory would give a wrong digest */
+	if (!complete) {
+		for (i = 0; i < *n; i++)
+			mem_free(entries[i].name);
+		mem_free(entries);
+		return NULL;
+	}
+
+	/* An empty directory is still readable */
+	if (entries == NULL)
+		entries = mem_alloc(FTPVITA_MEM_WALK, sizeof(*entries));
+	return entries;
+}
+
+/* Digest of the directory at t->path. Returns 0, -1 if it can't be
+ * read or is too deep, -3 if cancelled */
+static int treehash_dir(treehash_t *t, int depth, unsigned char digest[32])
+{
+	treehash_entry_t *entries;
+	unsigned char sub[32];
+	char hex[65];
+	unsigned int n, i;
+	unsigned int len = strlen(t->path);
+	unsigned int crc;
+	int ret = 0, r;
+	sha256_t sha;
+
+	if (depth > TREEHASH_MAX_DEPTH || (entries = treehash_read_dir(t, &n)) == NULL)
+		return -1;
+
+	qsort(entries, n, sizeof(*entries), treehash_cmp);
+	sha256_init(&sha);
+
+	for (i = 0; i < n && ret == 0; i++) {
+		if (t->cancelled && *t->cancelled) {
+			ret = -3;
+			break;
+		}
+
+		if (snprintf(t->path + len, sizeof(t->path) - len, "%s%s",
+			     t->path[len - 1] == '/' ? "" : "/", entries[i].name) >= sizeof(t->path) - len) {
+			r = -1;
+		} else if (entries[i].dir) {
+			r = treehash_dir(t, depth + 1, sub);
+		} else {
+			r = hash_file_cached(t->path, &entries[i].stat, t->cancelled, &crc);
+			t->files++;
+		}
+
+		if (r == -3 || r == -2) {
+			ret = r;
+		} else if (entries[i].dir) {
+			if (r == 0) {
+				treehash_hex(sub, hex);
+				/* Report it while the path is still there */
+				if (depth + 1 <= t->report_depth) {
+					snprintf(t->line, sizeof(t->line), "211-%s %s" FTPVITA_EOL, hex,
+						t->path + t->root_len + (t->path[t->root_len] == '/'));
+					job_reply(t->client, t->cancelled, t->line);
+				}
+			} else {
+				strcpy(hex, "-");
+				t->unreadable++;
+			}
+			snprintf(t->line, sizeof(t->line), "d %s %s\n", hex, entries[i].name);
+			sha256_update(&sha, t->line, strlen(t->line));
+		} else {
+			if (r == 0) {
+				snprintf(hex, sizeof(hex), "%08x", crc);
+			} else {
+				strcpy(hex, "-");
+				t->unreadable++;
+			}
+			snprintf(t->line, sizeof(t->line), "f %llu %s %s\n",
+				(unsigned long long)entries[i].stat.st_size, hex, entries[i].name);
+			sha256_update(&sha, t->line, strlen(t->line));
+		}
+
+		t->path[len] = '\0';
+		treehash_progress(t);
+	}
+
+	for (i = 0; i < n; i++)
+		mem_free(entries[i].name);
+	mem_free(entries);
+
+	sha256_final(&sha, digest);
+	return ret;
+}
+
+static void site_treehash(ftpvita_client_info_t *client, const char *args,
+			  const char *cur_path, volatile int *cancelled)
+{
+	char cmd_path[PATH_MAX];
+	char path[PATH_MAX];
+	char msg[128];
+	unsigned char digest[32];
+	char hex[65];
+	const char *vita_path;
+	SceIoStat stat;
+	treehash_t *t;
+	int ret;
+
+	t = mem_alloc(FTPVITA_MEM_WALK, sizeof(*t));
+	if (t == NULL) {
+		job_reply(client, cancelled, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+	t->client = client;
+	t->cancelled = cancelled;
+	t->report_depth = 0;
+	t->files = 0;
+	t->unreadable = 0;
+	t->last_progress = sceKernelGetProcessTimeWide();
+
+	while (*args == ' ')
+		args++;
+	if (*args == '-') {
+		t->report_depth = strtol(args + 1, (char **)&args, 10);
+		while (*args == ' ')
+			args++;
+	}
+
+	cmd_path[0] = '\0';
+	sscanf(args, "%[^\r\n\t]", cmd_path);
+	if (cmd_path[0])
+		gen_fullpath(cur_path, cmd_path, path, sizeof(path));
+	else
+		strcpy(path, cur_path);
+
+	vita_path = get_vita_path(path);
+	if (vita_path == NULL || sceIoGetstat(vita_path, &stat) < 0 || !SCE_S_ISDIR(stat.st_mode)) {
+		job_reply(client, cancelled, "550 Not a directory." FTPVITA_EOL);
+		mem_free(t);
+		return;
+	}
+
+	strcpy(t->path, vita_path);
+	t->root_len = strlen(t->path);
+
+	ret = treehash_dir(t, 0, digest);
+	if (ret == -2) {
+		job_reply(client, cancelled, "451 Could not allocate memory." FTPVITA_EOL);
+	} else if (ret == -1) {
+		job_reply(client, cancelled, "550 Could not read the directory." FTPVITA_EOL);
+	} else if (ret == 0) {
+		if (t->unreadable) {
+			snprintf(msg, sizeof(msg), "211-Unreadable: %u" FTPVITA_EOL, t->unreadable);
+			job_reply(client, cancelled, msg);
+		}
+		treehash_hex(digest, hex);
+		snprintf(msg, sizeof(msg), "211 %s" FTPVITA_EOL, hex);
+		job_reply(client, cancelled, msg);
+	}
+
+	mem_free(t);
+}
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+static int cmd_SITE_TREEHASH_async(ftpvita_async_cmd_t *cmd)
+{
+	site_treehash(cmd->client, cmd->args, cmd->cur_path, &cmd->cancelled);
+	return 0;
+}
+#else
+static void cmd_SITE_TREEHASH_func(ftpvita_client_info_t *client)
+{
+	site_treehash(client, client->recv_cmd_args, client->cur_path, NULL);
+}
+#endif
+#endif
+
+#if FTPVITA_FEATURE_PREFETCH || FTPVITA_FEATURE_EXTRACT || FTPVITA_FEATURE_VERIFY
+/* Copies the next path of a SITE argument list to out and moves args
+ * past it, paths with spaces must be quoted. Returns 0 at the end */
+static int site_next_path(const char **args, char *out, size_t size)
+{
+	const char *p = *args;
+	const char *end;
+
+	while (*p == ' ')
+		p++;
+	if (*p == '\0' || *p == '\r' || *p == '\n')
+		return 0;
+
+	if (*p == '"' && (end = strchr(p + 1, '"'))) {
+		p++;
+	} else {
+		end = p + strcspn(p, " \r\n");
+	}
+	snprintf(out, size, "%.*s", (int)(end - p), p);
+	*args = *end == '"' ? end + 1 : end;
+
+	return 1;
+}
+#endif
+
+#if FTPVITA_FEATURE_PREFETCH
+/* SITE PREFETCH path [path...] */
+static void cmd_SITE_PREFETCH_func(ftpvita_client_info_t *client)
+{
+	char cmd_path[PATH_MAX];
+	char path[PATH_MAX];
+	char msg[64];
+	const char *p = client->recv_cmd_args;
+	int n = 0;
+
+	while (site_next_path(&p, cmd_path, sizeof(cmd_path))) {
+		gen_fullpath(client->cur_path, cmd_path, path, sizeof(path));
+		if (get_vita_path(path)) {
+			prefetch_request(PREFETCH_REQ_FILE, get_vita_path(path));
+			n++;
+		}
+	}
+
+	if (n == 0) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters." FTPVITA_EOL);
+		return;
+	}
+
+	snprintf(msg, sizeof(msg), "200 %d files queued for read-ahead." FTPVITA_EOL, n);
+	client_send_ctrl_msg(client, msg);
+}
+#endif
+
+#if FTPVITA_FEATURE_THUMBS || FTPVITA_FEATURE_EXTRACT
+/* Creates each directory of path up to its last '/' */
+static void mkdir_parents(const char *path)
+{
+	char dir[PATH_MAX];
+	const char *p = path;
+
+	while ((p = strchr(p + 1, '/')) != NULL) {
+		snprintf(dir, sizeof(dir), "%.*s", (int)(p - path), path);
+		sceIoMkdir(dir, 0777);
+	}
+}
+
+/* Streaming inflate (RFC 1951), done like zlib's puff.c: small and
+ * simple rather than fast. The compressed data is pulled with read()
+ * and the output pushed to write() in pieces of up to 32 KB, each time
+ * the window fills up. Either can return < 0 to stop. */
+
+#define INFLATE_WINDOW  32768
+#define INFLATE_IN_SIZE 4096
+#define HUFF_MAX_BITS   16
+
+/* Canonical Huffman code: number of codes of each length and the
+ * symbols ordered by code. Also used for the JPEG tables */
+typedef struct {
+	unsigned short count[HUFF_MAX_BITS + 1];
+	unsigned short symbol[288];
+} huff_t;
+
+typedef struct {
+	int (*read)(void *arg, unsigned char *buf, unsigned int size);
+	int (*write)(void *arg, const unsigned char *data, unsigned int len);
+	void *arg;
+	unsigned char in[INFLATE_IN_SIZE];
+	unsigned int in_pos;
+	unsigned int in_len;
+	unsigned int bitbuf;
+	unsigned int bitcnt;
+	unsigned char window[INFLATE_WINDOW];
+	unsigned int wpos;
+	unsigned long long total;
+	int error;
+	huff_t lencode;
+	huff_t distcode;
+} inflate_t;
+
+/* Returns < 0 if the lengths are over-subscribed, > 0 if incomplete */
+static int huff_build(huff_t *h, const unsigned short *length, int n)
+{
+	unsigned short offs[HUFF_MAX_BITS + 1];
+	int len, symbol, left;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (symbol = 0; symbol < n; symbol++)
+		h->count[length[symbol]]++;
+	if (h->count[0] == n)
+		return 0;
+
+	left = 1;
+	for (len = 1; len <= HUFF_MAX_BITS; len++) {
+		left <<= 1;
+		left -= h->count[len];
+		if (left < 0)
+			return left;
+	}
+
+	offs[1] = 0;
+	for (len = 1; len < HUFF_MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (symbol = 0; symbol < n; symbol++) {
+		if (length[symbol] != 0)
+			h->symbol[offs[length[symbol]]++] = symbol;
+	}
+
+	return left;
+}
+
+static int inflate_byte(inflate_t *z)
+{
+	int n;
+
+	if (z->in_pos == z->in_len) {
+		n = z->read(z->arg, z->in, sizeof(z->in));
+		if (n <= 0) {
+			z->error = 1;
+			return 0;
+		}
+		z->in_pos = 0;
+		z->in_len = n;
+	}
+	return z->in[z->in_pos++];
+}
+
+static unsigned int inflate_bits(inflate_t *z, int need)
+{
+	unsigned int val = z->bitbuf;
+
+	while (z->bitcnt < need) {
+		val |= (unsigned int)inflate_byte(z) << z->bitcnt;
+		z->bitcnt += 8;
+	}
+	z->bitbuf = val >> need;
+	z->bitcnt -= need;
+
+	return val & ((1U << need) - 1);
+}
+
+static void inflate_flush(inflate_t *z)
+{
+	if (z->wpos > 0 && !z->error && z->write(z->arg, z->window, z->wpos) < 0)
+		z->error = 1;
+	z->wpos = 0;
+}
+
+static inline void inflate_put(inflate_t *z, unsigned char c)
+{
+	z->window[z->wpos++] = c;
+	z->total++;
+	if (z->wpos == INFLATE_WINDOW)
+		inflate_flush(z);
+}
+
+static int inflate_decode(inflate_t *z, const huff_t *h)
+{
+	int code = 0, first = 0, index = 0;
+	int len, count;
+
+	for (len = 1; len <= 15; len++) {
+		code |= inflate_bits(z, 1);
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+static int inflate_codes(inflate_t *z)
+{
+	static const unsigned short lbase[29] = {
+		3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+		35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+	static const unsigned char lext[29] = {
+		0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+		3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+	static const unsigned short dbase[30] = {
+		1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+		257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+		8193, 12289, 16385, 24577};
+	static const unsigned char dext[30] = {
+		0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+		7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+	int symbol;
+	unsigned int len, dist;
+
+	while (!z->error) {
+		symbol = inflate_decode(z, &z->lencode);
+		if (symbol < 0)
+			return -1;
+		if (symbol < 256) {
+			inflate_put(z, symbol);
+			continue;
+		}
+		if (symbol == 256)
+			return 0;
+
+		symbol -= 257;
+		if (symbol >= 29)
+			return -1;
+		len = lbase[symbol] + inflate_bits(z, lext[symbol]);
+
+		symbol = inflate_decode(z, &z->distcode);
+		if (symbol < 0 || symbol >= 30)
+			return -1;
+		dist = dbase[symbol] + inflate_bits(z, dext[symbol]);
+		if (dist > z->total)
+			return -1;
+
+		while (len--)
+			inflate_put(z, z->window[(z->wpos - dist) & (INFLATE_WINDOW - 1)]);
+	}
+
+	return -1;
+}
+
+static int inflate_stored(inflate_t *z)
+{
+	unsigned int len;
+
+	/* Stored blocks start on a byte boundary */
+	z->bitbuf = 0;
+	z->bitcnt = 0;
+
+	len = inflate_byte(z);
+	len |= inflate_byte(z) << 8;
+	if (inflate_byte(z) != (~len & 0xFF) || inflate_byte(z) != ((~len >> 8) & 0xFF))
+		return -1;
+
+	while (len-- && !z->error)
+		inflate_put(z, inflate_byte(z));
+
+	return z->error ? -1 : 0;
+}
+
+static int inflate_fixed(inflate_t *z)
+{
+	unsigned short lengths[288];
+	int symbol;
+
+	for (symbol = 0; symbol < 144; symbol++)
+		lengths[symbol] = 8;
+	for (; symbol < 256; symbol++)
+		lengths[symbol] = 9;
+	for (; symbol < 280; symbol++)
+		lengths[symbol] = 7;
+	for (; symbol < 288; symbol++)
+		lengths[symbol] = 8;
+	huff_build(&z->lencode, lengths, 288);
+
+	for (symbol = 0; symbol < 30; symbol++)
+		lengths[symbol] = 5;
+	huff_build(&z->distcode, lengths, 30);
+
+	return inflate_codes(z);
+}
+
+static int inflate_dynamic(inflate_t *z)
+{
+	static const unsigned char order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	unsigned short lengths[320];
+	int nlen, ndist, ncode;
+	int index, symbol, len, err;
+
+	nlen = inflate_bits(z, 5) + 257;
+	ndist = inflate_bits(z, 5) + 1;
+	ncode = inflate_bits(z, 4) + 4;
+	if (nlen > 286 || ndist > 30)
+		return -1;
+
+	for (index = 0; index < ncode; index++)
+		lengths[order[index]] = inflate_bits(z, 3);
+	for (; index < 19; index++)
+		lengths[order[index]] = 0;
+	if (huff_build(&z->lencode, lengths, 19) != 0)
+		return -1;
+
+	index = 0;
+	while (index < nlen + ndist) {
+		symbol = inflate_decode(z, &z->lencode);
+		if (symbol < 0 || z->error)
+			return -1;
+		if (symbol < 16) {
+			lengths[index++] = symbol;
+			continue;
+		}
+
+		len = 0;
+		if (symbol == 16) {
+			if (index == 0)
+				return -1;
+			len = lengths[index - 1];
+			symbol = 3 + inflate_bits(z, 2);
+		} else if (symbol == 17) {
+			symbol = 3 + inflate_bits(z, 3);
+		} else {
+			symbol = 11 + inflate_bits(z, 7);
+		}
+		if (index + symbol > nlen + ndist)
+			return -1;
+		while (symbol--)
+			lengths[index++] = len;
+	}
+
+	/* No end of block code */
+	if (lengths[256] == 0)
+		return -1;
+
+	/* Incomplete codes are only allowed with a single length */
+	err = huff_build(&z->lencode, lengths, nlen);
+	if (err && (err < 0 || nlen != z->lencode.count[0] + z->lencode.count[1]))
+		return -1;
+	err = huff_build(&z->distcode, lengths + nlen, ndist);
+	if (err && (err < 0 || ndist != z->distcode.count[0] + z->distcode.count[1]))
+		return -1;
+
+	return inflate_codes(z);
+}
+
+/* Inflates the whole stream. 0 on success */
+static int inflate_run(inflate_t *z)
+{
+	int last, type, err;
+
+	z->in_pos = 0;
+	z->in_len = 0;
+	z->bitbuf = 0;
+	z->bitcnt = 0;
+	z->wpos = 0;
+	z->total = 0;
+	z->error = 0;
+
+	do {
+		last = inflate_bits(z, 1);
+		type = inflate_bits(z, 2);
+		if (type == 0)
+			err = inflate_stored(z);
+		else if (type == 1)
+			err = inflate_fixed(z);
+		else if (type == 2)
+			err = inflate_dynamic(z);
+		else
+			err = -1;
+	} while (!last && !err && !z->error);
+
+	inflate_flush(z);
+
+	return err || z->error ? -1 : 0;
+}
+#endif
+
+#if FTPVITA_FEATURE_THUMBS
+/* Thumbnails: JPEG and PNG images are decoded on a small worker pool,
+ * downscaled to fit in THUMB_SIZE x THUMB_SIZE and stored as BMP in
+ * THUMB_CACHE_DIR, named after a hash of the path, size and mtime so a
+ * modified image gets a new one. SITE THUMB sends them over the data
+ * connection. JPEGs are only decoded to their DC coefficients, which
+ * gives the image at 1/8 of its size for a fraction of the work. */
+
+#define THUMB_SIZE       FTPVITA_THUMB_SIZE
+#define THUMB_WORKERS    FTPVITA_THUMB_WORKERS
+#define THUMB_QUEUE_SIZE 16
+#define THUMB_CACHE_DIR  FTPVITA_THUMB_CACHE_DIR
+#define THUMB_READ_SIZE  4096
+
+/* Box filter downscaler, fed one source row at a time */
+typedef struct {
+	unsigned int src_w, src_h;
+	unsigned int dst_w, dst_h;
+	unsigned int y, dy;
+	unsigned int *sum;
+	unsigned int *cnt;
+	unsigned char *out;
+} scaler_t;
+
+static int scaler_init(scaler_t *s, unsigned int w, unsigned int h)
+{
+	if (w == 0 || h == 0)
+		return -1;
+
+	/* Fit in THUMB_SIZE x THUMB_SIZE, never upscale */
+	if (w >= h) {
+		s->dst_w = w < THUMB_SIZE ? w : THUMB_SIZE;
+		s->dst_h = (unsigned long long)h * s->dst_w / w;
+	} else {
+		s->dst_h = h < THUMB_SIZE ? h : THUMB_SIZE;
+		s->dst_w = (unsigned long long)w * s->dst_h / h;
+	}
+	if (s->dst_w == 0)
+		s->dst_w = 1;
+	if (s->dst_h == 0)
+		s->dst_h = 1;
+
+	s->src_w = w;
+	s->src_h = h;
+	s->y = 0;
+	s->dy = 0;
+	s->sum = mem_calloc(FTPVITA_MEM_THUMB, s->dst_w * 3, sizeof(*s->sum));
+	s->cnt = mem_calloc(FTPVITA_MEM_THUMB, s->dst_w, sizeof(*s->cnt));
+	s->out = mem_calloc(FTPVITA_MEM_THUMB, s->dst_w * s->dst_h, 3);
+
+	return s->sum && s->cnt && s->out ? 0 : -1;
+}
+
+static void scaler_free(scaler_t *s)
+{
+	mem_free(s->sum);
+	mem_free(s->cnt);
+	mem_free(s->out);
+}
+
+static void scaler_emit(scaler_t *s)
+{
+	unsigned char *out = s->out + s->dy * s->dst_w * 3;
+	unsigned int x;
+
+	for (x = 0; x < s->dst_w; x++) {
+		if (s->cnt[x]) {
+			out[x * 3 + 0] = s->sum[x * 3 + 0] / s->cnt[x];
+			out[x * 3 + 1] = s->sum[x * 3 + 1] / s->cnt[x];
+			out[x * 3 + 2] = s->sum[x * 3 + 2] / s->cnt[x];
+		}
+	}
+	memset(s->sum, 0, s->dst_w * 3 * sizeof(*s->sum));
+	memset(s->cnt, 0, s->dst_w * sizeof(*s->cnt));
+}
+
+/* rgb is a source row, 3 bytes per pixel */
+static void scaler_row(scaler_t *s, const unsigned char *rgb)
+{
+	unsigned int x, dx;
+	unsigned int dy = (unsigned long long)s->y * s->dst_h / s->src_h;
+
+	if (s->y >= s->src_h)
+		return;
+
+	if (dy != s->dy) {
+		scaler_emit(s);
+		s->dy = dy;
+	}
+
+	for (x = 0; x < s->src_w; x++) {
+		dx = (unsigned long long)x * s->dst_w / s->src_w;
+		s->sum[dx * 3 + 0] += rgb[x * 3 + 0];
+		s->sum[dx * 3 + 1] += rgb[x * 3 + 1];
+		s->sum[dx * 3 + 2] += rgb[x * 3 + 2];
+		s->cnt[dx]++;
+	}
+
+	if (++s->y == s->src_h)
+		scaler_emit(s);
+}
+
+/* PNG: the IDAT chunks are inflated as they are read and each row is
+ * unfiltered, converted to RGB and fed to the scaler. Interlaced
+ * images are not supported */
+
+typedef struct {
+	SceUID fd;
+	/* Bytes left in the current IDAT chunk */
+	unsigned int idat_left;
+	int idat_end;
+	unsigned int width, height;
+	int depth, color, channels;
+	/* Bytes per complete pixel (at least 1) and per row */
+	unsigned int bpp, stride;
+	unsigned char palette[256][3];
+	/* Current row with its filter type byte, and the previous row */
+	unsigned char *row, *prev;
+	unsigned int row_pos;
+	unsigned char *rgb;
+	scaler_t *sc;
+} png_t;
+
+static unsigned int be32(const unsigned char *p)
+{
+	return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int read_full(SceUID fd, void *buf, unsigned int len)
+{
+	return sceIoRead(fd, buf, len) == len ? 0 : -1;
+}
+
+static int png_chunk_header(png_t *p, unsigned int *len, char *type)
+{
+	unsigned char h[8];
+
+	if (read_full(p->fd, h, sizeof(h)) < 0)
+		return -1;
+	*len = be32(h);
+	memcpy(type, h + 4, 4);
+	return 0;
+}
+
+static int png_read(void *arg, unsigned char *buf, unsigned int size)
+{
+	png_t *p = arg;
+	unsigned int len;
+	char type[4];
+	int n;
+
+	while (p->idat_left == 0) {
+		/* Skip the CRC, the next chunk must be an IDAT too */
+		if (p->idat_end || sceIoLseek(p->fd, 4, SCE_SEEK_CUR) < 0 ||
+		    png_chunk_header(p, &len, type) < 0 || memcmp(type, "IDAT", 4) != 0) {
+			p->idat_end = 1;
+			return 0;
+		}
+		p->idat_left = len;
+	}
+
+	n = sceIoRead(p->fd, buf, size < p->idat_left ? size : p->idat_left);
+	if (n <= 0)
+		return -1;
+	p->idat_left -= n;
+	return n;
+}
+
+static inline unsigned char paeth(unsigned char a, unsigned char b, unsigned char c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+static int png_unfilter(png_t *p)
+{
+	unsigned char *cur = p->row + 1, *prev = p->prev + 1;
+	unsigned int i, bpp = p->bpp;
+
+	switch (p->row[0]) {
+	case 0:
+		break;
+	case 1:
+		for (i = bpp; i < p->stride; i++)
+			cur[i] += cur[i - bpp];
+		break;
+	case 2:
+		for (i = 0; i < p->stride; i++)
+			cur[i] += prev[i];
+		break;
+	case 3:
+		for (i = 0; i < p->stride; i++)
+			cur[i] += ((i >= bpp ? cur[i - bpp] : 0) + prev[i]) >> 1;
+		break;
+	case 4:
+		for (i = 0; i < p->stride; i++)
+			cur[i] += paeth(i >= bpp ? cur[i - bpp] : 0, prev[i],
+				i >= bpp ? prev[i - bpp] : 0);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/* Sample s of the row, scaled to 8 bits unless it's a palette index */
+static unsigned int png_sample(const png_t *p, const unsigned char *row, unsigned int s)
+{
+	unsigned int bit, v;
+
+	if (p->depth == 8)
+		return row[s];
+	if (p->depth == 16)
+		return row[s * 2];
+
+	bit = s * p->depth;
+	v = (row[bit / 8] >> (8 - p->depth - bit % 8)) & ((1 << p->depth) - 1);
+	return p->color == 3 ? v : v * 255 / ((1 << p->depth) - 1);
+}
+
+static void png_convert_row(png_t *p)
+{
+	const unsigned char *row = p->row + 1;
+	unsigned char *rgb = p->rgb;
+	unsigned int x, c, v;
+
+	for (x = 0; x < p->width; x++, rgb += 3) {
+		switch (p->color) {
+		case 0:
+		case 4:
+			/* Gray, alpha is dropped */
+			rgb[0] = rgb[1] = rgb[2] = png_sample(p, row, x * p->channels);
+			break;
+		case 3:
+			v = png_sample(p, row, x);
+			memcpy(rgb, p->palette[v], 3);
+			break;
+		default:
+			for (c = 0; c < 3; c++)
+				rgb[c] = png_sample(p, row, x * p->channels + c);
+			break;
+		}
+	}
+}
+
+static int png_write(void *arg, const unsigned char *data, unsigned int len)
+{
+	png_t *p = arg;
+	unsigned int n;
+	unsigned char *tmp;
+
+	while (len > 0 && p->sc->y < p->height) {
+		n = p->stride + 1 - p->row_pos;
+		if (n > len)
+			n = len;
+		memcpy(p->row + p->row_pos, data, n);
+		p->row_pos += n;
+		data += n;
+		len -= n;
+
+		if (p->row_pos == p->stride + 1) {
+			if (png_unfilter(p) < 0)
+				return -1;
+			png_convert_row(p);
+			scaler_row(p->sc, p->rgb);
+
+			tmp = p->prev;
+			p->prev = p->row;
+			p->row = tmp;
+			p->row_pos = 0;
+		}
+	}
+	return 0;
+}
+
+static int png_decode(SceUID fd, scaler_t *sc)
+{
+	static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	unsigned char buf[13];
+	unsigned int len, i;
+	char type[4];
+	inflate_t *z = NULL;
+	png_t p;
+	int ret = -1;
+
+	memset(&p, 0, sizeof(p));
+	p.fd = fd;
+	p.sc = sc;
+
+	if (read_full(fd, buf, 8) < 0 || memcmp(buf, signature, 8) != 0)
+		return -1;
+
+	if (png_chunk_header(&p, &len, type) < 0 || memcmp(type, "IHDR", 4) != 0 ||
+	    len != 13 || read_full(fd, buf, 13) < 0)
+		return -1;
+	p.width = be32(buf);
+	p.height = be32(buf + 4);
+	p.depth = buf[8];
+	p.color = buf[9];
+	/* Compression, filter method, interlace */
+	if (buf[10] != 0 || buf[11] != 0 || buf[12] != 0)
+		return -1;
+	/* Same limit as JPEG, which keeps the row buffers reasonable */
+	if (p.width > 0xFFFF || p.height > 0xFFFF)
+		return -1;
+
+	switch (p.color) {
+	case 0: p.channels = 1; break;
+	case 2: p.channels = 3; break;
+	case 3: p.channels = 1; break;
+	case 4: p.channels = 2; break;
+	case 6: p.channels = 4; break;
+	default: return -1;
+	}
+	if (p.depth != 1 && p.depth != 2 && p.depth != 4 && p.depth != 8 && p.depth != 16)
+		return -1;
+	if ((p.color == 3 && p.depth > 8) || (p.color != 0 && p.color != 3 && p.depth < 8))
+		return -1;
+
+	p.bpp = (p.channels * p.depth + 7) / 8;
+	p.stride = ((unsigned long long)p.width * p.channels * p.depth + 7) / 8;
+
+	/* Skip to the first IDAT, keeping the palette */
+	sceIoLseek(fd, 4, SCE_SEEK_CUR);
+	while (1) {
+		if (png_chunk_header(&p, &len, type) < 0)
+			return -1;
+		if (memcmp(type, "IDAT", 4) == 0)
+			break;
+		if (memcmp(type, "PLTE", 4) == 0 && len <= sizeof(p.palette) && len % 3 == 0) {
+			if (read_full(fd, p.palette, len) < 0)
+				return -1;
+			len = 0;
+		}
+		if (sceIoLseek(fd, len + 4, SCE_SEEK_CUR) < 0)
+			return -1;
+	}
+	p.idat_left = len;
+
+	if (scaler_init(sc, p.width, p.height) < 0)
+		return -2;
+
+	p.row = mem_alloc(FTPVITA_MEM_THUMB, p.stride + 1);
+	p.prev = mem_calloc(FTPVITA_MEM_THUMB, p.stride + 1, 1);
+	p.rgb = mem_alloc(FTPVITA_MEM_THUMB, p.width * 3);
+	z = mem_alloc(FTPVITA_MEM_THUMB, sizeof(*z));
+	if (p.row == NULL || p.prev == NULL || p.rgb == NULL || z == NULL) {
+		ret = -2;
+		goto out;
+	}
+
+	/* zlib header: deflate, no preset dictionary */
+	if (p.idat_left < 2 || read_full(fd, buf, 2) < 0 || (buf[0] & 0x0F) != 8 || (buf[1] & 0x20) ||
+	    ((buf[0] << 8) | buf[1]) % 31 != 0)
+		goto out;
+	p.idat_left -= 2;
+
+	z->read = png_read;
+	z->write = png_write;
+	z->arg = &p;
+	inflate_run(z);
+
+	/* A truncated image still gives a thumbnail if most of it is there */
+	if (sc->y >= p.height / 2) {
+		for (i = sc->y; i < p.height; i++)
+			scaler_row(sc, p.rgb);
+		ret = 0;
+	}
+
+out:
+	mem_free(z);
+	mem_free(p.row);
+	mem_free(p.prev);
+	mem_free(p.rgb);
+	return ret;
+}
+
+/* Baseline JPEG, DC coefficients only: every 8x8 block gives a pixel */
+
+typedef struct {
+	int id;
+	int h, v;
+	int tq, td, ta;
+	/* DC of each block, in blocks of the component */
+	short *plane;
+	unsigned int pw, ph;
+	int pred;
+} jpeg_comp_t;
+
+typedef struct {
+	SceUID fd;
+	unsigned char buf[THUMB_READ_SIZE];
+	unsigned int pos, len;
+	unsigned int bitbuf;
+	int bitcnt;
+	/* Marker found in the entropy coded data */
+	int marker;
+	huff_t dc[4];
+	huff_t ac[4];
+	/* DC quantizer of each table */
+	unsigned short qt[4];
+	unsigned int width, height;
+	int ncomp;
+	int hmax, vmax;
+	unsigned int mcux, mcuy;
+	unsigned int restart_interval;
+	jpeg_comp_t comp[3];
+} jpeg_t;
+
+static int jpeg_byte(jpeg_t *j)
+{
+	int n;
+
+	if (j->pos == j->len) {
+		n = sceIoRead(j->fd, j->buf, sizeof(j->buf));
+		if (n <= 0)
+			return -1;
+		j->pos = 0;
+		j->len = n;
+	}
+	return j->buf[j->pos++];
+}
+
+static int jpeg_u16(jpeg_t *j)
+{
+	int hi = jpeg_byte(j);
+	int lo = jpeg_byte(j);
+
+	return hi < 0 || lo < 0 ? -1 : (hi << 8) | lo;
+}
+
+static int jpeg_bit(jpeg_t *j)
+{
+	int c;
+
+	if (j->bitcnt == 0) {
+		c = 0;
+		/* Past a marker the data is over, feed zeros */
+		if (!j->marker) {
+			c = jpeg_byte(j);
+			if (c == 0xFF) {
+				do {
+					j->marker = jpeg_byte(j);
+				} while (j->marker == 0xFF);
+				if (j->marker == 0)
+					c = 0xFF;
+				else
+					c = 0;
+			}
+			if (c < 0 || j->marker < 0) {
+				j->marker = 0xD9;
+				c = 0;
+			}
+		}
+		j->bitbuf = c;
+		j->bitcnt = 8;
+	}
+
+	j->bitcnt--;
+	return (j->bitbuf >> j->bitcnt) & 1;
+}
+
+static int jpeg_bits(jpeg_t *j, int n)
+{
+	int v = 0;
+
+	while (n--)
+		v = (v << 1) | jpeg_bit(j);
+	return v;
+}
+
+static int jpeg_decode_huff(jpeg_t *j, const huff_t *h)
+{
+	int code = 0, first = 0, index = 0;
+	int len, count;
+
+	for (len = 1; len <= 16; len++) {
+		code |= jpeg_bit(j);
+		count = h->count[len];
+		if (code - count < first)
+			return h->symbol[index + (code - first)];
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+/* Next marker, skipping whatever comes before it */
+static int jpeg_next_marker(jpeg_t *j)
+{
+	int c;
+
+	if (j->marker) {
+		c = j->marker;
+		j->marker = 0;
+		return c;
+	}
+
+	do {
+		while ((c = jpeg_byte(j)) != 0xFF) {
+			if (c < 0)
+				return -1;
+		}
+		while ((c = jpeg_byte(j)) == 0xFF)
+			;
+	} while (c == 0);
+
+	return c;
+}
+
+static int jpeg_skip(jpeg_t *j, int len)
+{
+	while (len-- > 0) {
+		if (jpeg_byte(j) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int jpeg_dqt(jpeg_t *j, int len)
+{
+	int pq, tq, q;
+
+	while (len > 0) {
+		pq = jpeg_byte(j);
+		if (pq < 0)
+			return -1;
+		tq = pq & 3;
+		pq >>= 4;
+		/* The DC quantizer comes first */
+		q = pq ? jpeg_u16(j) : jpeg_byte(j);
+		if (q < 0 || jpeg_skip(j, 63 * (pq ? 2 : 1)) < 0)
+			return -1;
+		j->qt[tq] = q;
+		len -= 1 + 64 * (pq ? 2 : 1);
+	}
+	return 0;
+}
+
+static int jpeg_dht(jpeg_t *j, int len)
+{
+	int tc, th, i, k, n, total, c;
+	unsigned char counts[16];
+	huff_t *h;
+
+	while (len > 0) {
+		c = jpeg_byte(j);
+		if (c < 0)
+			return -1;
+		tc = c >> 4;
+		th = c & 3;
+		total = 0;
+		for (i = 0; i < 16; i++) {
+			if ((c = jpeg_byte(j)) < 0)
+				return -1;
+			counts[i] = c;
+			total += c;
+		}
+		if (total > 256)
+			return -1;
+
+		/* Symbols come in code order, so build from lengths in order */
+		h = tc ? &j->ac[th] : &j->dc[th];
+		memset(h->count, 0, sizeof(h->count));
+		for (i = 0, n = 0; i < 16; i++) {
+			h->count[i + 1] = counts[i];
+			for (k = 0; k < counts[i]; k++) {
+				if ((c = jpeg_byte(j)) < 0)
+					return -1;
+				h->symbol[n++] = c;
+			}
+		}
+		len -= 17 + total;
+	}
+	return 0;
+}
 
-	return snprintf(out, n,
-		"%c%s 1 vita vita %u %s %-2d %s %s" FTPVITA_EOL,
-		dir ? 'd' : '-',
-		dir ? "rwxr-xr-x" : "rw-r--r--",
-		(unsigned int) stat->st_size,
-		num_to_month[stat->st_mtime.month<=0?0:(stat->st_mtime.month-1)%12],
-		stat->st_mtime.day,
-		yt,
-		filename);
+static int jpeg_sof(jpeg_t *j)
+{
+	int i, c, w, h;
+
+	if (jpeg_byte(j) != 8)
+		return -1;
+	h = jpeg_u16(j);
+	w = jpeg_u16(j);
+	j->ncomp = jpeg_byte(j);
+	if (w <= 0 || h <= 0 || (j->ncomp != 1 && j->ncomp != 3))
+		return -1;
+	j->width = w;
+	j->height = h;
+
+	j->hmax = 1;
+	j->vmax = 1;
+	for (i = 0; i < j->ncomp; i++) {
+		j->comp[i].id = jpeg_byte(j);
+		c = jpeg_byte(j);
+		j->comp[i].h = c >> 4;
+		j->comp[i].v = c & 15;
+		j->comp[i].tq = jpeg_byte(j) & 3;
+		if (j->comp[i].h < 1 || j->comp[i].h > 4 || j->comp[i].v < 1 || j->comp[i].v > 4)
+			return -1;
+		/* A single component is always one block per MCU */
+		if (j->ncomp == 1)
+			j->comp[i].h = j->comp[i].v = 1;
+		if (j->comp[i].h > j->hmax)
+			j->hmax = j->comp[i].h;
+		if (j->comp[i].v > j->vmax)
+			j->vmax = j->comp[i].v;
+	}
+
+	j->mcux = (j->width + 8 * j->hmax - 1) / (8 * j->hmax);
+	j->mcuy = (j->height + 8 * j->vmax - 1) / (8 * j->vmax);
+	for (i = 0; i < j->ncomp; i++) {
+		j->comp[i].pw = j->mcux * j->comp[i].h;
+		j->comp[i].ph = j->mcuy * j->comp[i].v;
+		j->comp[i].plane = mem_calloc(FTPVITA_MEM_THUMB, j->comp[i].pw * j->comp[i].ph, sizeof(short));
+		if (j->comp[i].plane == NULL)
+			return -2;
+	}
+	return 0;
 }
 
-static void send_LIST(ftpvita_client_info_t *client, const char *path)
+/* Decodes a block, keeping only its DC */
+static int jpeg_block(jpeg_t *j, jpeg_comp_t *c, unsigned int bx, unsigned int by)
+{
+	int t, k, rs, r, s, diff;
+
+	t = jpeg_decode_huff(j, &j->dc[c->td]);
+	if (t < 0 || t > 11)
+		return -1;
+	diff = 0;
+	if (t) {
+		diff = jpeg_bits(j, t);
+		if (diff < (1 << (t - 1)))
+			diff -= (1 << t) - 1;
+	}
+	c->pred += diff;
+	if (bx < c->pw && by < c->ph)
+		c->plane[by * c->pw + bx] = c->pred;
+
+	for (k = 1; k < 64; k++) {
+		rs = jpeg_decode_huff(j, &j->ac[c->ta]);
+		if (rs < 0)
+			return -1;
+		r = rs >> 4;
+		s = rs & 15;
+		if (s == 0) {
+			if (r != 15)
+				break;
+			k += 15;
+		} else {
+			k += r;
+			jpeg_bits(j, s);
+		}
+	}
+	return 0;
+}
+
+static int jpeg_restart(jpeg_t *j, jpeg_comp_t **comps, int n)
+{
+	int i, m;
+
+	j->bitcnt = 0;
+	m = jpeg_next_marker(j);
+	if (m < 0xD0 || m > 0xD7)
+		return -1;
+	for (i = 0; i < n; i++)
+		comps[i]->pred = 0;
+	return 0;
+}
+
+static int jpeg_sos(jpeg_t *j)
+{
+	jpeg_comp_t *comps[3], *c;
+	unsigned int mx, my, w, h, done = 0;
+	int n, i, k, id, t, x, y;
+
+	n = jpeg_byte(j);
+	if (n < 1 || n > j->ncomp)
+		return -1;
+	for (i = 0; i < n; i++) {
+		id = jpeg_byte(j);
+		t = jpeg_byte(j);
+		comps[i] = NULL;
+		for (k = 0; k < j->ncomp; k++) {
+			if (j->comp[k].id == id)
+				comps[i] = &j->comp[k];
+		}
+		if (comps[i] == NULL || t < 0)
+			return -1;
+		comps[i]->td = (t >> 4) & 3;
+		comps[i]->ta = t & 3;
+		comps[i]->pred = 0;
+	}
+	/* Spectral selection and approximation, fixed in baseline */
+	if (jpeg_skip(j, 3) < 0)
+		return -1;
+
+	j->bitcnt = 0;
+	j->marker = 0;
+
+	if (n == 1) {
+		/* Non interleaved: the blocks of the component in order */
+		c = comps[0];
+		w = ((j->width * c->h + j->hmax - 1) / j->hmax + 7) / 8;
+		h = ((j->height * c->v + j->vmax - 1) / j->vmax + 7) / 8;
+		for (my = 0; my < h; my++) {
+			for (mx = 0; mx < w; mx++) {
+				if (j->restart_interval && done && done % j->restart_interval == 0 &&
+				    jpeg_restart(j, comps, n) < 0)
+					return -1;
+				if (jpeg_block(j, c, mx, my) < 0)
+					return -1;
+				done++;
+			}
+		}
+		return 0;
+	}
+
+	for (my = 0; my < j->mcuy; my++) {
+		for (mx = 0; mx < j->mcux; mx++) {
+			if (j->restart_interval && done && done % j->restart_interval == 0 &&
+			    jpeg_restart(j, comps, n) < 0)
+				return -1;
+			for (i = 0; i < n; i++) {
+				c = comps[i];
+				for (y = 0; y < c->v; y++) {
+					for (x = 0; x < c->h; x++) {
+						if (jpeg_block(j, c, mx * c->h + x, my * c->v + y) < 0)
+							return -1;
+					}
+				}
+			}
+			done++;
+		}
+	}
+	return 0;
+}
+
+static inline unsigned char clamp_u8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* DC value of the component at image block (x, y) as a pixel */
+static int jpeg_dc_pixel(const jpeg_t *j, const jpeg_comp_t *c, unsigned int x, unsigned int y)
+{
+	unsigned int bx = x * c->h / j->hmax;
+	unsigned int by = y * c->v / j->vmax;
+
+	/* The DC is 8 times the block's mean */
+	return c->plane[by * c->pw + bx] * j->qt[c->tq] / 8 + 128;
+}
+
+static int jpeg_output(jpeg_t *j, scaler_t *sc)
+{
+	unsigned int w = (j->width + 7) / 8;
+	unsigned int h = (j->height + 7) / 8;
+	unsigned int x, y;
+	unsigned char *rgb, *p;
+	int Y, cb, cr;
+
+	if (scaler_init(sc, w, h) < 0)
+		return -2;
+	rgb = mem_alloc(FTPVITA_MEM_THUMB, w * 3);
+	if (rgb == NULL)
+		return -2;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0, p = rgb; x < w; x++, p += 3) {
+			Y = jpeg_dc_pixel(j, &j->comp[0], x, y);
+			if (j->ncomp == 1) {
+				p[0] = p[1] = p[2] = clamp_u8(Y);
+				continue;
+			}
+			cb = jpeg_dc_pixel(j, &j->comp[1], x, y) - 128;
+			cr = jpeg_dc_pixel(j, &j->comp[2], x, y) - 128;
+			p[0] = clamp_u8(Y + ((91881 * cr) >> 16));
+			p[1] = clamp_u8(Y - ((22554 * cb + 46802 * cr) >> 16));
+			p[2] = clamp_u8(Y + ((116130 * cb) >> 16));
+		}
+		scaler_row(sc, rgb);
+	}
+
+	mem_free(rgb);
+	return 0;
+}
+
+static int jpeg_decode(SceUID fd, scaler_t *sc)
+{
+	jpeg_t *j;
+	int m, len, i, ret = -1, scans = 0;
+
+	j = mem_calloc(FTPVITA_MEM_THUMB, 1, sizeof(*j));
+	if (j == NULL)
+		return -2;
+	j->fd = fd;
+
+	if (jpeg_byte(j) != 0xFF || jpeg_byte(j) != 0xD8)
+		goto out;
+
+	while (1) {
+		m = jpeg_next_marker(j);
+		if (m < 0 || m == 0xD9)
+			break;
+		if (m == 0x01 || (m >= 0xD0 && m <= 0xD7))
+			continue;
+
+		len = jpeg_u16(j) - 2;
+		if (len < 0)
+			break;
+
+		if (m == 0xC0 || m == 0xC1) {
+			if (j->ncomp || (ret = jpeg_sof(j)) < 0)
+				goto out;
+			ret = -1;
+		} else if ((m & 0xF0) == 0xC0 && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+			/* Progressive, lossless, arithmetic coding */
+			goto out;
+		} else if (m == 0xC4) {
+			if (jpeg_dht(j, len) < 0)
+				goto out;
+		} else if (m == 0xDB) {
+			if (jpeg_dqt(j, len) < 0)
+				goto out;
+		} else if (m == 0xDD) {
+			j->restart_interval = jpeg_u16(j);
+		} else if (m == 0xDA) {
+			if (!j->ncomp || jpeg_sos(j) < 0)
+				break;
+			scans++;
+		} else if (jpeg_skip(j, len) < 0) {
+			break;
+		}
+	}
+
+	/* Whatever was decoded, a broken end is still a thumbnail */
+	if (scans > 0)
+		ret = jpeg_output(j, sc);
+
+out:
+	for (i = 0; i < 3; i++)
+		mem_free(j->comp[i].plane);
+	mem_free(j);
+	return ret;
+}
+
+static int thumb_write_bmp(const char *path, const scaler_t *sc)
+{
+	unsigned char header[54];
+	unsigned int stride = (sc->dst_w * 3 + 3) & ~3;
+	unsigned int size = sizeof(header) + stride * sc->dst_h;
+	unsigned char *row;
+	unsigned int x, y;
+	SceUID fd;
+	int ret = 0;
+
+	memset(header, 0, sizeof(header));
+	header[0] = 'B';
+	header[1] = 'M';
+	memcpy(header + 2, &size, 4);
+	header[10] = sizeof(header);
+	header[14] = 40;
+	memcpy(header + 18, &sc->dst_w, 4);
+	memcpy(header + 22, &sc->dst_h, 4);
+	header[26] = 1;
+	header[28] = 24;
+
+	row = mem_calloc(FTPVITA_MEM_THUMB, stride, 1);
+	if (row == NULL)
+		return -2;
+
+	fd = sceIoOpen(path, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0777);
+	if (fd < 0) {
+		mem_free(row);
+		return -2;
+	}
+
+	if (sceIoWrite(fd, header, sizeof(header)) != sizeof(header))
+		ret = -2;
+
+	/* Bottom-up, BGR */
+	for (y = sc->dst_h; y-- > 0 && ret == 0; ) {
+		for (x = 0; x < sc->dst_w; x++) {
+			row[x * 3 + 0] = sc->out[(y * sc->dst_w + x) * 3 + 2];
+			row[x * 3 + 1] = sc->out[(y * sc->dst_w + x) * 3 + 1];
+			row[x * 3 + 2] = sc->out[(y * sc->dst_w + x) * 3 + 0];
+		}
+		if (sceIoWrite(fd, row, stride) != stride)
+			ret = -2;
+	}
+
+	sceIoClose(fd);
+	mem_free(row);
+	return ret;
+}
+
+/* Decodes path and writes its thumbnail to thumb_path. Returns 0 on
+ * success, -1 if it's not an image we can decode, -2 on other errors */
+static int thumb_generate(const char *path, const char *thumb_path)
+{
+	char tmp_path[PATH_MAX + 16];
+	unsigned char magic[2];
+	scaler_t sc;
+	SceIoStat stat;
+	SceUID fd;
+	int ret;
+
+	fd = sceIoOpen(path, SCE_O_RDONLY, 0777);
+	if (fd < 0)
+		return -2;
+
+	memset(&sc, 0, sizeof(sc));
+	if (read_full(fd, magic, sizeof(magic)) < 0) {
+		ret = -1;
+	} else {
+		sceIoLseek(fd, 0, SCE_SEEK_SET);
+		if (magic[0] == 0xFF && magic[1] == 0xD8)
+			ret = jpeg_decode(fd, &sc);
+		else if (magic[0] == 0x89 && magic[1] == 'P')
+			ret = png_decode(fd, &sc);
+		else
+			ret = -1;
+	}
+	sceIoClose(fd);
+
+	/* Written aside and renamed, so nobody sees half a thumbnail */
+	if (ret == 0) {
+		snprintf(tmp_path, sizeof(tmp_path), "%s.%08X", thumb_path,
+			sceKernelGetThreadId());
+		ret = thumb_write_bmp(tmp_path, &sc);
+		if (ret == 0 && sceIoRename(tmp_path, thumb_path) < 0) {
+			/* Another session may have just made the same one */
+			sceIoRemove(tmp_path);
+			if (sceIoGetstat(thumb_path, &stat) < 0)
+				ret = -2;
+		} else if (ret < 0) {
+			sceIoRemove(tmp_path);
+		}
+	}
+
+	scaler_free(&sc);
+	return ret;
+}
+
+typedef struct {
+	const char *path;
+	const char *thumb_path;
+	int result;
+	/* Signaled once the thumbnail is generated */
+	SceUID sema;
+} thumb_job_t;
+
+static struct {
+	thumb_job_t *jobs[THUMB_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	SceUID mtx;
+	SceUID jobs_sema;
+	SceUID free_sema;
+	SceUID thids[THUMB_WORKERS];
+	int started;
+	int quit;
+} thumb_pool;
+
+static int thumb_worker_thread(SceSize args, void *argp)
+{
+	thumb_job_t *job;
+
+	while (1) {
+		sceKernelWaitSema(thumb_pool.jobs_sema, 1, NULL);
+
+		sceKernelLockMutex(thumb_pool.mtx, 1, NULL);
+		if (thumb_pool.head == thumb_pool.tail) {
+			sceKernelUnlockMutex(thumb_pool.mtx, 1);
+			if (thumb_pool.quit)
+				break;
+			continue;
+		}
+		job = thumb_pool.jobs[thumb_pool.tail % THUMB_QUEUE_SIZE];
+		thumb_pool.tail++;
+		sceKernelUnlockMutex(thumb_pool.mtx, 1);
+		sceKernelSignalSema(thumb_pool.free_sema, 1);
+
+		job->result = thumb_generate(job->path, job->thumb_path);
+		sceKernelSignalSema(job->sema, 1);
+	}
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static void thumb_pool_init()
 {
+	char name[32];
 	int i;
-	char buffer[512];
-	SceUID dir;
-	SceIoDirent dirent;
+
+	thumb_pool.head = 0;
+	thumb_pool.tail = 0;
+	thumb_pool.started = 0;
+	thumb_pool.quit = 0;
+
+	thumb_pool.mtx = sceKernelCreateMutex("FTPVita_thumb_mutex", 0, 0, NULL);
+	thumb_pool.jobs_sema = sceKernelCreateSema("FTPVita_thumb_jobs_sema", 0, 0,
+		THUMB_QUEUE_SIZE + THUMB_WORKERS, NULL);
+	thumb_pool.free_sema = sceKernelCreateSema("FTPVita_thumb_free_sema", 0,
+		THUMB_QUEUE_SIZE, THUMB_QUEUE_SIZE, NULL);
+
+	/* Decoding is background work, below the transfers */
+	for (i = 0; i < THUMB_WORKERS; i++) {
+		/* Thumbnails are generated inline without the queue */
+		if (thumb_pool.mtx < 0 || thumb_pool.jobs_sema < 0 || thumb_pool.free_sema < 0) {
+			thumb_pool.thids[i] = -1;
+			continue;
+		}
+		sprintf(name, "FTPVita_thumb_worker_%i", i);
+		thumb_pool.thids[i] = sceKernelCreateThread(name,
+			thumb_worker_thread, 0x10000100 + 10, 0x4000, 0, 0, NULL);
+		DEBUG("Thumbnail worker %i UID: 0x%08X\n", i, thumb_pool.thids[i]);
+		if (thumb_pool.thids[i] >= 0 &&
+		    sceKernelStartThread(thumb_pool.thids[i], 0, NULL) < 0) {
+			sceKernelDeleteThread(thumb_pool.thids[i]);
+			thumb_pool.thids[i] = -1;
+		}
+		if (thumb_pool.thids[i] >= 0)
+			thumb_pool.started++;
+	}
+}
+
+static void thumb_pool_fini()
+{
+	int i;
+
+	thumb_pool.quit = 1;
+	sceKernelSignalSema(thumb_pool.jobs_sema, THUMB_WORKERS);
+	for (i = 0; i < THUMB_WORKERS; i++) {
+		if (thumb_pool.thids[i] >= 0)
+			sceKernelWaitThreadEnd(thumb_pool.thids[i], NULL, NULL);
+	}
+
+	sceKernelDeleteSema(thumb_pool.free_sema);
+	sceKernelDeleteSema(thumb_pool.jobs_sema);
+	sceKernelDeleteMutex(thumb_pool.mtx);
+}
+
+/* Generates the thumbnail on the pool and waits for it, or on the
+ * calling thread if no worker could be started */
+static int thumb_pool_run(const char *path, const char *thumb_path)
+{
+	thumb_job_t job;
+
+	if (thumb_pool.started == 0)
+		return thumb_generate(path, thumb_path);
+
+	job.path = path;
+	job.thumb_path = thumb_path;
+	job.result = -2;
+	job.sema = sceKernelCreateSema("FTPVita_thumb_done_sema", 0, 0, 1, NULL);
+	if (job.sema < 0)
+		return thumb_generate(path, thumb_path);
+
+	sceKernelWaitSema(thumb_pool.free_sema, 1, NULL);
+
+	sceKernelLockMutex(thumb_pool.mtx, 1, NULL);
+	thumb_pool.jobs[thumb_pool.head % THUMB_QUEUE_SIZE] = &job;
+	thumb_pool.head++;
+	sceKernelUnlockMutex(thumb_pool.mtx, 1);
+
+	sceKernelSignalSema(thumb_pool.jobs_sema, 1);
+
+	sceKernelWaitSema(job.sema, 1, NULL);
+	sceKernelDeleteSema(job.sema);
+
+	return job.result;
+}
+
+/* Path of the cached thumbnail of the file, which changes along with
+ * its size or modification time */
+static void thumb_cache_path(const char *path, const SceIoStat *stat, char *out, size_t size)
+{
+	unsigned long long h = 0xCBF29CE484222325ULL;
+	const unsigned char *p;
+	unsigned int i;
+
+	for (p = (const unsigned char *)path; *p; p++)
+		h = (h ^ *p) * 0x100000001B3ULL;
+	for (p = (const unsigned char *)&stat->st_mtime, i = 0; i < sizeof(stat->st_mtime); i++)
+		h = (h ^ p[i]) * 0x100000001B3ULL;
+	for (p = (const unsigned char *)&stat->st_size, i = 0; i < sizeof(stat->st_size); i++)
+		h = (h ^ p[i]) * 0x100000001B3ULL;
+
+	snprintf(out, size, "%s/%016llx.bmp", THUMB_CACHE_DIR, h);
+}
+
+/* SITE THUMB path: sends a BMP thumbnail of the JPEG or PNG image over
+ * the data connection. Paths with spaces can be quoted */
+static void cmd_SITE_THUMB_func(ftpvita_client_info_t *client)
+{
+	char cmd_path[PATH_MAX];
+	char path[PATH_MAX];
+	char thumb_path[PATH_MAX];
+	const char *args = client->recv_cmd_args;
+	const char *vita_path;
+	unsigned char *data;
 	SceIoStat stat;
-	char *devname;
-	int send_devices = 0;
+	SceUID fd;
+	int len, ret, n;
 
-	/* "/" path is a special case, if we are here we have
-	 * to send the list of devices (aka mountpoints). */
-	if (strcmp(path, "/") == 0) {
-		send_devices = 1;
+	while (*args == ' ')
+		args++;
+	if (*args == '"')
+		n = sscanf(args + 1, "%[^\"]", cmd_path);
+	else
+		n = sscanf(args, "%[^\r\n\t]", cmd_path);
+	if (n < 1) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters." FTPVITA_EOL);
+		return;
 	}
 
-	if (!send_devices) {
-		dir = sceIoDopen(get_vita_path(path));
-		if (dir < 0) {
-			client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
+	gen_fullpath(client->cur_path, cmd_path, path, sizeof(path));
+	vita_path = get_vita_path(path);
+	if (vita_path == NULL || sceIoGetstat(vita_path, &stat) < 0 || SCE_S_ISDIR(stat.st_mode)) {
+		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+		return;
+	}
+
+	thumb_cache_path(vita_path, &stat, thumb_path, sizeof(thumb_path));
+
+	if ((fd = sceIoOpen(thumb_path, SCE_O_RDONLY, 0777)) >= 0) {
+		STAT_INC(thumb_hits);
+	} else {
+		STAT_INC(thumb_misses);
+		mkdir_parents(thumb_path);
+		ret = thumb_pool_run(vita_path, thumb_path);
+		if (ret == -1) {
+			client_send_ctrl_msg(client, "550 Not a supported image." FTPVITA_EOL);
+			return;
+		}
+		if (ret < 0 || (fd = sceIoOpen(thumb_path, SCE_O_RDONLY, 0777)) < 0) {
+			client_send_ctrl_msg(client, "451 Could not generate the thumbnail." FTPVITA_EOL);
 			return;
 		}
 	}
 
-	client_send_ctrl_msg(client, "150 Opening ASCII mode data transfer for LIST." FTPVITA_EOL);
+	/* Thumbnails are small, send it in one go */
+	len = sceIoLseek32(fd, 0, SCE_SEEK_END);
+	sceIoLseek32(fd, 0, SCE_SEEK_SET);
+	data = len > 0 ? mem_alloc(FTPVITA_MEM_THUMB, len) : NULL;
+	if (data == NULL || sceIoRead(fd, data, len) != len) {
+		sceIoClose(fd);
+		mem_free(data);
+		client_send_ctrl_msg(client, "451 Could not read the thumbnail." FTPVITA_EOL);
+		return;
+	}
+	sceIoClose(fd);
 
 	client_open_data_connection(client);
+	client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
+	client_send_data_raw(client, data, len);
+	STAT_ADD(bytes_sent, len);
+	__atomic_fetch_add(&client->bytes_sent, len, __ATOMIC_RELAXED);
+	client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
+	client_close_data_connection(client);
 
-	if (send_devices) {
-		for (i = 0; i < MAX_DEVICES; i++) {
-			if (device_list[i].valid) {
-				devname = device_list[i].name;
-				if (sceIoGetstat(devname, &stat) >= 0) {
-					gen_list_format(buffer, sizeof(buffer),	1, &stat, devname);
-					client_send_data_msg(client, buffer);
-				}
-			}
-		}
+	mem_free(data);
+}
+#endif
+
+#if FTPVITA_FEATURE_EXTRACT
+/* SITE EXTRACT: unpacks a zip or tar archive already on the device.
+ * The archive is read ahead with async reads, one block in flight
+ * while the previous one is used, and the output is gathered into
+ * large writes. Zip entries are independent, so several workers inflate
+ * them at once, each with its own handle on the archive; a tar is a
+ * single stream and gets one. */
+
+#define EXTRACT_WORKERS    FTPVITA_EXTRACT_WORKERS
+#define EXTRACT_READ_SIZE  FTPVITA_EXTRACT_READ_SIZE
+#define EXTRACT_WRITE_SIZE FTPVITA_EXTRACT_WRITE_SIZE
+/* Interval between progress lines, in units of 100 ms */
+#define EXTRACT_PROGRESS_TICKS 10
+
+#define ZIP_LOCAL_SIG   0x04034B50
+#define ZIP_CENTRAL_SIG 0x02014B50
+#define ZIP_END_SIG     0x06054B50
+#define TAR_BLOCK       512
+
+typedef struct {
+	const char *name;
+	unsigned int name_len;
+	unsigned int flags;
+	unsigned int method;
+	unsigned int crc;
+	unsigned int csize;
+	unsigned int usize;
+	unsigned int offset;
+} zip_entry_t;
+
+typedef struct {
+	/* Device paths of the archive and of the destination directory */
+	const char *archive;
+	const char *dest;
+	int src_dev;
+	int dst_dev;
+	volatile int *cancelled;
+	/* Zip central directory and its entries, taken in order */
+	unsigned char *dir;
+	zip_entry_t *entries;
+	unsigned int n_entries;
+	unsigned int next;
+	/* Workers still running */
+	unsigned int running;
+	/* Totals */
+	unsigned long long bytes;
+	unsigned int files;
+	unsigned int dirs;
+	unsigned int errors;
+	/* First entry that couldn't be extracted */
+	int has_failed;
+	char failed[PATH_MAX];
+} extract_t;
+
+/* Archive reader: buf[cur] is being consumed while the next block is
+ * read into the other buffer */
+typedef struct {
+	SceUID fd;
+	int dev;
+	unsigned char *buf[2];
+	int cur;
+	unsigned int pos;
+	unsigned int len;
+	/* Size of the read in flight, 0 if none */
+	unsigned int want;
+	int async;
+	SceUInt64 t;
+	/* Bytes of the archive not requested yet */
+	unsigned long long left;
+	/* Bytes used since the start */
+	unsigned long long consumed;
+} ex_reader_t;
+
+/* Output file, written EXTRACT_WRITE_SIZE bytes at a time */
+typedef struct {
+	SceUID fd;
+	int dev;
+	unsigned char *buf;
+	unsigned int len;
+	unsigned long long total;
+	unsigned int crc;
+	int error;
+} ex_writer_t;
+
+/* What each worker needs to extract an entry */
+typedef struct {
+	extract_t *x;
+	ex_reader_t r;
+	ex_writer_t w;
+	inflate_t *z;
+} extract_io_t;
+
+static inline unsigned int le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static inline unsigned int le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static int extract_cancelled(const extract_t *x)
+{
+	return x->cancelled && *x->cancelled;
+}
+
+static void extract_fail(extract_t *x, const char *name)
+{
+	__atomic_fetch_add(&x->errors, 1, __ATOMIC_RELAXED);
+	if (!__atomic_exchange_n(&x->has_failed, 1, __ATOMIC_RELAXED))
+		snprintf(x->failed, sizeof(x->failed), "%s", name);
+}
+
+/* Requests the next block, read blocking later if it can't be async */
+static void ex_reader_issue(ex_reader_t *r)
+{
+	r->want = r->left < EXTRACT_READ_SIZE ? r->left : EXTRACT_READ_SIZE;
+	if (r->want == 0)
+		return;
+	r->left -= r->want;
+	r->t = sceKernelGetProcessTimeWide();
+	r->async = io_mode == FTPVITA_IO_ASYNC &&
+		sceIoReadAsync(r->fd, r->buf[r->cur ^ 1], r->want) >= 0;
+}
+
+/* Reads len bytes from the current offset of the file */
+static void ex_reader_start(ex_reader_t *r, unsigned long long len)
+{
+	r->pos = 0;
+	r->len = 0;
+	r->left = len;
+	ex_reader_issue(r);
+}
+
+/* Waits for the read in flight, the buffer can't go away under it */
+static void ex_reader_stop(ex_reader_t *r)
+{
+	SceInt64 res;
+
+	if (r->want && r->async)
+		sceIoWaitAsync(r->fd, &res);
+	r->want = 0;
+}
+
+/* Bytes available in the current buffer, 0 at the end, < 0 on errors */
+static int ex_reader_avail(extract_io_t *c)
+{
+	ex_reader_t *r = &c->r;
+	SceInt64 res;
+
+	if (r->pos < r->len)
+		return r->len - r->pos;
+	if (r->want == 0)
+		return 0;
+
+	if (r->async) {
+		if (sceIoWaitAsync(r->fd, &res) < 0)
+			res = -1;
 	} else {
-		memset(&dirent, 0, sizeof(dirent));
+		res = sceIoRead(r->fd, r->buf[r->cur ^ 1], r->want);
+	}
+	stat_io(r->dev, IO_OP_READ, res > 0 ? res : 0, sceKernelGetProcessTimeWide() - r->t);
+
+	/* Short reads mean a truncated archive */
+	if (res != r->want) {
+		r->want = 0;
+		return -1;
+	}
+
+	r->cur ^= 1;
+	r->pos = 0;
+	r->len = res;
+	ex_reader_issue(r);
+
+	if (extract_cancelled(c->x))
+		return -1;
+	return r->len;
+}
+
+static int ex_read(extract_io_t *c, void *buf, unsigned int len)
+{
+	unsigned char *out = buf;
+	int n;
+
+	while (len > 0) {
+		n = ex_reader_avail(c);
+		if (n <= 0)
+			return -1;
+		if (n > len)
+			n = len;
+		memcpy(out, c->r.buf[c->r.cur] + c->r.pos, n);
+		c->r.pos += n;
+		c->r.consumed += n;
+		out += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int ex_skip(extract_io_t *c, unsigned long long len)
+{
+	int n;
+
+	while (len > 0) {
+		n = ex_reader_avail(c);
+		if (n <= 0)
+			return -1;
+		if (n > len)
+			n = len;
+		c->r.pos += n;
+		c->r.consumed += n;
+		len -= n;
+	}
+	return 0;
+}
 
-		while (sceIoDread(dir, &dirent) > 0) {
-			gen_list_format(buffer, sizeof(buffer), SCE_S_ISDIR(dirent.d_stat.st_mode),
-				&dirent.d_stat, dirent.d_name);
-			client_send_data_msg(client, buffer);
-			memset(&dirent, 0, sizeof(dirent));
-			memset(buffer, 0, sizeof(buffer));
-		}
+static void ex_writer_start(ex_writer_t *w, SceUID fd)
+{
+	w->fd = fd;
+	w->len = 0;
+	w->total = 0;
+	w->crc = 0;
+	w->error = 0;
+}
 
-		sceIoDclose(dir);
+static int ex_writer_flush(ex_writer_t *w)
+{
+	SceUInt64 t = sceKernelGetProcessTimeWide();
+	int n;
+
+	if (w->len > 0 && !w->error) {
+		n = sceIoWrite(w->fd, w->buf, w->len);
+		stat_io(w->dev, IO_OP_WRITE, n > 0 ? n : 0, sceKernelGetProcessTimeWide() - t);
+		if (n != w->len)
+			w->error = 1;
 	}
+	w->len = 0;
 
-	DEBUG("Done sending LIST\n");
+	return w->error ? -1 : 0;
+}
 
-	client_close_data_connection(client);
-	client_send_ctrl_msg(client, "226 Transfer complete." FTPVITA_EOL);
+static int ex_write(extract_io_t *c, const unsigned char *data, unsigned int len)
+{
+	ex_writer_t *w = &c->w;
+	unsigned int n;
+
+#if FTPVITA_FEATURE_HASH
+	w->crc = crc32_update(w->crc, data, len);
+#endif
+	w->total += len;
+	__atomic_fetch_add(&c->x->bytes, len, __ATOMIC_RELAXED);
+
+	while (len > 0) {
+		n = EXTRACT_WRITE_SIZE - w->len;
+		if (n > len)
+			n = len;
+		memcpy(w->buf + w->len, data, n);
+		w->len += n;
+		data += n;
+		len -= n;
+
+		if (w->len == EXTRACT_WRITE_SIZE && ex_writer_flush(w) < 0)
+			return -1;
+	}
+
+	return extract_cancelled(c->x) ? -1 : 0;
 }
 
-static void cmd_LIST_func(ftpvita_client_info_t *client)
+/* Stored data goes from the read buffer to the write buffer */
+static int ex_copy(extract_io_t *c, unsigned long long len)
 {
-	char list_path[PATH_MAX];
-	int list_cur_path = 1;
+	int n;
+
+	while (len > 0) {
+		n = ex_reader_avail(c);
+		if (n <= 0)
+			return -1;
+		if (n > len)
+			n = len;
+		c->r.pos += n;
+		c->r.consumed += n;
+		len -= n;
+		if (ex_write(c, c->r.buf[c->r.cur] + c->r.pos - n, n) < 0)
+			return -1;
+	}
+	return 0;
+}
 
-	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", list_path);
+static int ex_inflate_read(void *arg, unsigned char *buf, unsigned int size)
+{
+	extract_io_t *c = arg;
+	int n = ex_reader_avail(c);
 
-	if (n > 0 && file_exists(get_vita_path(list_path)))
-		list_cur_path = 0;
+	if (n <= 0)
+		return -1;
+	if (n > size)
+		n = size;
+	memcpy(buf, c->r.buf[c->r.cur] + c->r.pos, n);
+	c->r.pos += n;
+	c->r.consumed += n;
+	return n;
+}
 
-	if (list_cur_path)
-		send_LIST(client, client->cur_path);
-	else
-		send_LIST(client, list_path);
+static int ex_inflate_write(void *arg, const unsigned char *data, unsigned int len)
+{
+	return ex_write(arg, data, len);
 }
 
-static void cmd_PWD_func(ftpvita_client_info_t *client)
+static int extract_io_init(extract_io_t *c, extract_t *x)
 {
-	char msg[PATH_MAX];
-	snprintf(msg, sizeof(msg), "257 \"%s\" is the current directory." FTPVITA_EOL, client->cur_path);
-	client_send_ctrl_msg(client, msg);
+	memset(c, 0, sizeof(*c));
+	c->x = x;
+	c->r.dev = x->src_dev;
+	c->w.dev = x->dst_dev;
+
+	c->r.fd = sceIoOpen(x->archive, SCE_O_RDONLY, 0777);
+	if (c->r.fd < 0)
+		return -1;
+
+	c->r.buf[0] = mem_alloc(FTPVITA_MEM_EXTRACT, EXTRACT_READ_SIZE);
+	c->r.buf[1] = mem_alloc(FTPVITA_MEM_EXTRACT, EXTRACT_READ_SIZE);
+	c->w.buf = mem_alloc(FTPVITA_MEM_EXTRACT, EXTRACT_WRITE_SIZE);
+	c->z = mem_alloc(FTPVITA_MEM_EXTRACT, sizeof(*c->z));
+	if (c->r.buf[0] == NULL || c->r.buf[1] == NULL || c->w.buf == NULL || c->z == NULL)
+		return -1;
+
+	c->z->read = ex_inflate_read;
+	c->z->write = ex_inflate_write;
+	c->z->arg = c;
+	return 0;
 }
 
-static int path_is_at_root(const char *path)
+static void extract_io_fini(extract_io_t *c)
 {
-	return strrchr(path, '/') == (path + strlen(path) - 1);
+	ex_reader_stop(&c->r);
+	if (c->r.fd >= 0)
+		sceIoClose(c->r.fd);
+	mem_free(c->r.buf[0]);
+	mem_free(c->r.buf[1]);
+	mem_free(c->w.buf);
+	mem_free(c->z);
 }
 
-static void dir_up(char *path)
+/* Destination of an entry, refusing names that would escape dest */
+static int extract_path(const extract_t *x, const char *name, char *path, size_t size)
 {
-	char *pch;
-	size_t len_in = strlen(path);
-	if (len_in == 1) {
-		strcpy(path, "/");
-		return;
+	const char *p = name;
+	size_t len;
+
+	if (name[0] == '\0' || name[0] == '/' || name[0] == '\\' || strchr(name, ':'))
+		return -1;
+
+	while (*p) {
+		len = strcspn(p, "/\\");
+		if (len == 2 && p[0] == '.' && p[1] == '.')
+			return -1;
+		p += len;
+		if (*p)
+			p++;
 	}
-	if (path_is_at_root(path)) { /* Case root of the device (/foo0:/) */
-		strcpy(path, "/");
-	} else {
-		pch = strrchr(path, '/');
-		size_t s = len_in - (pch - path);
-		memset(pch, '\0', s);
-		/* If the path is like: /foo: add slash */
-		if (strrchr(path, '/') == path)
-			strcat(path, "/");
+
+	if (snprintf(path, size, "%s/%s", x->dest, name) >= size)
+		return -1;
+	for (p = path; *p; p++) {
+		if (*p == '\\')
+			path[p - path] = '/';
 	}
+	return 0;
 }
 
-static void cmd_CWD_func(ftpvita_client_info_t *client)
+/* Creates the file and fills it with len bytes from the reader, stored
+ * or deflated. Returns 0 on success */
+static int extract_file(extract_io_t *c, const char *path, int deflated,
+			unsigned long long len, unsigned long long size)
 {
-	char cmd_path[PATH_MAX];
-	char tmp_path[PATH_MAX];
-	SceUID pd;
-	int n = sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+	SceUID fd;
+	int ret;
 
-	if (n < 1) {
-		client_send_ctrl_msg(client, "500 Syntax error, command unrecognized." FTPVITA_EOL);
-	} else {
-		if (strcmp(cmd_path, "/") == 0) {
-			strcpy(client->cur_path, cmd_path);
-		} else  if (strcmp(cmd_path, "..") == 0) {
-			dir_up(client->cur_path);
-		} else {
-			if (cmd_path[0] == '/') { /* Full path */
-				strcpy(tmp_path, cmd_path);
-			} else { /* Change dir relative to current dir */
-				/* If we are at the root of the device, don't add
-				 * an slash to add new path */
-				if (path_is_at_root(client->cur_path))
-					snprintf(tmp_path, sizeof(tmp_path), "%s%s", client->cur_path, cmd_path);
-				else
-					snprintf(tmp_path, sizeof(tmp_path), "%s/%s", client->cur_path, cmd_path);
-			}
+	mkdir_parents(path);
+	fd = sceIoOpen(path, SCE_O_WRONLY | SCE_O_CREAT | SCE_O_TRUNC, 0777);
+	if (fd < 0)
+		return -1;
 
-			/* If the path is like: /foo: add an slash */
-			if (strrchr(tmp_path, '/') == tmp_path)
-				strcat(tmp_path, "/");
+	ex_writer_start(&c->w, fd);
+	ret = deflated ? inflate_run(c->z) : ex_copy(c, len);
 
-			/* If the path is not "/", check if it exists */
-			if (strcmp(tmp_path, "/") != 0) {
-				/* Check if the path exists */
-				pd = sceIoDopen(get_vita_path(tmp_path));
-				if (pd < 0) {
-					client_send_ctrl_msg(client, "550 Invalid directory." FTPVITA_EOL);
-					return;
-				}
-				sceIoDclose(pd);
-			}
-			strcpy(client->cur_path, tmp_path);
-		}
-		client_send_ctrl_msg(client, "250 Requested file action okay, completed." FTPVITA_EOL);
+	if (ex_writer_flush(&c->w) < 0 || c->w.total != size)
+		ret = -1;
+	sceIoClose(fd);
+
+	if (ret < 0) {
+		sceIoRemove(path);
+		return -1;
 	}
+
+	__atomic_fetch_add(&c->x->files, 1, __ATOMIC_RELAXED);
+	return 0;
 }
 
-static void cmd_TYPE_func(ftpvita_client_info_t *client)
+static void zip_extract_entry(extract_io_t *c, const zip_entry_t *e)
 {
-	char data_type;
-	char format_control[8];
-	int n_args = sscanf(client->recv_cmd_args, "%c %s", &data_type, format_control);
+	extract_t *x = c->x;
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+	unsigned char hdr[30];
+	unsigned int start;
+	int ret;
 
-	if (n_args > 0) {
-		switch(data_type) {
-		case 'A':
-		case 'I':
-			client_send_ctrl_msg(client, "200 Okay" FTPVITA_EOL);
-			break;
-		case 'E':
-		case 'L':
-		default:
-			client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
-			break;
-		}
-	} else {
-		client_send_ctrl_msg(client, "504 Error: bad parameters?" FTPVITA_EOL);
+	snprintf(name, sizeof(name), "%.*s", (int)e->name_len, e->name);
+	if (extract_path(x, name, path, sizeof(path)) < 0) {
+		extract_fail(x, name);
+		return;
+	}
+
+	if (e->name[e->name_len - 1] == '/') {
+		mkdir_parents(path);
+		__atomic_fetch_add(&x->dirs, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Encrypted, methods other than stored and deflate, ZIP64 */
+	if ((e->flags & 1) || (e->method != 0 && e->method != 8) ||
+	    e->csize == 0xFFFFFFFF || e->usize == 0xFFFFFFFF) {
+		extract_fail(x, name);
+		return;
+	}
+
+	/* The local header can have another extra field than the central one */
+	if (sceIoPread(c->r.fd, hdr, sizeof(hdr), e->offset) != sizeof(hdr) ||
+	    le32(hdr) != ZIP_LOCAL_SIG) {
+		extract_fail(x, name);
+		return;
+	}
+	start = e->offset + sizeof(hdr) + le16(hdr + 26) + le16(hdr + 28);
+	sceIoLseek(c->r.fd, start, SCE_SEEK_SET);
+
+	ex_reader_start(&c->r, e->csize);
+	ret = extract_file(c, path, e->method == 8, e->csize, e->usize);
+	ex_reader_stop(&c->r);
+	if (ret < 0) {
+		if (!extract_cancelled(x))
+			extract_fail(x, name);
+		return;
+	}
+
+#if FTPVITA_FEATURE_HASH
+	if (c->w.crc != e->crc) {
+		sceIoRemove(path);
+		__atomic_fetch_sub(&x->files, 1, __ATOMIC_RELAXED);
+		extract_fail(x, name);
 	}
+#endif
 }
 
-static void cmd_CDUP_func(ftpvita_client_info_t *client)
+static int extract_zip_thread(SceSize args, void *argp)
 {
-	dir_up(client->cur_path);
-	client_send_ctrl_msg(client, "200 Command okay." FTPVITA_EOL);
+	extract_t *x = *(extract_t **)argp;
+	extract_io_t c;
+	unsigned int i;
+
+	if (extract_io_init(&c, x) == 0) {
+		while (!extract_cancelled(x) &&
+		       (i = __atomic_fetch_add(&x->next, 1, __ATOMIC_RELAXED)) < x->n_entries)
+			zip_extract_entry(&c, &x->entries[i]);
+	}
+	extract_io_fini(&c);
+
+	__atomic_fetch_sub(&x->running, 1, __ATOMIC_RELEASE);
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-static void send_file(ftpvita_client_info_t *client, const char *path)
+/* Loads the central directory. Returns -1 if it's not a valid
+ * zip file, -2 if out of memory */
+static int zip_read_dir(extract_t *x, SceUID fd)
 {
-	unsigned char *buffer;
-	SceUID fd;
-	unsigned int bytes_read;
+	unsigned char *tail, *p, *end;
+	unsigned int tail_len, dir_size, dir_off, n, i;
+	SceOff size;
 
-	DEBUG("Opening: %s\n", path);
+	/* The end record is within the last 64 KB + 22 bytes, behind a comment */
+	size = sceIoLseek(fd, 0, SCE_SEEK_END);
+	if (size < 22)
+		return -1;
+	tail_len = size < 0x10000 + 22 ? size : 0x10000 + 22;
+	tail = mem_alloc(FTPVITA_MEM_EXTRACT, tail_len);
+	if (tail == NULL)
+		return -2;
+	if (sceIoPread(fd, tail, tail_len, size - tail_len) != tail_len) {
+		mem_free(tail);
+		return -1;
+	}
 
-	if ((fd = sceIoOpen(path, SCE_O_RDONLY, 0777)) >= 0) {
+	for (p = tail + tail_len - 22; p >= tail && le32(p) != ZIP_END_SIG; p--)
+		;
+	if (p < tail) {
+		mem_free(tail);
+		return -1;
+	}
+	n = le16(p + 10);
+	dir_size = le32(p + 12);
+	dir_off = le32(p + 16);
+	mem_free(tail);
 
-		sceIoLseek32(fd, client->restore_point, SCE_SEEK_SET);
+	if (n == 0xFFFF || dir_off == 0xFFFFFFFF || dir_off + (SceOff)dir_size > size)
+		return -1;
 
-		buffer = malloc(file_buf_size);
-		if (buffer == NULL) {
-			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
-			return;
-		}
+	x->dir = mem_alloc(FTPVITA_MEM_EXTRACT, dir_size);
+	x->entries = mem_alloc(FTPVITA_MEM_EXTRACT, n * sizeof(*x->entries) + 1);
+	if (x->dir == NULL || x->entries == NULL)
+		return -2;
+	if (sceIoPread(fd, x->dir, dir_size, dir_off) != dir_size)
+		return -1;
 
-		client_open_data_connection(client);
-		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
+	p = x->dir;
+	end = x->dir + dir_size;
+	for (i = 0; i < n; i++) {
+		if (end - p < 46 || le32(p) != ZIP_CENTRAL_SIG)
+			return -1;
+
+		x->entries[i].flags = le16(p + 8);
+		x->entries[i].method = le16(p + 10);
+		x->entries[i].crc = le32(p + 16);
+		x->entries[i].csize = le32(p + 20);
+		x->entries[i].usize = le32(p + 24);
+		x->entries[i].name_len = le16(p + 28);
+		x->entries[i].offset = le32(p + 42);
+		x->entries[i].name = (const char *)p + 46;
+
+		p += 46 + le16(p + 28) + le16(p + 30) + le16(p + 32);
+		if (p > end || x->entries[i].name_len == 0 ||
+		    x->entries[i].name_len >= PATH_MAX)
+			return -1;
+	}
+	x->n_entries = n;
 
-		while ((bytes_read = sceIoRead (fd, buffer, file_buf_size)) > 0) {
-			client_send_data_raw(client, buffer, bytes_read);
-		}
+	return 0;
+}
 
-		sceIoClose(fd);
-		free(buffer);
-		client->restore_point = 0;
-		client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
-		client_close_data_connection(client);
+static unsigned long long tar_number(const unsigned char *p, int len)
+{
+	unsigned long long v = 0;
+
+	/* GNU base-256, for files over 8 GB */
+	if (*p & 0x80) {
+		v = *p++ & 0x7F;
+		while (--len)
+			v = (v << 8) | *p++;
+		return v;
+	}
 
-	} else {
-		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	while (len > 0 && (*p == ' ' || *p == '\0')) {
+		p++;
+		len--;
 	}
+	while (len-- > 0 && *p >= '0' && *p <= '7')
+		v = (v << 3) | (*p++ - '0');
+	return v;
 }
 
-/* This function generates an FTP full-path with the input path (relative or absolute)
- * from RETR, STOR, DELE, RMD, MKD, RNFR and RNTO commands */
-static void gen_ftp_fullpath(ftpvita_client_info_t *client, char *path, size_t path_size)
+static int tar_header_valid(const unsigned char *hdr)
 {
-	char cmd_path[PATH_MAX];
-	sscanf(client->recv_cmd_args, "%[^\r\n\t]", cmd_path);
+	unsigned int sum = 0;
+	int i;
 
-	if (cmd_path[0] == '/') {
-		/* Full path */
-		strncpy(path, cmd_path, path_size);
-	} else {
-		if (strlen(cmd_path) >= 5 && cmd_path[3] == ':' && cmd_path[4] == '/') {
-			/* Case "ux0:/foo */
-			snprintf(path, path_size, "/%s", cmd_path);
-		} else {
-			/* The file is relative to current dir, so
-			 * append the file to the current path */
-			snprintf(path, path_size, "%s/%s", client->cur_path, cmd_path);
+	/* The checksum is computed with its own field as spaces */
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += i >= 148 && i < 156 ? ' ' : hdr[i];
+	return sum == tar_number(hdr + 148, 8);
+}
+
+/* Path of a pax extended header ("len path=value\n" records) */
+static int tar_pax_path(const char *data, unsigned int size, char *name, size_t name_size)
+{
+	const char *p = data, *end = data + size;
+	unsigned int len;
+	int found = 0;
+
+	while (p < end && sscanf(p, "%u", &len) == 1 && len > 0 && len <= end - p) {
+		const char *kv = memchr(p, ' ', len);
+
+		if (kv && len - (kv + 1 - p) > 6 && strncmp(kv + 1, "path=", 5) == 0) {
+			snprintf(name, name_size, "%.*s", (int)(p + len - (kv + 6) - 1), kv + 6);
+			found = 1;
 		}
+		p += len;
 	}
+	return found;
 }
 
-static void cmd_RETR_func(ftpvita_client_info_t *client)
+static int extract_tar_thread(SceSize args, void *argp)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	send_file(client, get_vita_path(dest_path));
+	extract_t *x = *(extract_t **)argp;
+	unsigned char hdr[TAR_BLOCK];
+	char name[PATH_MAX];
+	char path[PATH_MAX];
+	char *data;
+	unsigned long long size, next;
+	int long_name = 0;
+	extract_io_t c;
+
+	if (extract_io_init(&c, x) < 0) {
+		extract_fail(x, x->archive);
+		goto out;
+	}
+	size = sceIoLseek(c.r.fd, 0, SCE_SEEK_END);
+	sceIoLseek(c.r.fd, 0, SCE_SEEK_SET);
+	ex_reader_start(&c.r, size);
+
+	while (!extract_cancelled(x)) {
+		if (ex_read(&c, hdr, sizeof(hdr)) < 0) {
+			if (!extract_cancelled(x))
+				extract_fail(x, x->archive);
+			break;
+		}
+		/* Zero blocks end the archive */
+		if (hdr[0] == '\0')
+			break;
+		if (!tar_header_valid(hdr)) {
+			extract_fail(x, x->archive);
+			break;
+		}
+
+		/* Whatever happens to the entry, the next header is here */
+		size = tar_number(hdr + 124, 12);
+		next = c.r.consumed + ((size + TAR_BLOCK - 1) & ~(unsigned long long)(TAR_BLOCK - 1));
+
+		/* A long name from the previous GNU or pax header wins */
+		if (!long_name) {
+			if (memcmp(hdr + 257, "ustar", 5) == 0 && hdr[345])
+				snprintf(name, sizeof(name), "%.155s/%.100s", hdr + 345, hdr);
+			else
+				snprintf(name, sizeof(name), "%.100s", hdr);
+		}
+		long_name = 0;
+
+		switch (hdr[156]) {
+		case 'L':
+		case 'x':
+			/* GNU long name, pax extended header */
+			if (size >= 0x10000 || (data = mem_alloc(FTPVITA_MEM_EXTRACT, size + 1)) == NULL)
+				break;
+			if (ex_read(&c, data, size) == 0) {
+				data[size] = '\0';
+				if (hdr[156] == 'L') {
+					snprintf(name, sizeof(name), "%s", data);
+					long_name = 1;
+				} else {
+					long_name = tar_pax_path(data, size, name, sizeof(name));
+				}
+			}
+			mem_free(data);
+			break;
+
+		case '5':
+			/* Leave room for the slash */
+			if (extract_path(x, name, path, sizeof(path) - 1) < 0) {
+				extract_fail(x, name);
+				break;
+			}
+			strcat(path, "/");
+			mkdir_parents(path);
+			__atomic_fetch_add(&x->dirs, 1, __ATOMIC_RELAXED);
+			break;
+
+		case '0':
+		case '7':
+		case '\0':
+			if (extract_path(x, name, path, sizeof(path)) < 0 ||
+			    extract_file(&c, path, 0, size, size) < 0) {
+				if (!extract_cancelled(x))
+					extract_fail(x, name);
+			}
+			break;
+
+		case 'g':
+			break;
+
+		default:
+			/* Links and devices can't be created */
+			extract_fail(x, name);
+			break;
+		}
+
+		if (ex_skip(&c, next - c.r.consumed) < 0 && !extract_cancelled(x)) {
+			extract_fail(x, x->archive);
+			break;
+		}
+	}
+
+out:
+	extract_io_fini(&c);
+
+	__atomic_fetch_sub(&x->running, 1, __ATOMIC_RELEASE);
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-static void receive_file(ftpvita_client_info_t *client, const char *path)
+static void site_extract(ftpvita_client_info_t *client, const char *args,
+			 const char *cur_path, volatile int *cancelled)
 {
-	unsigned char *buffer;
+	char archive_path[PATH_MAX];
+	char dest_path[PATH_MAX];
+	char path[PATH_MAX];
+	char msg[PATH_MAX + 64];
+	char archive[PATH_MAX];
+	char dest[PATH_MAX];
+	unsigned char hdr[TAR_BLOCK];
+	SceUID thids[EXTRACT_WORKERS];
+	SceIoStat stat;
+	extract_t *x;
 	SceUID fd;
-	int bytes_recv;
+	int i, n_threads, started, is_zip, ret, ticks = 0;
+
+	if (!site_next_path(&args, archive_path, sizeof(archive_path)) ||
+	    !site_next_path(&args, dest_path, sizeof(dest_path))) {
+		job_reply(client, cancelled, "501 Syntax error in parameters." FTPVITA_EOL);
+		return;
+	}
+
+	gen_fullpath(cur_path, archive_path, path, sizeof(path));
+	if (get_vita_path(path) == NULL || sceIoGetstat(get_vita_path(path), &stat) < 0 ||
+	    SCE_S_ISDIR(stat.st_mode)) {
+		job_reply(client, cancelled, "550 Archive not found." FTPVITA_EOL);
+		return;
+	}
+	strcpy(archive, get_vita_path(path));
 
-	DEBUG("Opening: %s\n", path);
+	gen_fullpath(cur_path, dest_path, path, sizeof(path));
+	if (get_vita_path(path) == NULL) {
+		job_reply(client, cancelled, "550 Invalid destination." FTPVITA_EOL);
+		return;
+	}
+	strcpy(dest, get_vita_path(path));
+	/* Without the trailing slash the entries would get two */
+	while (strlen(dest) > 5 && dest[strlen(dest) - 1] == '/')
+		dest[strlen(dest) - 1] = '\0';
+	sceIoMkdir(dest, 0777);
+	if (sceIoGetstat(dest, &stat) < 0 || !SCE_S_ISDIR(stat.st_mode)) {
+		job_reply(client, cancelled, "550 Invalid destination." FTPVITA_EOL);
+		return;
+	}
 
-	int mode = SCE_O_CREAT | SCE_O_RDWR;
-	/* if we resume broken - append missing part
-	 * else - overwrite file */
-	if (client->restore_point) {
-		mode = mode | SCE_O_APPEND;
+	fd = sceIoOpen(archive, SCE_O_RDONLY, 0777);
+	if (fd < 0) {
+		job_reply(client, cancelled, "550 Could not open the archive." FTPVITA_EOL);
+		return;
 	}
-	else {
-		mode = mode | SCE_O_TRUNC;
+	memset(hdr, 0, sizeof(hdr));
+	sceIoRead(fd, hdr, sizeof(hdr));
+	is_zip = le32(hdr) == ZIP_LOCAL_SIG || le32(hdr) == ZIP_END_SIG;
+	if (!is_zip && !tar_header_valid(hdr)) {
+		sceIoClose(fd);
+		job_reply(client, cancelled, "550 Not a zip or tar archive." FTPVITA_EOL);
+		return;
 	}
 
-	if ((fd = sceIoOpen(path, mode, 0777)) >= 0) {
+	x = mem_calloc(FTPVITA_MEM_EXTRACT, 1, sizeof(*x));
+	if (x == NULL) {
+		sceIoClose(fd);
+		job_reply(client, cancelled, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	}
+	x->archive = archive;
+	x->dest = dest;
+	x->src_dev = device_index(archive);
+	x->dst_dev = device_index(dest);
+	x->cancelled = cancelled;
+
+	ret = is_zip ? zip_read_dir(x, fd) : 0;
+	sceIoClose(fd);
+	if (ret < 0) {
+		job_reply(client, cancelled, ret == -2 ?
+			"451 Could not allocate memory." FTPVITA_EOL :
+			"550 Not a valid zip archive." FTPVITA_EOL);
+		goto out;
+	}
 
-		buffer = malloc(file_buf_size);
-		if (buffer == NULL) {
-			client_send_ctrl_msg(client, "550 Could not allocate memory." FTPVITA_EOL);
-			return;
+	n_threads = 1;
+	if (is_zip)
+		n_threads = x->n_entries < EXTRACT_WORKERS ? x->n_entries : EXTRACT_WORKERS;
+	x->running = n_threads;
+
+	started = 0;
+	for (i = 0; i < n_threads; i++) {
+		thids[i] = sceKernelCreateThread("FTPVita_extract_thread",
+			is_zip ? extract_zip_thread : extract_tar_thread,
+			0x10000100, 0x8000, 0, 0, NULL);
+		if (thids[i] >= 0 && sceKernelStartThread(thids[i], sizeof(x), &x) < 0) {
+			sceKernelDeleteThread(thids[i]);
+			thids[i] = -1;
+		}
+		if (thids[i] < 0) {
+			/* The zip entries are shared, the others take them */
+			__atomic_fetch_sub(&x->running, 1, __ATOMIC_RELEASE);
+			continue;
 		}
+		started++;
+	}
 
-		client_open_data_connection(client);
-		client_send_ctrl_msg(client, "150 Opening Image mode data transfer." FTPVITA_EOL);
+	if (n_threads > 0 && started == 0) {
+		job_reply(client, cancelled, "451 Could not start the extraction." FTPVITA_EOL);
+		goto out;
+	}
 
-		while ((bytes_recv = client_recv_data_raw(client, buffer, file_buf_size)) > 0) {
-			sceIoWrite(fd, buffer, bytes_recv);
+	/* Stream the progress while the workers go on */
+	while (__atomic_load_n(&x->running, __ATOMIC_ACQUIRE) > 0) {
+		sceKernelDelayThread(100 * 1000);
+		if (++ticks % EXTRACT_PROGRESS_TICKS == 0) {
+			snprintf(msg, sizeof(msg),
+				"211-%u files, %llu bytes so far" FTPVITA_EOL,
+				__atomic_load_n(&x->files, __ATOMIC_RELAXED),
+				__atomic_load_n(&x->bytes, __ATOMIC_RELAXED));
+			job_reply(client, cancelled, msg);
 		}
+	}
 
-		sceIoClose(fd);
-		free(buffer);
-		client->restore_point = 0;
-		if (bytes_recv == 0) {
-			client_send_ctrl_msg(client, "226 Transfer completed." FTPVITA_EOL);
-		} else {
-			sceIoRemove(path);
-			client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
-		}
-		client_close_data_connection(client);
+	for (i = 0; i < n_threads; i++) {
+		if (thids[i] >= 0)
+			sceKernelWaitThreadEnd(thids[i], NULL, NULL);
+	}
 
-	} else {
-		client_send_ctrl_msg(client, "550 File not found." FTPVITA_EOL);
+	/* Entries no worker could get to */
+	if (is_zip && x->next < x->n_entries && !extract_cancelled(x))
+		x->errors += x->n_entries - x->next;
+
+	cache_invalidate(dest);
+
+	snprintf(msg, sizeof(msg), "211-Files: %u" FTPVITA_EOL, x->files);
+	job_reply(client, cancelled, msg);
+	snprintf(msg, sizeof(msg), "211-Directories: %u" FTPVITA_EOL, x->dirs);
+	job_reply(client, cancelled, msg);
+	snprintf(msg, sizeof(msg), "211-Bytes: %llu" FTPVITA_EOL, x->bytes);
+	job_reply(client, cancelled, msg);
+	if (x->errors) {
+		snprintf(msg, sizeof(msg), "211-Failed: %u (%s)" FTPVITA_EOL,
+			x->errors, x->has_failed ? x->failed : "no memory");
+		job_reply(client, cancelled, msg);
 	}
+	job_reply(client, cancelled, "211 End" FTPVITA_EOL);
+
+out:
+	mem_free(x->entries);
+	mem_free(x->dir);
+	mem_free(x);
 }
 
-static void cmd_STOR_func(ftpvita_client_info_t *client)
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+static int cmd_SITE_EXTRACT_async(ftpvita_async_cmd_t *cmd)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	receive_file(client, get_vita_path(dest_path));
+	site_extract(cmd->client, cmd->args, cmd->cur_path, &cmd->cancelled);
+	return 0;
+}
+#else
+static void cmd_SITE_EXTRACT_func(ftpvita_client_info_t *client)
+{
+	site_extract(client, client->recv_cmd_args, client->cur_path, NULL);
 }
+#endif
+#endif
+
+#if FTPVITA_FEATURE_VERIFY
+/* SITE VERIFY: checks a tree against a manifest uploaded over the data
+ * connection. Each line is "<size> <crc32> <path>", like the file lines
+ * of TREEHASH, a "-" crc only checks the size. Paths are relative to
+ * the directory given to the command. The files are checked by a few
+ * threads, so the reads of one overlap the hashing of another, and only
+ * the files that don't match are reported, in manifest order. */
+
+#define VERIFY_WORKERS       FTPVITA_VERIFY_WORKERS
+#define VERIFY_MANIFEST_MAX  FTPVITA_VERIFY_MANIFEST_MAX
+/* Seconds between progress lines */
+#define VERIFY_PROGRESS_SECS 5
+
+enum {
+	VERIFY_OK,
+	VERIFY_MISSING,
+	VERIFY_SIZE,
+	VERIFY_CRC,
+	VERIFY_UNREADABLE
+};
 
-static void delete_file(ftpvita_client_info_t *client, const char *path)
+typedef struct {
+	const char *name;
+	SceOff size;
+	unsigned int crc;
+	int has_crc;
+	SceOff actual_size;
+	unsigned int actual_crc;
+	int result;
+	int done;
+} verify_entry_t;
+
+typedef struct {
+	const char *base;
+	verify_entry_t *entries;
+	unsigned int n_entries;
+	unsigned int next;
+	/* Signaled for each entry checked */
+	SceUID sema;
+} verify_t;
+
+static void verify_entry(verify_t *v, verify_entry_t *e)
 {
-	DEBUG("Deleting: %s\n", path);
+	char path[PATH_MAX];
+	const char *vita_path;
+	SceIoStat stat;
+	int ret;
 
-	if (sceIoRemove(path) >= 0) {
-		client_send_ctrl_msg(client, "226 File deleted." FTPVITA_EOL);
-	} else {
-		client_send_ctrl_msg(client, "550 Could not delete the file." FTPVITA_EOL);
+	gen_fullpath(v->base, e->name, path, sizeof(path));
+	vita_path = get_vita_path(path);
+	if (vita_path == NULL || sceIoGetstat(vita_path, &stat) < 0 || SCE_S_ISDIR(stat.st_mode)) {
+		e->result = VERIFY_MISSING;
+		return;
 	}
-}
 
-static void cmd_DELE_func(ftpvita_client_info_t *client)
-{
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	delete_file(client, get_vita_path(dest_path));
+	e->actual_size = stat.st_size;
+	if (stat.st_size != e->size) {
+		e->result = VERIFY_SIZE;
+		return;
+	}
+	if (!e->has_crc) {
+		e->result = VERIFY_OK;
+		return;
+	}
+
+	ret = hash_file_cached(vita_path, &stat, NULL, &e->actual_crc);
+	if (ret < 0)
+		e->result = VERIFY_UNREADABLE;
+	else
+		e->result = e->actual_crc == e->crc ? VERIFY_OK : VERIFY_CRC;
 }
 
-static void delete_dir(ftpvita_client_info_t *client, const char *path)
+/* Checks entries until none is left */
+static void verify_run(verify_t *v)
 {
-	int ret;
-	DEBUG("Deleting: %s\n", path);
-	ret = sceIoRmdir(path);
-	if (ret >= 0) {
-		client_send_ctrl_msg(client, "226 Directory deleted." FTPVITA_EOL);
-	} else if (ret == 0x8001005A) { /* DIRECTORY_IS_NOT_EMPTY */
-		client_send_ctrl_msg(client, "550 Directory is not empty." FTPVITA_EOL);
-	} else {
-		client_send_ctrl_msg(client, "550 Could not delete the directory." FTPVITA_EOL);
+	verify_entry_t *e;
+	unsigned int i;
+
+	while ((i = __atomic_fetch_add(&v->next, 1, __ATOMIC_RELAXED)) < v->n_entries) {
+		e = &v->entries[i];
+		verify_entry(v, e);
+		__atomic_store_n(&e->done, 1, __ATOMIC_RELEASE);
+		sceKernelSignalSema(v->sema, 1);
 	}
 }
 
-static void cmd_RMD_func(ftpvita_client_info_t *client)
+static int verify_thread(SceSize args, void *argp)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	delete_dir(client, get_vita_path(dest_path));
+	verify_run(*(verify_t **)argp);
+
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-static void create_dir(ftpvita_client_info_t *client, const char *path)
+/* Receives the manifest into a NUL-terminated buffer. Returns its
+ * length, -1 if the transfer failed, -2 without memory and -3 if it's
+ * larger than VERIFY_MANIFEST_MAX */
+static int verify_recv_manifest(ftpvita_client_info_t *client, char **manifest)
 {
-	DEBUG("Creating: %s\n", path);
+	unsigned int size = 64 * 1024;
+	unsigned int len = 0;
+	char *buf, *p;
+	int n;
+
+	if ((buf = mem_alloc(FTPVITA_MEM_VERIFY, size + 1)) == NULL)
+		return -2;
+
+	while ((n = client_recv_data_raw(client, buf + len, size - len)) > 0) {
+		len += n;
+		STAT_ADD(bytes_received, n);
+		__atomic_fetch_add(&client->bytes_received, n, __ATOMIC_RELAXED);
+		if (len < size)
+			continue;
+		if (size == VERIFY_MANIFEST_MAX) {
+			mem_free(buf);
+			return -3;
+		}
+		size = size * 2 < VERIFY_MANIFEST_MAX ? size * 2 : VERIFY_MANIFEST_MAX;
+		if ((p = mem_realloc(FTPVITA_MEM_VERIFY, buf, size + 1)) == NULL) {
+			mem_free(buf);
+			return -2;
+		}
+		buf = p;
+	}
 
-	if (sceIoMkdir(path, 0777) >= 0) {
-		client_send_ctrl_msg(client, "226 Directory created." FTPVITA_EOL);
-	} else {
-		client_send_ctrl_msg(client, "550 Could not create the directory." FTPVITA_EOL);
+	if (n < 0) {
+		mem_free(buf);
+		return -1;
 	}
+
+	buf[len] = '\0';
+	*manifest = buf;
+	return len;
 }
 
-static void cmd_MKD_func(ftpvita_client_info_t *client)
+/* Splits the manifest into entries, in place. Returns 0 on success, the
+ * number of the first bad line or -1 without memory */
+static int verify_parse(verify_t *v, char *manifest)
 {
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	create_dir(client, get_vita_path(dest_path));
+	verify_entry_t *p;
+	unsigned int size = 0;
+	unsigned int line_num = 0;
+	char *line, *eol, *end;
+	char crc[16];
+	long long file_size;
+	int name;
+
+	v->entries = NULL;
+	v->n_entries = 0;
+
+	for (line = manifest; line && *line; line = eol) {
+		line_num++;
+		if ((eol = strchr(line, '\n')) != NULL)
+			*eol++ = '\0';
+		end = line + strlen(line);
+		if (end > line && end[-1] == '\r')
+			*--end = '\0';
+
+		/* Blank lines and comments */
+		if (*line == '\0' || *line == '#')
+			continue;
+
+		name = 0;
+		if (sscanf(line, "%lld %15s %n", &file_size, crc, &name) < 2 ||
+		    name == 0 || line[name] == '\0' || file_size < 0)
+			return line_num;
+
+		if (v->n_entries == size) {
+			size = size ? size * 2 : 256;
+			p = mem_realloc(FTPVITA_MEM_VERIFY, v->entries, size * sizeof(*p));
+			if (p == NULL)
+				return -1;
+			v->entries = p;
+		}
+		p = &v->entries[v->n_entries];
+		memset(p, 0, sizeof(*p));
+		p->name = line + name;
+		p->size = file_size;
+		if (strcmp(crc, "-") != 0) {
+			p->crc = strtoul(crc, &end, 16);
+			if (*end != '\0' || strlen(crc) > 8)
+				return line_num;
+			p->has_crc = 1;
+		}
+		v->n_entries++;
+	}
+
+	return 0;
 }
 
-static void cmd_RNFR_func(ftpvita_client_info_t *client)
+static void verify_report(ftpvita_client_info_t *client, const verify_entry_t *e,
+			  unsigned int *mismatched, unsigned int *missing)
 {
-	char path_src[PATH_MAX];
-	const char *vita_path_src;
-	/* Get the origin filename */
-	gen_ftp_fullpath(client, path_src, sizeof(path_src));
-	vita_path_src = get_vita_path(path_src);
-
-	/* Check if the file exists */
-	if (!file_exists(vita_path_src)) {
-		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+	char msg[PATH_MAX + 64];
+
+	switch (e->result) {
+	case VERIFY_MISSING:
+		(*missing)++;
+		snprintf(msg, sizeof(msg), "226-Missing %s" FTPVITA_EOL, e->name);
+		break;
+	case VERIFY_SIZE:
+		(*mismatched)++;
+		snprintf(msg, sizeof(msg), "226-Size %lld %s" FTPVITA_EOL, e->actual_size, e->name);
+		break;
+	case VERIFY_CRC:
+		(*mismatched)++;
+		snprintf(msg, sizeof(msg), "226-CRC32 %08x %s" FTPVITA_EOL, e->actual_crc, e->name);
+		break;
+	case VERIFY_UNREADABLE:
+		(*mismatched)++;
+		snprintf(msg, sizeof(msg), "226-Unreadable %s" FTPVITA_EOL, e->name);
+		break;
+	default:
 		return;
 	}
-	/* The file to be renamed is the received path */
-	strcpy(client->rename_path, vita_path_src);
-	client_send_ctrl_msg(client, "350 I need the destination name b0ss." FTPVITA_EOL);
+	client_send_ctrl_msg(client, msg);
 }
 
-static void cmd_RNTO_func(ftpvita_client_info_t *client)
+/* SITE VERIFY [path]: the manifest is sent like a STOR, the reply to
+ * the transfer then lists what doesn't match it */
+static void cmd_SITE_VERIFY_func(ftpvita_client_info_t *client)
 {
-	char path_dst[PATH_MAX];
-	const char *vita_path_dst;
-	/* Get the destination filename */
-	gen_ftp_fullpath(client, path_dst,sizeof(path_dst));
-	vita_path_dst = get_vita_path(path_dst);
+	char cmd_path[PATH_MAX];
+	char base[PATH_MAX];
+	char msg[128];
+	const char *args = client->recv_cmd_args;
+	SceUID thids[VERIFY_WORKERS];
+	SceUInt64 last_progress;
+	SceUInt32 timeout;
+	SceIoStat stat;
+	char *manifest = NULL;
+	unsigned int checked = 0, reported = 0;
+	unsigned int mismatched = 0, missing = 0;
+	int i, n_threads, started, ret;
+	verify_t v;
+	verify_t *vp = &v;
+
+	if (site_next_path(&args, cmd_path, sizeof(cmd_path)))
+		gen_fullpath(client->cur_path, cmd_path, base, sizeof(base));
+	else
+		strcpy(base, client->cur_path);
+	if (get_vita_path(base) == NULL || sceIoGetstat(get_vita_path(base), &stat) < 0 ||
+	    !SCE_S_ISDIR(stat.st_mode)) {
+		client_send_ctrl_msg(client, "550 Directory not found." FTPVITA_EOL);
+		return;
+	}
 
-	DEBUG("Renaming: %s to %s\n", client->rename_path, vita_path_dst);
+	client_open_data_connection(client);
+	client_send_ctrl_msg(client, "150 Opening data connection for the manifest." FTPVITA_EOL);
+	ret = verify_recv_manifest(client, &manifest);
+	client_close_data_connection(client);
 
-	if (sceIoRename(client->rename_path, vita_path_dst) < 0) {
-		client_send_ctrl_msg(client, "550 Error renaming the file." FTPVITA_EOL);
+	switch (ret) {
+	case -1:
+		client_send_ctrl_msg(client, "426 Connection closed; transfer aborted." FTPVITA_EOL);
+		return;
+	case -2:
+		client_send_ctrl_msg(client, "451 Could not allocate memory." FTPVITA_EOL);
+		return;
+	case -3:
+		client_send_ctrl_msg(client, "552 Manifest too large." FTPVITA_EOL);
+		return;
 	}
 
-	client_send_ctrl_msg(client, "226 Rename completed." FTPVITA_EOL);
+	memset(&v, 0, sizeof(v));
+	v.base = base;
+	ret = verify_parse(&v, manifest);
+	if (ret != 0) {
+		if (ret < 0)
+			snprintf(msg, sizeof(msg), "451 Could not allocate memory." FTPVITA_EOL);
+		else
+			snprintf(msg, sizeof(msg), "501 Syntax error in manifest line %d." FTPVITA_EOL, ret);
+		client_send_ctrl_msg(client, msg);
+		goto out;
+	}
+
+	snprintf(msg, sizeof(msg), "226-Manifest received, checking %u files." FTPVITA_EOL, v.n_entries);
+	client_send_ctrl_msg(client, msg);
+
+	v.sema = sceKernelCreateSema("FTPVita_verify_sema", 0, 0, v.n_entries + 1, NULL);
+	if (v.sema < 0) {
+		client_send_ctrl_msg(client, "451 Could not start checking." FTPVITA_EOL);
+		goto out;
+	}
+
+	n_threads = v.n_entries < VERIFY_WORKERS ? v.n_entries : VERIFY_WORKERS;
+	started = 0;
+	for (i = 0; i < n_threads; i++) {
+		thids[i] = sceKernelCreateThread("FTPVita_verify_thread", verify_thread,
+			0x10000100, 0x8000, 0, 0, NULL);
+		if (thids[i] >= 0 && sceKernelStartThread(thids[i], sizeof(vp), &vp) < 0) {
+			sceKernelDeleteThread(thids[i]);
+			thids[i] = -1;
+		}
+		if (thids[i] >= 0)
+			started++;
+	}
+
+	/* Without workers the files are checked here, then reported */
+	if (started == 0)
+		verify_run(&v);
+
+	/* Report the entries in order as they're checked */
+	last_progress = sceKernelGetProcessTimeWide();
+	while (checked < v.n_entries) {
+		timeout = 1000 * 1000;
+		if (sceKernelWaitSema(v.sema, 1, &timeout) >= 0)
+			checked++;
+
+		while (reported < v.n_entries &&
+		       __atomic_load_n(&v.entries[reported].done, __ATOMIC_ACQUIRE))
+			verify_report(client, &v.entries[reported++], &mismatched, &missing);
+
+		if (sceKernelGetProcessTimeWide() - last_progress >= VERIFY_PROGRESS_SECS * 1000 * 1000ULL) {
+			last_progress = sceKernelGetProcessTimeWide();
+			snprintf(msg, sizeof(msg), "226-%u of %u files checked so far." FTPVITA_EOL,
+				checked, v.n_entries);
+			client_send_ctrl_msg(client, msg);
+		}
+	}
+
+	for (i = 0; i < n_threads; i++) {
+		if (thids[i] >= 0)
+			sceKernelWaitThreadEnd(thids[i], NULL, NULL);
+	}
+	sceKernelDeleteSema(v.sema);
+
+	snprintf(msg, sizeof(msg), "226 %u files checked, %u mismatched, %u missing." FTPVITA_EOL,
+		v.n_entries, mismatched, missing);
+	client_send_ctrl_msg(client, msg);
+
+out:
+	mem_free(v.entries);
+	mem_free(manifest);
 }
+#endif
+
+#define add_site_entry(name) {#name, cmd_SITE_##name##_func}
+static const cmd_dispatch_entry site_dispatch_table[] = {
+#if FTPVITA_FEATURE_METRICS
+	add_site_entry(STATS),
+#endif
+#if FTPVITA_FEATURE_RESUME
+	add_site_entry(TOKEN),
+	add_site_entry(RESUME),
+#endif
+#if FTPVITA_FEATURE_DU && !FTPVITA_FEATURE_ASYNC_COMMANDS
+	add_site_entry(DU),
+#endif
+#if FTPVITA_FEATURE_PREFETCH
+	add_site_entry(PREFETCH),
+#endif
+#if FTPVITA_FEATURE_THUMBS
+	add_site_entry(THUMB),
+#endif
+#if FTPVITA_FEATURE_EXTRACT && !FTPVITA_FEATURE_ASYNC_COMMANDS
+	add_site_entry(EXTRACT),
+#endif
+#if FTPVITA_FEATURE_TREEHASH && !FTPVITA_FEATURE_ASYNC_COMMANDS
+	add_site_entry(TREEHASH),
+#endif
+#if FTPVITA_FEATURE_VERIFY
+	add_site_entry(VERIFY),
+#endif
+	{NULL, NULL}
+};
 
-static void cmd_SIZE_func(ftpvita_client_info_t *client)
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+/* SITE subcommands that run on the async worker pool */
+#define add_site_async_entry(name) {#name, cmd_SITE_##name##_async}
+static const async_dispatch_entry site_async_dispatch_table[] = {
+#if FTPVITA_FEATURE_DU
+	add_site_async_entry(DU),
+#endif
+#if FTPVITA_FEATURE_EXTRACT
+	add_site_async_entry(EXTRACT),
+#endif
+#if FTPVITA_FEATURE_TREEHASH
+	add_site_async_entry(TREEHASH),
+#endif
+	{NULL, NULL}
+};
+#endif
+
+static void cmd_SITE_func(ftpvita_client_info_t *client)
 {
-	SceIoStat stat;
-	char path[PATH_MAX];
-	char cmd[64];
-	/* Get the filename to retrieve its size */
-	gen_ftp_fullpath(client, path, sizeof(path));
+	char site_cmd[16];
+	const char *args;
+	int i;
 
-	/* Check if the file exists */
-	if (sceIoGetstat(get_vita_path(path), &stat) < 0) {
-		client_send_ctrl_msg(client, "550 The file doesn't exist." FTPVITA_EOL);
+	if (sscanf(client->recv_cmd_args, "%15s", site_cmd) < 1) {
+		client_send_ctrl_msg(client, "501 Syntax error in parameters." FTPVITA_EOL);
 		return;
 	}
-	/* Send the size of the file */
-	sprintf(cmd, "213 %lld" FTPVITA_EOL, stat.st_size);
-	client_send_ctrl_msg(client, cmd);
-}
 
-static void cmd_REST_func(ftpvita_client_info_t *client)
-{
-	char cmd[64];
-	sscanf(client->recv_buffer, "%*[^ ] %d", &client->restore_point);
-	sprintf(cmd, "350 Resuming at %d" FTPVITA_EOL, client->restore_point);
-	client_send_ctrl_msg(client, cmd);
-}
+	/* The SITE command's arguments become the subcommand's arguments */
+	args = strchr(client->recv_cmd_args, ' ');
+	client->recv_cmd_args = args ? args + 1 : "";
 
-static void cmd_FEAT_func(ftpvita_client_info_t *client)
-{
-	/*So client would know that we support resume */
-	client_send_ctrl_msg(client, "211-extensions" FTPVITA_EOL);
-	client_send_ctrl_msg(client, " REST STREAM" FTPVITA_EOL);
-	client_send_ctrl_msg(client, " UTF8" FTPVITA_EOL);
-	client_send_ctrl_msg(client, "211 end" FTPVITA_EOL);
-}
+	for (i = 0; site_dispatch_table[i].cmd; i++) {
+		if (strcasecmp(site_cmd, site_dispatch_table[i].cmd) == 0) {
+			site_dispatch_table[i].func(client);
+			return;
+		}
+	}
 
-static void cmd_OPTS_func(ftpvita_client_info_t *client)
-{
-	client_send_ctrl_msg(client, "501 bad OPTS" FTPVITA_EOL);
-}
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+	for (i = 0; site_async_dispatch_table[i].cmd; i++) {
+		if (strcasecmp(site_cmd, site_async_dispatch_table[i].cmd) == 0) {
+			async_cmd_submit(client, site_async_dispatch_table[i].cmd,
+				site_async_dispatch_table[i].func, NULL);
+			return;
+		}
+	}
+#endif
 
-static void cmd_APPE_func(ftpvita_client_info_t *client)
-{
-	/* set restore point to not 0
-	restore point numeric value only matters if we RETR file from vita.
-	If we STOR or APPE, it is only used to indicate that we want to resume
-	a broken transfer */
-	client->restore_point = -1;
-	char dest_path[PATH_MAX];
-	gen_ftp_fullpath(client, dest_path, sizeof(dest_path));
-	receive_file(client, get_vita_path(dest_path));
+	client_send_ctrl_msg(client, "500 Unknown SITE command." FTPVITA_EOL);
 }
 
 #define add_entry(name) {#name, cmd_##name##_func}
@@ -788,22 +7901,48 @@ static const cmd_dispatch_entry cmd_dispatch_table[] = {
 	add_entry(PWD),
 	add_entry(CWD),
 	add_entry(TYPE),
+#if FTPVITA_FEATURE_MODE_E
+	add_entry(MODE),
+	add_entry(SPAS),
+#endif
 	add_entry(CDUP),
 	add_entry(RETR),
+#if FTPVITA_FEATURE_WRITE
 	add_entry(STOR),
 	add_entry(DELE),
 	add_entry(RMD),
 	add_entry(MKD),
 	add_entry(RNFR),
 	add_entry(RNTO),
+#endif
 	add_entry(SIZE),
 	add_entry(REST),
 	add_entry(FEAT),
 	add_entry(OPTS),
+#if FTPVITA_FEATURE_WRITE
 	add_entry(APPE),
+#endif
+	add_entry(SITE),
+	add_entry(ABOR),
+#if FTPVITA_FEATURE_HASH && !FTPVITA_FEATURE_ASYNC_COMMANDS
+	add_entry(XCRC),
+	add_entry(HASH),
+#endif
 	{NULL, NULL}
 };
 
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+/* Built-in commands that run on the async worker pool */
+#define add_async_entry(name) {#name, cmd_##name##_async}
+static const async_dispatch_entry async_dispatch_table[] = {
+#if FTPVITA_FEATURE_HASH
+	add_async_entry(XCRC),
+	add_async_entry(HASH),
+#endif
+	{NULL, NULL}
+};
+#endif
+
 static cmd_dispatch_func get_dispatch_func(const char *cmd)
 {
 	int i;
@@ -814,7 +7953,7 @@ static cmd_dispatch_func get_dispatch_func(const char *cmd)
 	}
 	// Check for custom commands
 	for(i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
-		if (custom_command_dispatchers[i].valid) {
+		if (custom_command_dispatchers[i].valid && custom_command_dispatchers[i].func) {
 			if (strcmp(cmd, custom_command_dispatchers[i].cmd) == 0) {
 				return custom_command_dispatchers[i].func;
 			}
@@ -823,6 +7962,31 @@ static cmd_dispatch_func get_dispatch_func(const char *cmd)
 	return NULL;
 }
 
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+static int get_async_dispatch(const char *cmd, async_cmd_func *func, async_cmd_done_func *done)
+{
+	int i;
+	for (i = 0; async_dispatch_table[i].cmd; i++) {
+		if (strcmp(cmd, async_dispatch_table[i].cmd) == 0) {
+			*func = async_dispatch_table[i].func;
+			*done = NULL;
+			return 1;
+		}
+	}
+	// Check for custom commands
+	for(i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+		if (custom_command_dispatchers[i].valid && custom_command_dispatchers[i].async_func) {
+			if (strcmp(cmd, custom_command_dispatchers[i].cmd) == 0) {
+				*func = custom_command_dispatchers[i].async_func;
+				*done = custom_command_dispatchers[i].async_done;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+#endif
+
 static void client_list_add(ftpvita_client_info_t *client)
 {
 	/* Add the client at the front of the client list */
@@ -867,7 +8031,8 @@ static void client_list_delete(ftpvita_client_info_t *client)
 static void client_list_thread_end()
 {
 	ftpvita_client_info_t *it, *next;
-	SceUID client_thid;
+	SceUID client_thids[FTPVITA_MAX_SESSIONS];
+	int i, n = 0;
 	const int data_abort_flags = SCE_NET_SOCKET_ABORT_FLAG_RCV_PRESERVATION |
 				SCE_NET_SOCKET_ABORT_FLAG_SND_PRESERVATION;
 
@@ -876,9 +8041,9 @@ static void client_list_thread_end()
 	it = client_list;
 
 	/* Iterate over the client list and close their sockets */
-	while (it) {
+	while (it && n < FTPVITA_MAX_SESSIONS) {
 		next = it->next;
-		client_thid = it->thid;
+		client_thids[n++] = it->thid;
 
 		/* Abort the client's control socket, only abort
 		 * receiving data so we can still send control messages */
@@ -892,20 +8057,31 @@ static void client_list_thread_end()
 				sceNetSocketAbort(it->pasv_sockfd, data_abort_flags);
 			}
 		}
-
-		/* Wait until the client threads ends */
-		sceKernelWaitThreadEnd(client_thid, NULL, NULL);
+#if FTPVITA_FEATURE_MODE_E
+		for (i = 1; i < it->n_streams; i++)
+			sceNetSocketAbort(it->stream_sockfd[i], data_abort_flags);
+#endif
 
 		it = next;
 	}
 
 	sceKernelUnlockMutex(client_list_mtx, 1);
+
+	/* Wait until the client threads end, without the mutex: a thread
+	 * closing on its own removes itself from the list */
+	for (i = 0; i < n; i++)
+		sceKernelWaitThreadEnd(client_thids[i], NULL, NULL);
 }
 
 static int client_thread(SceSize args, void *argp)
 {
 	char cmd[16];
+	const char *p;
 	cmd_dispatch_func dispatch_func;
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+	async_cmd_func async_func;
+	async_cmd_done_func async_done;
+#endif
 	ftpvita_client_info_t *client = *(ftpvita_client_info_t **)argp;
 
 	DEBUG("Client thread %i started!\n", client->num);
@@ -922,8 +8098,15 @@ static int client_thread(SceSize args, void *argp)
 
 			INFO("\t%i> %s", client->num, client->recv_buffer);
 
-			/* The command is the first chars until the first space */
-			sscanf(client->recv_buffer, "%s", cmd);
+			/* Skip the Telnet IP and Synch sequence clients send before ABOR */
+			for (p = client->recv_buffer; *(const unsigned char *)p >= 0x80; p++)
+				;
+
+			/* The command is the first chars until the first space,
+			 * ignore lines that are empty or only whitespace */
+			cmd[0] = '\0';
+			if (sscanf(p, "%15s", cmd) != 1)
+				continue;
 
 			client->recv_cmd_args = strchr(client->recv_buffer, ' ');
 			if (client->recv_cmd_args)
@@ -931,20 +8114,29 @@ static int client_thread(SceSize args, void *argp)
 			else
 				client->recv_cmd_args = client->recv_buffer;
 
+			client_info_write_begin(client);
+			strcpy(client->cur_cmd, cmd);
+			client_info_write_end(client);
+
 			/* Wait 1 ms before sending any data */
 			sceKernelDelayThread(1*1000);
 
+			STAT_INC(commands);
+
 			if ((dispatch_func = get_dispatch_func(cmd))) {
 				dispatch_func(client);
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+			} else if (get_async_dispatch(cmd, &async_func, &async_done)) {
+				async_cmd_submit(client, cmd, async_func, async_done);
+#endif
 			} else {
+				STAT_INC(commands_unknown);
 				client_send_ctrl_msg(client, "502 Sorry, command not implemented. :(" FTPVITA_EOL);
 			}
 
 		} else if (client->n_recv == 0) {
 			/* Value 0 means connection closed by the remote peer */
 			INFO("Connection closed by the client %i.\n", client->num);
-			/* Delete itself from the client list */
-			client_list_delete(client);
 			break;
 		} else if (client->n_recv == SCE_NET_ERROR_EINTR) {
 			/* Socket aborted (ftpvita_fini() called) */
@@ -953,11 +8145,14 @@ static int client_thread(SceSize args, void *argp)
 		} else {
 			/* Other errors */
 			INFO("Client %i socket error: 0x%08X\n", client->num, client->n_recv);
-			client_list_delete(client);
 			break;
 		}
 	}
 
+	/* Delete itself from the client list, also when aborted: the list
+	 * is walked by ftpvita_get_sessions() until ftpvita_fini() is done */
+	client_list_delete(client);
+
 	/* Close the client's socket */
 	sceNetSocketClose(client->ctrl_sockfd);
 
@@ -969,14 +8164,65 @@ static int client_thread(SceSize args, void *argp)
 		}
 	}
 
+	/* The worker pool must be done with the client before we free it */
+	async_cmd_cancel(client);
+
+#if FTPVITA_FEATURE_RESUME
+	resume_cache_save(client);
+#endif
+
+	event_post(FTPVITA_EVENT_SESSION_CLOSE, client, NULL, NULL);
+
 	DEBUG("Client thread %i exiting!\n", client->num);
 
-	free(client);
+	mem_free(client);
 
 	sceKernelExitDeleteThread(0);
 	return 0;
 }
 
+/* Run by the server thread on each new connection, before anything is
+ * allocated for it. Returns the reply to reject it with, NULL to accept it */
+static const char *admission_check(const SceNetInAddr *addr)
+{
+	ftpvita_client_info_t *it;
+	unsigned int from_ip = 0;
+	SceUInt64 now;
+
+	/* Every attempt takes a token, rejected or not */
+	if (accept_rate) {
+		now = sceKernelGetProcessTimeWide();
+		if (accept_last == 0)
+			accept_tokens = accept_burst * 1000000ULL;
+		else
+			accept_tokens += (now - accept_last) * accept_rate;
+		if (accept_tokens > accept_burst * 1000000ULL)
+			accept_tokens = accept_burst * 1000000ULL;
+		accept_last = now;
+
+		if (accept_tokens < 1000000)
+			return "421 Too many connection attempts, try again later." FTPVITA_EOL;
+		accept_tokens -= 1000000;
+	}
+
+	if (number_clients >= max_sessions)
+		return "421 Too many connections." FTPVITA_EOL;
+
+	if (max_sessions_per_ip) {
+		sceKernelLockMutex(client_list_mtx, 1, NULL);
+		for (it = client_list; it; it = it->next) {
+			if (it->addr.sin_addr.s_addr == addr->s_addr)
+				from_ip++;
+		}
+		sceKernelUnlockMutex(client_list_mtx, 1);
+
+		if (from_ip >= max_sessions_per_ip)
+			return "421 Too many connections from your address." FTPVITA_EOL;
+	}
+
+	return NULL;
+}
+
 static int server_thread(SceSize args, void *argp)
 {
 	int ret;
@@ -1019,6 +8265,15 @@ static int server_thread(SceSize args, void *argp)
 		if (client_sockfd >= 0) {
 			DEBUG("New connection, client fd: 0x%08X\n", client_sockfd);
 
+			const char *reject = admission_check(&clientaddr.sin_addr);
+			if (reject) {
+				sceNetSend(client_sockfd, reject, strlen(reject), 0);
+				sceNetSocketClose(client_sockfd);
+				STAT_INC(sessions_rejected);
+				continue;
+			}
+			STAT_INC(sessions_accepted);
+
 			/* Get the client's IP address */
 			char remote_ip[16];
 			sceNetInetNtop(SCE_NET_AF_INET,
@@ -1041,17 +8296,40 @@ static int server_thread(SceSize args, void *argp)
 			DEBUG("Client %i thread UID: 0x%08X\n", number_clients, client_thid);
 
 			/* Allocate the ftpvita_client_info_t struct for the new client */
-			ftpvita_client_info_t *client = malloc(sizeof(*client));
+			ftpvita_client_info_t *client = mem_alloc(FTPVITA_MEM_SESSION, sizeof(*client));
 			client->num = number_clients;
 			client->thid = client_thid;
 			client->ctrl_sockfd = client_sockfd;
 			client->data_con_type = FTP_DATA_CONNECTION_NONE;
+			client->rename_path[0] = '\0';
+			client->type_ascii = 0;
+#if FTPVITA_FEATURE_MODE_E
+			client->mode_e = 0;
+			client->parallelism = 1;
+			client->n_streams = 0;
+#endif
+#if FTPVITA_FEATURE_PREFETCH
+			client->prefetch_dir[0] = '\0';
+#endif
+			client->cur_cmd[0] = '\0';
+			client->info_seq = 0;
+			client->xfer_path[0] = '\0';
+			client->bytes_sent = 0;
+			client->bytes_received = 0;
+#if FTPVITA_FEATURE_RESUME
+			client->resume_token = 0;
+#endif
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+			client->async_busy = 0;
+#endif
 			strcpy(client->cur_path, FTP_DEFAULT_PATH);
 			memcpy(&client->addr, &clientaddr, sizeof(client->addr));
 
 			/* Add the new client to the client list */
 			client_list_add(client);
 
+			event_post(FTPVITA_EVENT_SESSION_OPEN, client, NULL, NULL);
+
 			/* Start the client thread */
 			sceKernelStartThread(client_thid, sizeof(client), &client);
 		} else {
@@ -1069,16 +8347,131 @@ static int server_thread(SceSize args, void *argp)
 	return 0;
 }
 
-int ftpvita_init(char *vita_ip, unsigned short int *vita_port)
+#if FTPVITA_FEATURE_METRICS
+static int metrics_http_thread(SceSize args, void *argp)
+{
+	SceNetSockaddrIn addr;
+	char request[256];
+	char header[128];
+	char *buffer;
+	int sockfd, len;
+	int timeout = METRICS_HTTP_TIMEOUT;
+	unsigned int addrlen;
+
+	DEBUG("Metrics HTTP thread started!\n");
+
+	while (1) {
+		addrlen = sizeof(addr);
+		sockfd = sceNetAccept(metrics_http_sockfd, (SceNetSockaddr *)&addr, &addrlen);
+		if (sockfd < 0) {
+			/* Listening socket closed by ftpvita_fini() */
+			break;
+		}
+
+		/* Connections are served one at a time, and ftpvita_fini()
+		 * waits for this thread: don't wait on a silent client */
+		sceNetSetsockopt(sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_RCVTIMEO,
+			&timeout, sizeof(timeout));
+		sceNetSetsockopt(sockfd, SCE_NET_SOL_SOCKET, SCE_NET_SO_SNDTIMEO,
+			&timeout, sizeof(timeout));
+
+		/* We serve the metrics whatever the request is */
+		sceNetRecv(sockfd, request, sizeof(request), 0);
+
+		len = gen_metrics(&buffer);
+		if (len < 0) {
+			snprintf(header, sizeof(header),
+				"HTTP/1.0 503 Service Unavailable\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n");
+			send_all(sockfd, header, strlen(header));
+			sceNetSocketClose(sockfd);
+			continue;
+		}
+
+		snprintf(header, sizeof(header),
+			"HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %d\r\n"
+			"Connection: close\r\n\r\n", len);
+
+		if (send_all(sockfd, header, strlen(header)) == 0)
+			send_all(sockfd, buffer, len);
+		sceNetSocketClose(sockfd);
+		mem_free(buffer);
+	}
+
+	DEBUG("Metrics HTTP thread exiting!\n");
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+static void metrics_http_start()
 {
+	SceNetSockaddrIn addr;
 	int ret;
-	int i;
-	SceNetInitParam initparam;
-	SceNetCtlInfo info;
 
-	if (ftp_initialized) {
-		return -1;
+	metrics_http_sockfd = sceNetSocket("FTPVita_metrics_sock",
+		SCE_NET_AF_INET,
+		SCE_NET_SOCK_STREAM,
+		0);
+	if (metrics_http_sockfd < 0)
+		return;
+
+	addr.sin_family = SCE_NET_AF_INET;
+	addr.sin_addr.s_addr = sceNetHtonl(SCE_NET_INADDR_ANY);
+	addr.sin_port = sceNetHtons(metrics_http_port);
+
+	ret = sceNetBind(metrics_http_sockfd, (SceNetSockaddr *)&addr, sizeof(addr));
+	if (ret >= 0)
+		ret = sceNetListen(metrics_http_sockfd, 8);
+	if (ret < 0) {
+		INFO("Metrics HTTP endpoint error: 0x%08X\n", ret);
+		sceNetSocketClose(metrics_http_sockfd);
+		metrics_http_sockfd = -1;
+		return;
+	}
+
+	metrics_http_thid = sceKernelCreateThread("FTPVita_metrics_thread",
+		metrics_http_thread, 0x10000100, 0x4000, 0, 0, NULL);
+	DEBUG("Metrics HTTP thread UID: 0x%08X\n", metrics_http_thid);
+	if (metrics_http_thid >= 0 && (ret = sceKernelStartThread(metrics_http_thid, 0, NULL)) < 0) {
+		sceKernelDeleteThread(metrics_http_thid);
+		metrics_http_thid = ret;
 	}
+	if (metrics_http_thid < 0) {
+		/* Nothing to wait for in metrics_http_stop() */
+		INFO("Metrics HTTP endpoint error: 0x%08X\n", metrics_http_thid);
+		sceNetSocketClose(metrics_http_sockfd);
+		metrics_http_sockfd = -1;
+		metrics_http_thid = -1;
+	}
+}
+
+static void metrics_http_stop()
+{
+	if (metrics_http_sockfd >= 0) {
+		sceNetSocketClose(metrics_http_sockfd);
+		sceKernelWaitThreadEnd(metrics_http_thid, NULL, NULL);
+		metrics_http_sockfd = -1;
+		metrics_http_thid = -1;
+	}
+}
+#endif
+
+static void notify_state(ftpvita_state_t state, const char *ip)
+{
+	ftpvita_state_cb_t cb = state_cb;
+
+	if (cb)
+		cb(state, ip, FTP_PORT, state_cb_arg);
+}
+
+static int net_start()
+{
+	int ret;
+	SceNetInitParam initparam;
 
 	/* Init Net */
 	ret = sceNetShowNetstat();
@@ -1086,10 +8479,10 @@ int ftpvita_init(char *vita_ip, unsigned short int *vita_port)
 		DEBUG("Net is already initialized.\n");
 		net_init = -1;
 	} else if (ret == SCE_NET_ERROR_ENOTINIT) {
-		net_memory = malloc(NET_INIT_SIZE);
+		net_memory = mem_alloc(FTPVITA_MEM_NET, net_pool_size);
 
 		initparam.memory = net_memory;
-		initparam.size = NET_INIT_SIZE;
+		initparam.size = net_pool_size;
 		initparam.flags = 0;
 
 		ret = net_init = sceNetInit(&initparam);
@@ -1107,18 +8500,40 @@ int ftpvita_init(char *vita_ip, unsigned short int *vita_port)
 	if (netctl_init < 0 && netctl_init != NET_CTL_ERROR_NOT_TERMINATED)
 		goto error_netctlinit;
 
-	/* Get IP address */
-	ret = sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_IP_ADDRESS, &info);
-	DEBUG("sceNetCtlInetGetInfo(): 0x%08X\n", ret);
-	if (ret < 0)
-		goto error_netctlgetinfo;
+	return 0;
 
-	/* Return data */
-	strcpy(vita_ip, info.ip_address);
-	*vita_port = FTP_PORT;
+error_netctlinit:
+	if (net_init == 0) {
+		sceNetTerm();
+		net_init = -1;
+	}
+error_netinit:
+	if (net_memory) {
+		mem_free(net_memory);
+		net_memory = NULL;
+	}
+error_netstat:
+	return ret;
+}
+
+static void net_stop()
+{
+	if (netctl_init == 0)
+		sceNetCtlTerm();
+	if (net_init == 0)
+		sceNetTerm();
+	if (net_memory)
+		mem_free(net_memory);
+
+	netctl_init = -1;
+	net_init = -1;
+	net_memory = NULL;
+}
 
+static void server_start(const char *ip)
+{
 	/* Save the IP of PSVita to a global variable */
-	sceNetInetPton(SCE_NET_AF_INET, info.ip_address, &vita_addr);
+	sceNetInetPton(SCE_NET_AF_INET, ip, &vita_addr);
 
 	/* Create server thread */
 	server_thid = sceKernelCreateThread("FTPVita_server_thread",
@@ -1129,6 +8544,119 @@ int ftpvita_init(char *vita_ip, unsigned short int *vita_port)
 	client_list_mtx = sceKernelCreateMutex("FTPVita_client_list_mutex", 0, 0, NULL);
 	DEBUG("Client list mutex UID: 0x%08X\n", client_list_mtx);
 
+#if FTPVITA_FEATURE_HASH
+	crc32_init_table();
+#endif
+#if FTPVITA_FEATURE_RESUME
+	resume_cache_init();
+#endif
+#if FTPVITA_FEATURE_EVENTS
+	event_queue_init();
+#endif
+#if FTPVITA_FEATURE_HASH
+	hash_pool_init();
+	hash_cache_init();
+#endif
+#if FTPVITA_FEATURE_DIR_CACHE
+	dir_cache_init();
+#endif
+#if FTPVITA_FEATURE_DU
+	walk_init();
+#endif
+#if FTPVITA_FEATURE_PREFETCH
+	prefetch_init();
+#endif
+#if FTPVITA_FEATURE_THUMBS
+	thumb_pool_init();
+#endif
+#if FTPVITA_FEATURE_XFERLOG
+	xferlog_init();
+#endif
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+	async_pool_init();
+#endif
+
+	/* Start the server thread */
+	sceKernelStartThread(server_thid, 0, NULL);
+
+#if FTPVITA_FEATURE_METRICS
+	if (metrics_http_port)
+		metrics_http_start();
+#endif
+
+	server_running = 1;
+}
+
+static void server_stop()
+{
+	/* In order to "stop" the blocking sceNetAccept,
+	 * we have to close the server socket; this way
+	 * the accept call will return an error */
+	sceNetSocketClose(server_sockfd);
+
+	/* Wait until the server threads ends */
+	sceKernelWaitThreadEnd(server_thid, NULL, NULL);
+
+	/* To close the clients we have to do the same:
+	 * we have to iterate over all the clients
+	 * and shutdown their sockets */
+	client_list_thread_end();
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+	async_pool_fini();
+#endif
+
+#if FTPVITA_FEATURE_HASH
+	/* After the async pool, hashing commands run on it */
+	hash_pool_fini();
+	hash_cache_fini();
+#endif
+
+#if FTPVITA_FEATURE_THUMBS
+	thumb_pool_fini();
+#endif
+#if FTPVITA_FEATURE_PREFETCH
+	prefetch_fini();
+#endif
+#if FTPVITA_FEATURE_DU
+	walk_fini();
+#endif
+#if FTPVITA_FEATURE_DIR_CACHE
+	dir_cache_fini();
+#endif
+
+#if FTPVITA_FEATURE_RESUME
+	resume_cache_fini();
+#endif
+
+#if FTPVITA_FEATURE_XFERLOG
+	/* After the clients, so their last transfers get written */
+	xferlog_fini();
+#endif
+
+#if FTPVITA_FEATURE_METRICS
+	metrics_http_stop();
+#endif
+
+#if FTPVITA_FEATURE_EVENTS
+	/* All the sessions are closed, deliver their last events */
+	event_queue_fini();
+#endif
+
+	/* Delete the client list mutex */
+	sceKernelDeleteMutex(client_list_mtx);
+
+	buf_pool_release();
+
+	client_list = NULL;
+	number_clients = 0;
+	server_running = 0;
+}
+
+static void clear_tables()
+{
+	int i;
+
 	/* Init device list */
 	for (i = 0; i < MAX_DEVICES; i++) {
 		device_list[i].valid = 0;
@@ -1137,66 +8665,122 @@ int ftpvita_init(char *vita_ip, unsigned short int *vita_port)
 	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
 		custom_command_dispatchers[i].valid = 0;
 	}
+}
 
-	/* Start the server thread */
-	sceKernelStartThread(server_thid, 0, NULL);
+/* Waits until the PSVita gets an IP address to start the server */
+static int net_wait_thread(SceSize args, void *argp)
+{
+	SceNetCtlInfo info;
+	int state, ret;
 
-	ftp_initialized = 1;
+	DEBUG("Network wait thread started!\n");
 
-	return 0;
+	notify_state(FTPVITA_STATE_WAITING_NETWORK, NULL);
 
-error_netctlgetinfo:
-	if (netctl_init == 0) {
-		sceNetCtlTerm();
-		netctl_init = -1;
+	while (!net_wait_quit) {
+		ret = sceNetCtlInetGetState(&state);
+		if (ret >= 0 && state == SCE_NETCTL_STATE_CONNECTED) {
+			ret = sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_IP_ADDRESS, &info);
+			DEBUG("sceNetCtlInetGetInfo(): 0x%08X\n", ret);
+			if (ret >= 0) {
+				server_start(info.ip_address);
+				notify_state(FTPVITA_STATE_LISTENING, info.ip_address);
+				break;
+			}
+		}
+		sceKernelDelayThread(NET_WAIT_POLL_INTERVAL);
 	}
-error_netctlinit:
-	if (net_init == 0) {
-		sceNetTerm();
-		net_init = -1;
+
+	DEBUG("Network wait thread exiting!\n");
+
+	sceKernelExitDeleteThread(0);
+	return 0;
+}
+
+int ftpvita_init(char *vita_ip, unsigned short int *vita_port)
+{
+	int ret;
+	SceNetCtlInfo info;
+
+	if (ftp_initialized) {
+		return -1;
 	}
-error_netinit:
-	if (net_memory) {
-		free(net_memory);
-		net_memory = NULL;
+
+	ret = net_start();
+	if (ret < 0)
+		return ret;
+
+	/* Get IP address */
+	ret = sceNetCtlInetGetInfo(SCE_NETCTL_INFO_GET_IP_ADDRESS, &info);
+	DEBUG("sceNetCtlInetGetInfo(): 0x%08X\n", ret);
+	if (ret < 0) {
+		net_stop();
+		return ret;
 	}
-error_netstat:
-	return ret;
+
+	/* Return data */
+	strcpy(vita_ip, info.ip_address);
+	*vita_port = FTP_PORT;
+
+	clear_tables();
+	server_start(info.ip_address);
+
+	ftp_initialized = 1;
+
+	notify_state(FTPVITA_STATE_LISTENING, info.ip_address);
+
+	return 0;
 }
 
-void ftpvita_fini()
+int ftpvita_init_async(ftpvita_state_cb_t cb, void *arg)
 {
+	int ret;
+
 	if (ftp_initialized) {
-		/* In order to "stop" the blocking sceNetAccept,
-		 * we have to close the server socket; this way
-		 * the accept call will return an error */
-		sceNetSocketClose(server_sockfd);
+		return -1;
+	}
 
-		/* Wait until the server threads ends */
-		sceKernelWaitThreadEnd(server_thid, NULL, NULL);
+	state_cb_arg = arg;
+	state_cb = cb;
 
-		/* To close the clients we have to do the same:
-		 * we have to iterate over all the clients
-		 * and shutdown their sockets */
-		client_list_thread_end();
+	ret = net_start();
+	if (ret < 0) {
+		notify_state(FTPVITA_STATE_ERROR, NULL);
+		return ret;
+	}
 
-		/* Delete the client list mutex */
-		sceKernelDeleteMutex(client_list_mtx);
+	clear_tables();
 
-		client_list = NULL;
-		number_clients = 0;
+	net_wait_quit = 0;
+	net_wait_thid = sceKernelCreateThread("FTPVita_net_wait_thread",
+		net_wait_thread, 0x10000100, 0x4000, 0, 0, NULL);
+	DEBUG("Network wait thread UID: 0x%08X\n", net_wait_thid);
+	sceKernelStartThread(net_wait_thid, 0, NULL);
 
-		if (netctl_init == 0)
-			sceNetCtlTerm();
-		if (net_init == 0)
-			sceNetTerm();
-		if (net_memory)
-			free(net_memory);
+	ftp_initialized = 1;
+
+	return 0;
+}
+
+void ftpvita_fini()
+{
+	if (ftp_initialized) {
+		if (net_wait_thid >= 0) {
+			net_wait_quit = 1;
+			sceKernelWaitThreadEnd(net_wait_thid, NULL, NULL);
+			net_wait_thid = -1;
+		}
+
+		if (server_running)
+			server_stop();
+
+		net_stop();
+
+		mem_leak_check();
 
-		netctl_init = -1;
-		net_init = -1;
-		net_memory = NULL;
 		ftp_initialized = 0;
+
+		notify_state(FTPVITA_STATE_STOPPED, NULL);
 	}
 }
 
@@ -1205,12 +8789,46 @@ int ftpvita_is_initialized()
 	return ftp_initialized;
 }
 
+unsigned int ftpvita_trim_memory(ftpvita_trim_level_t level)
+{
+	unsigned int freed;
+
+	/* Buffers in use belong to transfers and aren't in the pool */
+	freed = buf_pool_release();
+
+	/* The caches are gone already when the server isn't running */
+	if (!server_running)
+		return freed;
+
+#if FTPVITA_FEATURE_PREFETCH
+	freed += prefetch_trim();
+#endif
+	if (level < FTPVITA_TRIM_CACHES)
+		return freed;
+
+#if FTPVITA_FEATURE_DIR_CACHE
+	freed += dir_cache_trim();
+#endif
+	if (level < FTPVITA_TRIM_ALL)
+		return freed;
+
+#if FTPVITA_FEATURE_HASH
+	freed += hash_cache_trim();
+#endif
+
+	return freed;
+}
+
 int ftpvita_add_device(const char *devname)
 {
 	int i;
+	if (strlen(devname) >= sizeof(device_list[0].name))
+		return 0;
+
 	for (i = 0; i < MAX_DEVICES; i++) {
 		if (!device_list[i].valid) {
 			strcpy(device_list[i].name, devname);
+			device_list[i].cache_policy = FTPVITA_CACHE_POLICY;
 			device_list[i].valid = 1;
 			return 1;
 		}
@@ -1218,6 +8836,18 @@ int ftpvita_add_device(const char *devname)
 	return 0;
 }
 
+int ftpvita_set_cache_policy(const char *devname, ftpvita_cache_policy_t policy)
+{
+	int i;
+	for (i = 0; i < MAX_DEVICES; i++) {
+		if (device_list[i].valid && strcmp(devname, device_list[i].name) == 0) {
+			device_list[i].cache_policy = policy;
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int ftpvita_del_device(const char *devname)
 {
 	int i;
@@ -1245,6 +8875,187 @@ void ftpvita_set_file_buf_size(unsigned int size)
 	file_buf_size = size;
 }
 
+#if FTPVITA_FEATURE_METRICS
+void ftpvita_set_metrics_http_port(unsigned short port)
+{
+	metrics_http_port = port;
+}
+#endif
+
+#if FTPVITA_FEATURE_XFERLOG
+void ftpvita_set_xferlog(const char *path, unsigned int max_size)
+{
+	if (path)
+		snprintf(xferlog_path, sizeof(xferlog_path), "%s", path);
+	else
+		xferlog_path[0] = '\0';
+	xferlog_max_size = max_size;
+}
+#endif
+
+void ftpvita_set_session_limits(unsigned int sessions, unsigned int per_ip,
+				unsigned int rate, unsigned int burst)
+{
+	max_sessions = sessions && sessions < FTPVITA_MAX_SESSIONS ?
+		sessions : FTPVITA_MAX_SESSIONS;
+	max_sessions_per_ip = per_ip;
+	accept_rate = rate;
+	accept_burst = burst ? burst : 1;
+	accept_last = 0;
+}
+
+void ftpvita_set_io_mode(ftpvita_io_mode_t mode)
+{
+	io_mode = mode;
+}
+
+void ftpvita_set_net_pool_size(unsigned int size)
+{
+	net_pool_size = size;
+}
+
+void ftpvita_get_stats(ftpvita_stats_t *out)
+{
+	SceNetStatisticsInfo net_info;
+
+	out->bytes_sent = STAT_LOAD(bytes_sent);
+	out->bytes_received = STAT_LOAD(bytes_received);
+	out->files_sent = STAT_LOAD(files_sent);
+	out->files_received = STAT_LOAD(files_received);
+	out->commands = STAT_LOAD(commands);
+	out->active_sessions = __atomic_load_n(&number_clients, __ATOMIC_RELAXED);
+	out->sessions_accepted = STAT_LOAD(sessions_accepted);
+	out->sessions_rejected = STAT_LOAD(sessions_rejected);
+	out->buffers_in_use = STAT_LOAD(buffers_in_use);
+	out->buffers_idle = STAT_LOAD(buffers_idle);
+	out->prefetch_hits = STAT_LOAD(prefetch_hits);
+	out->prefetch_misses = STAT_LOAD(prefetch_misses);
+	out->thumb_hits = STAT_LOAD(thumb_hits);
+	out->thumb_misses = STAT_LOAD(thumb_misses);
+	out->xferlog_dropped = STAT_LOAD(xferlog_dropped);
+
+	out->net_pool_size = net_memory ? net_pool_size : 0;
+	if (sceNetGetStatisticsInfo(&net_info, 0) >= 0) {
+		out->net_pool_free = net_info.libnet_mem_free_size;
+		out->net_pool_free_min = net_info.libnet_mem_free_min;
+	} else {
+		out->net_pool_free = 0;
+		out->net_pool_free_min = 0;
+	}
+}
+
+int ftpvita_get_sessions(ftpvita_session_info_t *sessions, int max)
+{
+	ftpvita_client_info_t *it;
+	ftpvita_session_info_t *s;
+	unsigned int seq;
+	int n = 0;
+
+	if (!server_running)
+		return 0;
+
+	sceKernelLockMutex(client_list_mtx, 1, NULL);
+
+	for (it = client_list; it != NULL && n < max; it = it->next) {
+		s = &sessions[n++];
+		s->num = it->num;
+		s->addr = it->addr.sin_addr;
+		/* Retry if the client thread wrote cur_cmd or xfer_path while
+		 * we copied them, the working directory can change under us
+		 * too, so every copy is bounded */
+		while (1) {
+			seq = __atomic_load_n(&it->info_seq, __ATOMIC_ACQUIRE);
+			memcpy(s->cmd, it->cur_cmd, sizeof(s->cmd));
+			s->transferring = it->xfer_path[0] != '\0';
+			strncpy(s->path, s->transferring ? it->xfer_path : it->cur_path,
+				sizeof(s->path) - 1);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (!(seq & 1) && seq == __atomic_load_n(&it->info_seq, __ATOMIC_RELAXED))
+				break;
+			/* Let the writer finish */
+			sceKernelDelayThread(100);
+		}
+		s->cmd[sizeof(s->cmd) - 1] = '\0';
+		s->path[sizeof(s->path) - 1] = '\0';
+		s->bytes_sent = __atomic_load_n(&it->bytes_sent, __ATOMIC_RELAXED);
+		s->bytes_received = __atomic_load_n(&it->bytes_received, __ATOMIC_RELAXED);
+	}
+
+	sceKernelUnlockMutex(client_list_mtx, 1);
+
+	return n;
+}
+
+int ftpvita_set_allocator(ftpvita_alloc_cb_t cb, void *arg)
+{
+	int i;
+
+	for (i = 0; i < FTPVITA_MEM_TAG_MAX; i++) {
+		if (__atomic_load_n(&mem_stats[i].blocks, __ATOMIC_RELAXED) != 0)
+			return -1;
+	}
+
+	alloc_cb_arg = arg;
+	alloc_cb = cb;
+	return 0;
+}
+
+int ftpvita_get_mem_stats(ftpvita_mem_stats_t *stats, int max)
+{
+	int i;
+
+	for (i = 0; i < FTPVITA_MEM_TAG_MAX && i < max; i++) {
+		stats[i].tag = mem_tag_names[i];
+		stats[i].current = __atomic_load_n(&mem_stats[i].current, __ATOMIC_RELAXED);
+		stats[i].peak = __atomic_load_n(&mem_stats[i].peak, __ATOMIC_RELAXED);
+		stats[i].blocks = __atomic_load_n(&mem_stats[i].blocks, __ATOMIC_RELAXED);
+		stats[i].allocs = __atomic_load_n(&mem_stats[i].allocs, __ATOMIC_RELAXED);
+		stats[i].failures = __atomic_load_n(&mem_stats[i].failures, __ATOMIC_RELAXED);
+	}
+
+	return i;
+}
+
+void ftpvita_dump_mem_stats()
+{
+	ftpvita_mem_stats_t mem[FTPVITA_MEM_TAG_MAX];
+	int i, n;
+
+	n = ftpvita_get_mem_stats(mem, FTPVITA_MEM_TAG_MAX);
+
+	INFO("%-10s %10s %10s %7s %8s %8s\n", "tag", "current", "peak", "blocks", "allocs", "failures");
+	for (i = 0; i < n; i++) {
+		INFO("%-10s %10u %10u %7u %8u %8u\n", mem[i].tag, mem[i].current,
+			mem[i].peak, mem[i].blocks, mem[i].allocs, mem[i].failures);
+	}
+}
+
+int ftpvita_get_device_stats(ftpvita_device_stats_t *devices, int max)
+{
+	int i, n = 0;
+
+	for (i = 0; i < MAX_DEVICES && n < max; i++) {
+		if (!device_list[i].valid)
+			continue;
+
+		strcpy(devices[n].name, device_list[i].name);
+		devices[n].bytes_read = STAT_LOAD(dev_bytes_read[i]);
+		devices[n].bytes_written = STAT_LOAD(dev_bytes_written[i]);
+		devices[n].io_time_us = STAT_LOAD(dev_io_us[i]);
+		n++;
+	}
+
+	return n;
+}
+
+#if FTPVITA_FEATURE_EVENTS
+void ftpvita_set_event_cb(ftpvita_event_cb_t cb, void *arg)
+{
+	event_cb_arg = arg;
+	event_cb = cb;
+}
+#endif
+
 int ftpvita_ext_add_custom_command(const char *cmd, cmd_dispatch_func func)
 {
 	int i;
@@ -1252,12 +9063,34 @@ int ftpvita_ext_add_custom_command(const char *cmd, cmd_dispatch_func func)
 		if (!custom_command_dispatchers[i].valid) {
 			custom_command_dispatchers[i].cmd = cmd;
 			custom_command_dispatchers[i].func = func;
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+			custom_command_dispatchers[i].async_func = NULL;
+			custom_command_dispatchers[i].async_done = NULL;
+#endif
+			custom_command_dispatchers[i].valid = 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+int ftpvita_ext_add_async_command(const char *cmd, async_cmd_func func, async_cmd_done_func done)
+{
+	int i;
+	for (i = 0; i < MAX_CUSTOM_COMMANDS; i++) {
+		if (!custom_command_dispatchers[i].valid) {
+			custom_command_dispatchers[i].cmd = cmd;
+			custom_command_dispatchers[i].func = NULL;
+			custom_command_dispatchers[i].async_func = func;
+			custom_command_dispatchers[i].async_done = done;
 			custom_command_dispatchers[i].valid = 1;
 			return 1;
 		}
 	}
 	return 0;
 }
+#endif
 
 int ftpvita_ext_del_custom_command(const char *cmd)
 {
@@ -1280,3 +9113,14 @@ void ftpvita_ext_client_send_data_msg(ftpvita_client_info_t *client, const char
 {
 	client_send_data_msg(client, str);
 }
+
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+int ftpvita_ext_async_reply(ftpvita_async_cmd_t *cmd, const char *msg)
+{
+	if (cmd->cancelled)
+		return -1;
+
+	client_send_ctrl_msg(cmd->client, msg);
+	return 0;
+}
+#endif
@@ -6,22 +6,251 @@
 #define FTPVITA_H
 
 #include <psp2/types.h>
+#include <stddef.h>
 #include <sys/syslimits.h>
 #include <psp2/net/net.h>
 #include <psp2/net/netctl.h>
 
+#include "ftpvita_config.h"
+
 typedef void (*ftpvita_log_cb_t)(const char *);
 
+typedef enum {
+	FTPVITA_STATE_STOPPED,
+	FTPVITA_STATE_WAITING_NETWORK,
+	FTPVITA_STATE_LISTENING,
+	FTPVITA_STATE_ERROR,
+} ftpvita_state_t;
+
+/* vita_ip is only valid for FTPVITA_STATE_LISTENING */
+typedef void (*ftpvita_state_cb_t)(ftpvita_state_t state, const char *vita_ip,
+				   unsigned short vita_port, void *arg);
+
 /* Returns PSVita's IP and FTP port. 0 on success */
 int ftpvita_init(char *vita_ip, unsigned short int *vita_port);
+/* Returns immediately, the server starts listening as soon as the
+ * PSVita is connected to a network. The callback is run from a library
+ * thread on each state change. 0 on success */
+int ftpvita_init_async(ftpvita_state_cb_t cb, void *arg);
 void ftpvita_fini();
 int ftpvita_is_initialized();
 int ftpvita_add_device(const char *devname);
 int ftpvita_del_device(const char *devname);
+
+typedef enum {
+	/* Cached data is used as is, only the server's own changes drop it */
+	FTPVITA_CACHE_TRUST,
+	/* Cached data is checked against a stat of the file or directory
+	 * first, for devices other applications write to */
+	FTPVITA_CACHE_REVALIDATE,
+	/* Nothing on the device is cached */
+	FTPVITA_CACHE_BYPASS,
+} ftpvita_cache_policy_t;
+
+/* Applies to the directory cache, read-ahead and hash cache of the files
+ * of an added device, FTPVITA_CACHE_POLICY by default. 1 on success */
+int ftpvita_set_cache_policy(const char *devname, ftpvita_cache_policy_t policy);
 void ftpvita_set_info_log_cb(ftpvita_log_cb_t cb);
 void ftpvita_set_debug_log_cb(ftpvita_log_cb_t cb);
 void ftpvita_set_file_buf_size(unsigned int size);
 
+typedef enum {
+	/* The transfer waits for every storage read or write */
+	FTPVITA_IO_BLOCKING,
+	/* Storage I/O is asynchronous on two buffers, so it overlaps
+	 * with the network; falls back to blocking if unavailable */
+	FTPVITA_IO_ASYNC,
+} ftpvita_io_mode_t;
+
+/* Applies to the transfers started afterwards, FTPVITA_IO_ASYNC by default */
+void ftpvita_set_io_mode(ftpvita_io_mode_t mode);
+
+/* Limits on new control connections, the ones over them get a 421 reply:
+ * at most sessions at once (0: FTPVITA_MAX_SESSIONS) and per_ip from the
+ * same address (0: no limit), accepted at rate per second (0: no limit)
+ * with bursts of up to burst. Defaults from ftpvita_config.h */
+void ftpvita_set_session_limits(unsigned int sessions, unsigned int per_ip,
+				unsigned int rate, unsigned int burst);
+
+/* Size of the memory pool given to sceNetInit(), if the library has
+ * to initialize the network. Must be called before ftpvita_init() */
+void ftpvita_set_net_pool_size(unsigned int size);
+
+typedef enum {
+	/* Idle transfer buffers and read-ahead data */
+	FTPVITA_TRIM_BUFFERS,
+	/* Also the directory cache */
+	FTPVITA_TRIM_CACHES,
+	/* Also the hash cache, the most expensive to rebuild */
+	FTPVITA_TRIM_ALL,
+} ftpvita_trim_level_t;
+
+/* Frees the memory the library holds on to for speed, up to level.
+ * Transfers in progress keep their buffers and what's dropped is built
+ * again on demand. Returns the number of bytes freed */
+unsigned int ftpvita_trim_memory(ftpvita_trim_level_t level);
+
+/* Statistics */
+
+typedef struct {
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+	unsigned int files_sent;
+	unsigned int files_received;
+	unsigned int commands;
+	unsigned int active_sessions;
+	/* Control connections accepted and rejected by the session limits */
+	unsigned int sessions_accepted;
+	unsigned int sessions_rejected;
+	/* Transfer buffer pool occupancy */
+	unsigned int buffers_in_use;
+	unsigned int buffers_idle;
+	/* Network memory pool: size (0 if the network was initialized by
+	 * someone else), free bytes and lowest free bytes seen */
+	unsigned int net_pool_size;
+	unsigned int net_pool_free;
+	unsigned int net_pool_free_min;
+	/* RETRs served from the read-ahead and RETRs that weren't */
+	unsigned int prefetch_hits;
+	unsigned int prefetch_misses;
+	/* SITE THUMB requests served from the disk cache and generated */
+	unsigned int thumb_hits;
+	unsigned int thumb_misses;
+	/* Transfer log lines lost, the buffer or the file being full */
+	unsigned int xferlog_dropped;
+} ftpvita_stats_t;
+
+void ftpvita_get_stats(ftpvita_stats_t *stats);
+
+typedef struct {
+	int num;
+	SceNetInAddr addr;
+	/* Last command received */
+	char cmd[16];
+	/* File being transferred, or the working directory if none */
+	char path[PATH_MAX];
+	int transferring;
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+} ftpvita_session_info_t;
+
+/* Fills up to max entries, returns the number of sessions filled */
+int ftpvita_get_sessions(ftpvita_session_info_t *sessions, int max);
+
+typedef struct {
+	char name[FTPVITA_DEVNAME_MAX];
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	/* Time spent inside read and write calls */
+	unsigned long long io_time_us;
+} ftpvita_device_stats_t;
+
+/* Fills up to max entries, returns the number of devices filled */
+int ftpvita_get_device_stats(ftpvita_device_stats_t *devices, int max);
+
+/* Memory */
+
+/* What the library allocates memory for */
+typedef enum {
+	/* sceNetInit() pool */
+	FTPVITA_MEM_NET,
+	/* Session structs */
+	FTPVITA_MEM_SESSION,
+	/* Transfer buffers */
+	FTPVITA_MEM_XFER,
+	FTPVITA_MEM_XFERLOG,
+	/* Chunks being hashed */
+	FTPVITA_MEM_HASH,
+	FTPVITA_MEM_HASH_CACHE,
+	FTPVITA_MEM_DIR_CACHE,
+	/* SITE DU and TREEHASH tree walks */
+	FTPVITA_MEM_WALK,
+	FTPVITA_MEM_PREFETCH,
+	FTPVITA_MEM_METRICS,
+	FTPVITA_MEM_THUMB,
+	FTPVITA_MEM_EXTRACT,
+	FTPVITA_MEM_VERIFY,
+	FTPVITA_MEM_TAG_MAX,
+} ftpvita_mem_tag_t;
+
+/* Works like realloc(): allocates if ptr is NULL, frees ptr and returns
+ * NULL if size is 0, else resizes ptr. Blocks must be aligned like
+ * malloc()'s. ptr is always a block of the same tag */
+typedef void *(*ftpvita_alloc_cb_t)(void *ptr, size_t size, ftpvita_mem_tag_t tag, void *arg);
+
+/* All the library's allocations go through cb, NULL restores malloc().
+ * Fails (-1) while the library holds memory, i.e. between ftpvita_init()
+ * and ftpvita_fini(). 0 on success */
+int ftpvita_set_allocator(ftpvita_alloc_cb_t cb, void *arg);
+
+typedef struct {
+	const char *tag;
+	/* Bytes and blocks allocated now, and the most bytes ever */
+	unsigned int current;
+	unsigned int peak;
+	unsigned int blocks;
+	/* Allocations made and the ones that failed, since the start */
+	unsigned int allocs;
+	unsigned int failures;
+} ftpvita_mem_stats_t;
+
+/* Fills up to max entries, one per tag in ftpvita_mem_tag_t order,
+ * returns the number filled. Once ftpvita_fini() returns every blocks
+ * count is 0, unless something leaked */
+int ftpvita_get_mem_stats(ftpvita_mem_stats_t *stats, int max);
+
+/* Writes the memory statistics to the info log */
+void ftpvita_dump_mem_stats();
+
+#if FTPVITA_FEATURE_METRICS
+/* Serve Prometheus metrics over HTTP on this port, 0 disables it (default).
+ * Must be called before ftpvita_init() */
+void ftpvita_set_metrics_http_port(unsigned short port);
+#endif
+
+#if FTPVITA_FEATURE_XFERLOG
+/* Log every transfer to path (a PSVita path, e.g. "ux0:data/xferlog") in
+ * xferlog format. When it would grow past max_size bytes (0: no limit) it's
+ * renamed to path.1. NULL disables it (default). Must be called before
+ * ftpvita_init() */
+void ftpvita_set_xferlog(const char *path, unsigned int max_size);
+#endif
+
+/* Event hooks */
+
+typedef enum {
+	FTPVITA_EVENT_SESSION_OPEN,
+	FTPVITA_EVENT_SESSION_CLOSE,
+	FTPVITA_EVENT_UPLOAD_COMPLETE,
+	FTPVITA_EVENT_DELETE,
+	FTPVITA_EVENT_RENAME,
+	FTPVITA_EVENT_MKDIR,
+	FTPVITA_EVENT_RMDIR,
+} ftpvita_event_type_t;
+
+typedef struct {
+	ftpvita_event_type_t type;
+	/* Client number and IP that caused the event */
+	int client_num;
+	SceNetInAddr client_addr;
+	/* PSVita path affected (the destination for renames) */
+	char path[PATH_MAX];
+	/* Source path for renames */
+	char old_path[PATH_MAX];
+	/* Upload size and CRC32 (only for whole-file uploads) */
+	unsigned long long size;
+	int has_crc32;
+	unsigned int crc32;
+} ftpvita_event_t;
+
+typedef void (*ftpvita_event_cb_t)(const ftpvita_event_t *event, void *arg);
+
+#if FTPVITA_FEATURE_EVENTS
+/* The callback runs on a dedicated thread; if it can't keep up,
+ * events are dropped instead of stalling the sessions */
+void ftpvita_set_event_cb(ftpvita_event_cb_t cb, void *arg);
+#endif
+
 /* Extended functionality */
 
 #define FTPVITA_EOL "\r\n"
@@ -32,6 +261,30 @@ typedef enum {
 	FTP_DATA_CONNECTION_PASSIVE,
 } DataConnectionType;
 
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+struct ftpvita_client_info;
+struct ftpvita_async_cmd;
+
+typedef int (*async_cmd_func)(struct ftpvita_async_cmd *cmd); // Async command handler
+typedef void (*async_cmd_done_func)(struct ftpvita_async_cmd *cmd, int result); // Completion callback
+
+typedef struct ftpvita_async_cmd {
+	/* Number of the client that issued the command */
+	int client_num;
+	/* Command name and arguments, copied from the receive buffer */
+	char cmd[16];
+	char args[FTPVITA_RECV_BUFFER_SIZE];
+	/* Client's working directory when the command was issued */
+	char cur_path[PATH_MAX];
+	/* Set when the client sends ABOR, handlers should poll it */
+	volatile int cancelled;
+	/* Private */
+	struct ftpvita_client_info *client;
+	async_cmd_func func;
+	async_cmd_done_func done;
+} ftpvita_async_cmd_t;
+#endif
+
 typedef struct ftpvita_client_info {
 	/* Client number */
 	int num;
@@ -50,7 +303,7 @@ typedef struct ftpvita_client_info {
 	SceNetSockaddrIn addr;
 	/* Receive buffer attributes */
 	int n_recv;
-	char recv_buffer[512];
+	char recv_buffer[FTPVITA_RECV_BUFFER_SIZE];
 	/* Points to the character after the first space */
 	const char *recv_cmd_args;
 	/* Current working directory */
@@ -62,6 +315,37 @@ typedef struct ftpvita_client_info {
 	struct ftpvita_client_info *prev;
 	/* Offset for transfer resume */
 	unsigned int restore_point;
+	/* TYPE A, line endings are converted */
+	int type_ascii;
+	/* Last command, file being transferred and byte counters,
+	 * as reported by ftpvita_get_sessions(). info_seq is odd
+	 * while cur_cmd or xfer_path are being written */
+	char cur_cmd[16];
+	unsigned int info_seq;
+	char xfer_path[PATH_MAX];
+	unsigned long long bytes_sent;
+	unsigned long long bytes_received;
+#if FTPVITA_FEATURE_MODE_E
+	/* MODE E is set, data connections of its transfers (OPTS RETR
+	 * Parallelism) and the sockets of the one in progress */
+	int mode_e;
+	int parallelism;
+	int stream_sockfd[FTPVITA_MAX_STREAMS];
+	int n_streams;
+#endif
+#if FTPVITA_FEATURE_PREFETCH
+	/* Directory of the last RETR, to detect sequential downloads */
+	char prefetch_dir[PATH_MAX];
+#endif
+#if FTPVITA_FEATURE_RESUME
+	/* Token to resume this session from another connection, 0 if none */
+	unsigned long long resume_token;
+#endif
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+	/* Asynchronous command in progress */
+	ftpvita_async_cmd_t async_cmd;
+	int async_busy;
+#endif
 } ftpvita_client_info_t;
 
 
@@ -72,4 +356,15 @@ int ftpvita_ext_del_custom_command(const char *cmd);
 void ftpvita_ext_client_send_ctrl_msg(ftpvita_client_info_t *client, const char *msg);
 void ftpvita_ext_client_send_data_msg(ftpvita_client_info_t *client, const char *str);
 
+#if FTPVITA_FEATURE_ASYNC_COMMANDS
+/* Asynchronous commands run on a worker pool, so the session keeps
+ * processing commands (ABOR in particular) while they execute.
+ * The handler streams replies with ftpvita_ext_async_reply(), which
+ * become no-ops once the command is cancelled; the library then
+ * replies 426 itself. The done callback, if any, runs on the worker
+ * right after the handler returns. */
+int ftpvita_ext_add_async_command(const char *cmd, async_cmd_func func, async_cmd_done_func done);
+int ftpvita_ext_async_reply(ftpvita_async_cmd_t *cmd, const char *msg);
+#endif
+
 #endif
@@ -0,0 +1,312 @@
+/*
+ * Copyright (c) 2015-2016 Sergi Granell (xerpi)
+ */
+
+#ifndef FTPVITA_CONFIG_H
+#define FTPVITA_CONFIG_H
+
+/* Compile-time configuration of libftpvita.
+ *
+ * Every option can be overridden with -D on the command line or by
+ * pointing FTPVITA_USER_CONFIG to a header with the overrides, e.g.
+ *     make CFLAGS+='-DFTPVITA_USER_CONFIG=\"my_config.h\"'
+ * The application must be built with the same configuration as the
+ * library, since some of it changes the public structures.
+ *
+ * Features are enabled with 1 and compiled out entirely with 0.
+ */
+
+#ifdef FTPVITA_USER_CONFIG
+#  include FTPVITA_USER_CONFIG
+#endif
+
+/* Features */
+
+/* STOR, APPE, DELE, RMD, MKD, RNFR and RNTO; 0 gives a read-only server */
+#ifndef FTPVITA_FEATURE_WRITE
+#  define FTPVITA_FEATURE_WRITE 1
+#endif
+
+/* Prometheus metrics: RETR of the metrics file, SITE STATS, HTTP endpoint */
+#ifndef FTPVITA_FEATURE_METRICS
+#  define FTPVITA_FEATURE_METRICS 1
+#endif
+
+/* Event hooks and their dispatcher thread */
+#ifndef FTPVITA_FEATURE_EVENTS
+#  define FTPVITA_FEATURE_EVENTS 1
+#endif
+
+/* Asynchronous custom commands and their worker pool */
+#ifndef FTPVITA_FEATURE_ASYNC_COMMANDS
+#  define FTPVITA_FEATURE_ASYNC_COMMANDS 1
+#endif
+
+/* CRC32 hashing: upload event hashes, XCRC and HASH commands */
+#ifndef FTPVITA_FEATURE_HASH
+#  define FTPVITA_FEATURE_HASH 1
+#endif
+
+/* Session resume tokens (SITE TOKEN and SITE RESUME) */
+#ifndef FTPVITA_FEATURE_RESUME
+#  define FTPVITA_FEATURE_RESUME 1
+#endif
+
+/* SITE DU, recursive directory sizes */
+#ifndef FTPVITA_FEATURE_DU
+#  define FTPVITA_FEATURE_DU 1
+#endif
+
+/* Cache of the directories read by tree walks */
+#ifndef FTPVITA_FEATURE_DIR_CACHE
+#  define FTPVITA_FEATURE_DIR_CACHE 1
+#endif
+
+/* Only tree walks fill the directory cache */
+#if !FTPVITA_FEATURE_DU
+#  undef FTPVITA_FEATURE_DIR_CACHE
+#  define FTPVITA_FEATURE_DIR_CACHE 0
+#endif
+
+/* Read-ahead of the next file and SITE PREFETCH */
+#ifndef FTPVITA_FEATURE_PREFETCH
+#  define FTPVITA_FEATURE_PREFETCH 1
+#endif
+
+/* Extended block mode (MODE E): a transfer over parallel data connections */
+#ifndef FTPVITA_FEATURE_MODE_E
+#  define FTPVITA_FEATURE_MODE_E 1
+#endif
+
+/* Transfer log, see ftpvita_set_xferlog() */
+#ifndef FTPVITA_FEATURE_XFERLOG
+#  define FTPVITA_FEATURE_XFERLOG 1
+#endif
+
+/* SITE THUMB, JPEG and PNG thumbnails cached on the memory card */
+#ifndef FTPVITA_FEATURE_THUMBS
+#  define FTPVITA_FEATURE_THUMBS 1
+#endif
+
+/* SITE TREEHASH, Merkle digests of directory trees */
+#ifndef FTPVITA_FEATURE_TREEHASH
+#  define FTPVITA_FEATURE_TREEHASH 1
+#endif
+
+/* The tree digests are made of the file CRC32s */
+#if !FTPVITA_FEATURE_HASH
+#  undef FTPVITA_FEATURE_TREEHASH
+#  define FTPVITA_FEATURE_TREEHASH 0
+#endif
+
+/* SITE VERIFY, checking a tree against an uploaded manifest */
+#ifndef FTPVITA_FEATURE_VERIFY
+#  define FTPVITA_FEATURE_VERIFY 1
+#endif
+
+/* The manifest has the CRC32s of the files */
+#if !FTPVITA_FEATURE_HASH
+#  undef FTPVITA_FEATURE_VERIFY
+#  define FTPVITA_FEATURE_VERIFY 0
+#endif
+
+/* SITE EXTRACT, unpacking zip and tar archives on the device */
+#ifndef FTPVITA_FEATURE_EXTRACT
+#  define FTPVITA_FEATURE_EXTRACT 1
+#endif
+
+/* Extracting needs the write commands */
+#if !FTPVITA_FEATURE_WRITE
+#  undef FTPVITA_FEATURE_EXTRACT
+#  define FTPVITA_FEATURE_EXTRACT 0
+#endif
+
+/* Limits */
+
+/* Maximum number of simultaneous control sessions */
+#ifndef FTPVITA_MAX_SESSIONS
+#  define FTPVITA_MAX_SESSIONS 32
+#endif
+
+/* Maximum number of control sessions from the same IP, 0 for no limit */
+#ifndef FTPVITA_MAX_SESSIONS_PER_IP
+#  define FTPVITA_MAX_SESSIONS_PER_IP 8
+#endif
+
+/* New control connections accepted per second, 0 for no limit, and
+ * how many can be accepted at once after a quiet period */
+#ifndef FTPVITA_ACCEPT_RATE
+#  define FTPVITA_ACCEPT_RATE 10
+#endif
+
+#ifndef FTPVITA_ACCEPT_BURST
+#  define FTPVITA_ACCEPT_BURST 20
+#endif
+
+/* Closed sessions kept so they can be resumed */
+#ifndef FTPVITA_RESUME_CACHE_SIZE
+#  define FTPVITA_RESUME_CACHE_SIZE 8
+#endif
+
+/* Seconds a closed session can be resumed for */
+#ifndef FTPVITA_RESUME_TTL
+#  define FTPVITA_RESUME_TTL 300
+#endif
+
+#ifndef FTPVITA_MAX_DEVICES
+#  define FTPVITA_MAX_DEVICES 16
+#endif
+
+/* Maximum device name length, including the ':' and the terminator */
+#ifndef FTPVITA_DEVNAME_MAX
+#  define FTPVITA_DEVNAME_MAX 16
+#endif
+
+#ifndef FTPVITA_MAX_CUSTOM_COMMANDS
+#  define FTPVITA_MAX_CUSTOM_COMMANDS 16
+#endif
+
+/* Size of the per-session control connection receive buffer */
+#ifndef FTPVITA_RECV_BUFFER_SIZE
+#  define FTPVITA_RECV_BUFFER_SIZE 512
+#endif
+
+/* Default transfer buffer size, see ftpvita_set_file_buf_size() */
+#ifndef FTPVITA_DEFAULT_FILE_BUF_SIZE
+#  define FTPVITA_DEFAULT_FILE_BUF_SIZE (4 * 1024 * 1024)
+#endif
+
+/* Default network memory pool size, see ftpvita_set_net_pool_size() */
+#ifndef FTPVITA_NET_POOL_SIZE
+#  define FTPVITA_NET_POOL_SIZE (64 * 1024)
+#endif
+
+/* Number of idle transfer buffers kept for reuse */
+#ifndef FTPVITA_BUF_POOL_SLOTS
+#  define FTPVITA_BUF_POOL_SLOTS 4
+#endif
+
+#ifndef FTPVITA_EVENT_QUEUE_SIZE
+#  define FTPVITA_EVENT_QUEUE_SIZE 32
+#endif
+
+#ifndef FTPVITA_ASYNC_WORKERS
+#  define FTPVITA_ASYNC_WORKERS 2
+#endif
+
+#ifndef FTPVITA_ASYNC_QUEUE_SIZE
+#  define FTPVITA_ASYNC_QUEUE_SIZE 16
+#endif
+
+/* Threads hashing the chunks of a file in parallel */
+#ifndef FTPVITA_HASH_WORKERS
+#  define FTPVITA_HASH_WORKERS 2
+#endif
+
+/* Size of the chunks a file is split into for hashing */
+#ifndef FTPVITA_HASH_CHUNK_SIZE
+#  define FTPVITA_HASH_CHUNK_SIZE (512 * 1024)
+#endif
+
+/* Files whose CRC32 is remembered, about 40 bytes each */
+#ifndef FTPVITA_HASH_CACHE_SIZE
+#  define FTPVITA_HASH_CACHE_SIZE 16384
+#endif
+
+/* Threads walking a directory tree */
+#ifndef FTPVITA_WALK_WORKERS
+#  define FTPVITA_WALK_WORKERS 3
+#endif
+
+/* Directories read at once on each device, across all the walks */
+#ifndef FTPVITA_WALK_DEV_CONCURRENCY
+#  define FTPVITA_WALK_DEV_CONCURRENCY 2
+#endif
+
+/* Cache policy of the devices, see ftpvita_set_cache_policy() */
+#ifndef FTPVITA_CACHE_POLICY
+#  define FTPVITA_CACHE_POLICY FTPVITA_CACHE_REVALIDATE
+#endif
+
+/* Number of directories kept in the directory cache */
+#ifndef FTPVITA_DIR_CACHE_SIZE
+#  define FTPVITA_DIR_CACHE_SIZE 128
+#endif
+
+/* Bytes read ahead from the start of each file */
+#ifndef FTPVITA_PREFETCH_SIZE
+#  define FTPVITA_PREFETCH_SIZE (256 * 1024)
+#endif
+
+/* Memory used for read-ahead, at most this / FTPVITA_PREFETCH_SIZE files */
+#ifndef FTPVITA_PREFETCH_BUDGET
+#  define FTPVITA_PREFETCH_BUDGET (1024 * 1024)
+#endif
+
+/* Maximum data connections of a MODE E transfer */
+#ifndef FTPVITA_MAX_STREAMS
+#  define FTPVITA_MAX_STREAMS 4
+#endif
+
+/* Time PASV waits for the client to open the parallel connections
+ * of a MODE E transfer, in microseconds */
+#ifndef FTPVITA_MODE_E_ACCEPT_TIMEOUT
+#  define FTPVITA_MODE_E_ACCEPT_TIMEOUT (5 * 1000 * 1000)
+#endif
+
+/* Size of the blocks MODE E transfers are split into */
+#ifndef FTPVITA_MODE_E_BLOCK_SIZE
+#  define FTPVITA_MODE_E_BLOCK_SIZE (256 * 1024)
+#endif
+
+/* Transfer log lines are kept in a buffer this size until written */
+#ifndef FTPVITA_XFERLOG_BUFFER_SIZE
+#  define FTPVITA_XFERLOG_BUFFER_SIZE (16 * 1024)
+#endif
+
+/* Seconds between transfer log writes */
+#ifndef FTPVITA_XFERLOG_FLUSH_INTERVAL
+#  define FTPVITA_XFERLOG_FLUSH_INTERVAL 10
+#endif
+
+/* Thumbnails fit in a square this size, in pixels */
+#ifndef FTPVITA_THUMB_SIZE
+#  define FTPVITA_THUMB_SIZE 160
+#endif
+
+/* Threads decoding images for thumbnails */
+#ifndef FTPVITA_THUMB_WORKERS
+#  define FTPVITA_THUMB_WORKERS 1
+#endif
+
+/* Where the generated thumbnails are kept */
+#ifndef FTPVITA_THUMB_CACHE_DIR
+#  define FTPVITA_THUMB_CACHE_DIR "ux0:data/ftpvita/thumbs"
+#endif
+
+/* Threads checking the files of a manifest */
+#ifndef FTPVITA_VERIFY_WORKERS
+#  define FTPVITA_VERIFY_WORKERS 2
+#endif
+
+/* Largest manifest SITE VERIFY accepts */
+#ifndef FTPVITA_VERIFY_MANIFEST_MAX
+#  define FTPVITA_VERIFY_MANIFEST_MAX (4 * 1024 * 1024)
+#endif
+
+/* Threads inflating the entries of a zip archive */
+#ifndef FTPVITA_EXTRACT_WORKERS
+#  define FTPVITA_EXTRACT_WORKERS 2
+#endif
+
+/* Size of the reads of an archive, two are in flight per worker */
+#ifndef FTPVITA_EXTRACT_READ_SIZE
+#  define FTPVITA_EXTRACT_READ_SIZE (64 * 1024)
+#endif
+
+/* Extracted files are written in pieces this size */
+#ifndef FTPVITA_EXTRACT_WRITE_SIZE
+#  define FTPVITA_EXTRACT_WRITE_SIZE (256 * 1024)
+#endif
+
+#endif
@@ -3,130 +3,331 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <stdarg.h>
 
+#include <psp2/display.h>
 #include <psp2/kernel/threadmgr.h>
-#include <psp2/kernel/error.h>
 
 #include "console.h"
 
-static int top_margin = 10;
-static int cns_x = 0, cns_y = 0;
+/* Any thread can log: messages are pushed into a lock-free ring and a
+ * single render thread draws them on vblank. Producers never touch the
+ * framebuffer nor wait on a lock, if the ring is full the message is
+ * dropped and counted. */
+
+#define LOG_QUEUE_SIZE 64
+#define LOG_ENTRY_SIZE 256
+
+#define LINE_H    20
+#define CHAR_W    16
+#define MARGIN    10
+#define COLS      ((SCREEN_W - MARGIN - CHAR_W) / CHAR_W)
+#define ROWS      ((SCREEN_H - MARGIN) / LINE_H)
+
+/* Lines kept by the render thread, at least a full screen */
+#define SCROLLBACK_LINES 32
+
+enum {
+	LOG_ENTRY_TEXT,
+	LOG_ENTRY_PIN,
+};
+
+typedef struct {
+	int ready;
+	int type;
+	uint32_t color;
+	char text[LOG_ENTRY_SIZE];
+} log_entry_t;
+
+static struct {
+	log_entry_t entries[LOG_QUEUE_SIZE];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int dropped;
+} log_queue;
+
+/* Render thread state */
+typedef struct {
+	char text[COLS + 1];
+	int len;
+	uint32_t color;
+} console_line_t;
+
+static console_line_t lines[SCROLLBACK_LINES];
+/* Copy of the pinned lines, they can leave the scrollback */
+static console_line_t pinned_lines[ROWS];
+
+static unsigned int cur_line = 0;
+static unsigned int view_first = 0;
+static int pinned_rows = 0;
+static unsigned char dirty[ROWS];
+static unsigned int dropped_shown = 0;
+
+/* View drawn instead of the log, see console_set_view() */
+static console_view_cb view_cb = NULL;
+static console_view_cb view_shown = NULL;
+
 static uint32_t cns_color = WHITE;
 static int console_initialzed = 0;
-static SceUID console_mtx;
+static volatile int console_running = 0;
+static SceUID console_thid;
 
-void console_init()
+static void log_enqueue(int type, const char *s)
 {
-	if (console_initialzed) {
-		return;
-	}
+	unsigned int head;
+	log_entry_t *entry;
 
-	console_reset();
+	/* Reserve a slot */
+	head = __atomic_load_n(&log_queue.head, __ATOMIC_RELAXED);
+	do {
+		if (head - __atomic_load_n(&log_queue.tail, __ATOMIC_ACQUIRE) >= LOG_QUEUE_SIZE) {
+			__atomic_fetch_add(&log_queue.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+	} while (!__atomic_compare_exchange_n(&log_queue.head, &head, head + 1,
+		1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
 
-	console_mtx = sceKernelCreateMutex("console_mutex", 0, 0, NULL);
-	if (console_mtx > 0) {
-		DEBUG("Console Mutex UID: 0x%08X\n", console_mtx);
-	}
+	entry = &log_queue.entries[head % LOG_QUEUE_SIZE];
+	entry->type = type;
+	entry->color = __atomic_load_n(&cns_color, __ATOMIC_RELAXED);
+	strncpy(entry->text, s, LOG_ENTRY_SIZE - 1);
+	entry->text[LOG_ENTRY_SIZE - 1] = '\0';
 
-	console_initialzed = 1;
+	/* Publish it */
+	__atomic_store_n(&entry->ready, 1, __ATOMIC_RELEASE);
 }
 
-void console_fini()
+static int line_row(unsigned int line)
 {
-	if (console_initialzed) {
-		sceKernelDeleteMutex(console_mtx);
-	}
+	return pinned_rows + (line - view_first);
 }
 
-void console_reset()
+static void mark_line_dirty(unsigned int line)
 {
-	cns_x = 10;
-	cns_y = top_margin;
+	int row = line_row(line);
+	if (line >= view_first && row < ROWS)
+		dirty[row] = 1;
 }
 
-void console_putc(char c)
+static void new_line()
 {
-	int mtx_err = sceKernelTryLockMutex(console_mtx, 1);
+	int i;
+
+	cur_line++;
+	lines[cur_line % SCROLLBACK_LINES].len = 0;
+	lines[cur_line % SCROLLBACK_LINES].text[0] = '\0';
+
+	/* Scroll when the new line falls off the screen */
+	if (line_row(cur_line) >= ROWS) {
+		view_first = cur_line - (ROWS - pinned_rows) + 1;
+		for (i = pinned_rows; i < ROWS; i++)
+			dirty[i] = 1;
+	} else {
+		mark_line_dirty(cur_line);
+	}
+}
+
+static void line_append(char c, uint32_t color)
+{
+	int i;
 
-	int last_y = cns_y;
 	if (c == '\n') {
-		cns_y += 20;
-		cns_x = 10;
-	} else if (c == '\t') {
-		cns_x += 16*4;
-	} else if (c >= ' ' && c <= 126) {
-		font_draw_char(cns_x, cns_y, cns_color, c);
-		cns_x += 16;
+		new_line();
+		return;
 	}
-	if (cns_x >= (SCREEN_W-16)) {
-		cns_y += 20;
-		cns_x = 10;
+
+	if (c == '\t') {
+		for (i = 0; i < 4; i++)
+			line_append(' ', color);
+		return;
 	}
-	if (cns_y >= (SCREEN_H-16)) {
-		cns_y = top_margin;
+
+	if (c < ' ' || c > 126)
+		return;
+
+	if (lines[cur_line % SCROLLBACK_LINES].len >= COLS)
+		new_line();
+
+	i = cur_line % SCROLLBACK_LINES;
+	if (lines[i].len == 0)
+		lines[i].color = color;
+	lines[i].text[lines[i].len++] = c;
+	lines[i].text[lines[i].len] = '\0';
+	mark_line_dirty(cur_line);
+}
+
+static void redraw_dirty()
+{
+	const console_line_t *l;
+	unsigned int line;
+	int row, y;
+
+	for (row = 0; row < ROWS; row++) {
+		if (!dirty[row])
+			continue;
+		dirty[row] = 0;
+
+		y = MARGIN + row * LINE_H;
+		draw_rectangle(0, y, SCREEN_W, LINE_H, BLACK);
+
+		if (row < pinned_rows) {
+			l = &pinned_lines[row];
+		} else {
+			line = view_first + (row - pinned_rows);
+			if (line > cur_line)
+				continue;
+			l = &lines[line % SCROLLBACK_LINES];
+		}
+		font_draw_string(MARGIN, y, l->color, l->text);
 	}
-	if (cns_y != last_y) {
-		draw_rectangle(0, cns_y, SCREEN_W, 20, BLACK);
-		if ((cns_y+20+16) < SCREEN_H) {
-			draw_rectangle(0, cns_y+20, SCREEN_W, 20, BLACK);
-			if ((cns_y+20+20+16) < SCREEN_H) {
-				draw_rectangle(0, cns_y+40, SCREEN_W, 20, BLACK);
-			}
+}
+
+static void log_drain()
+{
+	log_entry_t *entry;
+	unsigned int dropped;
+	char buf[64];
+	const char *s;
+	unsigned int i;
+
+	while (1) {
+		entry = &log_queue.entries[log_queue.tail % LOG_QUEUE_SIZE];
+		if (!__atomic_load_n(&entry->ready, __ATOMIC_ACQUIRE))
+			break;
+
+		if (entry->type == LOG_ENTRY_PIN) {
+			/* Keep the lines printed so far, scroll below them */
+			if (lines[cur_line % SCROLLBACK_LINES].len > 0)
+				new_line();
+			for (i = 0; pinned_rows < ROWS - 1 && view_first + i < cur_line; i++)
+				pinned_lines[pinned_rows++] = lines[(view_first + i) % SCROLLBACK_LINES];
+			view_first = cur_line;
+		} else {
+			for (s = entry->text; *s; s++)
+				line_append(*s, entry->color);
 		}
+
+		__atomic_store_n(&entry->ready, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&log_queue.tail, log_queue.tail + 1, __ATOMIC_RELEASE);
 	}
 
-	if (mtx_err == SCE_KERNEL_OK) {
-		sceKernelUnlockMutex(console_mtx, 1);
+	dropped = __atomic_load_n(&log_queue.dropped, __ATOMIC_RELAXED);
+	if (dropped != dropped_shown) {
+		snprintf(buf, sizeof(buf), "[%u messages dropped]\n", dropped - dropped_shown);
+		for (s = buf; *s; s++)
+			line_append(*s, RED);
+		dropped_shown = dropped;
 	}
 }
 
-void console_print(const char *s)
+static int console_thread(SceSize args, void *argp)
 {
-	int mtx_err = sceKernelTryLockMutex(console_mtx, 1);
+	console_view_cb cb;
 
-	while (*s) {
-		console_putc(*s);
-		s++;
+	while (console_running) {
+		sceDisplayWaitVblankStart();
+		log_drain();
+
+		cb = __atomic_load_n(&view_cb, __ATOMIC_ACQUIRE);
+		if (cb != view_shown) {
+			clear_screen();
+			memset(dirty, 1, sizeof(dirty));
+			__atomic_store_n(&view_shown, cb, __ATOMIC_RELEASE);
+			if (cb)
+				cb(1);
+		} else if (cb) {
+			cb(0);
+		} else {
+			redraw_dirty();
+		}
 	}
 
-	if (mtx_err == SCE_KERNEL_OK) {
-		sceKernelUnlockMutex(console_mtx, 1);
+	/* Show whatever was logged right before exiting */
+	log_drain();
+	if (view_shown) {
+		clear_screen();
+		memset(dirty, 1, sizeof(dirty));
 	}
+	redraw_dirty();
+
+	sceKernelExitDeleteThread(0);
+	return 0;
 }
 
-void console_printf(const char *s, ...)
+void console_init()
+{
+	if (console_initialzed) {
+		return;
+	}
+
+	console_reset();
+
+	console_running = 1;
+	console_thid = sceKernelCreateThread("console_thread", console_thread,
+		0x10000100, 0x4000, 0, 0, NULL);
+	sceKernelStartThread(console_thid, 0, NULL);
+
+	DEBUG("Console thread UID: 0x%08X\n", console_thid);
+
+	console_initialzed = 1;
+}
+
+void console_fini()
+{
+	if (console_initialzed) {
+		console_running = 0;
+		sceKernelWaitThreadEnd(console_thid, NULL, NULL);
+		console_initialzed = 0;
+	}
+}
+
+void console_reset()
+{
+	cur_line = 0;
+	view_first = 0;
+	pinned_rows = 0;
+	lines[0].len = 0;
+	lines[0].text[0] = '\0';
+	memset(dirty, 1, sizeof(dirty));
+}
+
+void console_putc(char c)
+{
+	char s[2] = {c, '\0'};
+	log_enqueue(LOG_ENTRY_TEXT, s);
+}
+
+void console_print(const char *s)
 {
-	unsigned int mtx_timeout = 0xFFFFFFFF;
-	sceKernelLockMutex(console_mtx, 1, &mtx_timeout);
+	log_enqueue(LOG_ENTRY_TEXT, s);
+}
 
-	char buf[256];
+void console_printf(const char *s, ...)
+{
+	char buf[LOG_ENTRY_SIZE];
 	va_list argptr;
 	va_start(argptr, s);
 	vsnprintf(buf, sizeof(buf), s, argptr);
 	va_end(argptr);
-	console_print(buf);
-
-	sceKernelUnlockMutex(console_mtx, 1);
+	log_enqueue(LOG_ENTRY_TEXT, buf);
 }
 
 void console_set_color(uint32_t color)
 {
-	cns_color = color;
+	__atomic_store_n(&cns_color, color, __ATOMIC_RELAXED);
 }
 
-int console_get_y()
+void console_pin()
 {
-	return cns_y;
+	log_enqueue(LOG_ENTRY_PIN, "");
 }
 
-void console_set_y(int new_y)
+void console_set_view(console_view_cb cb)
 {
-	cns_y = new_y;
-	draw_rectangle(0, cns_y, SCREEN_W, 20, BLACK);
-}
+	__atomic_store_n(&view_cb, cb, __ATOMIC_RELEASE);
 
-void console_set_top_margin(int new_top_margin)
-{
-	top_margin = new_top_margin;
+	/* Once switched, the render thread is done with the old view */
+	while (console_running && __atomic_load_n(&view_shown, __ATOMIC_ACQUIRE) != cb)
+		sceDisplayWaitVblankStart();
 }
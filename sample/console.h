@@ -15,9 +15,15 @@ void console_putc(char c);
 void console_print(const char *s);
 void console_printf(const char *s, ...);
 void console_set_color(uint32_t color);
-int console_get_y();
-void console_set_y(int new_y);
-void console_set_top_margin(int new_top_margin);
+/* Keep the lines printed so far on screen, scroll below them */
+void console_pin();
+
+/* Called by the render thread on every vblank instead of drawing the
+ * log, redraw is set when the whole screen has to be drawn again.
+ * Logging goes on meanwhile; NULL goes back to the log. Returns once
+ * the render thread has switched views */
+typedef void (*console_view_cb)(int redraw);
+void console_set_view(console_view_cb cb);
 
 #define INFO(...) console_printf(__VA_ARGS__)
 
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2015 Sergi Granell (xerpi)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include <psp2/kernel/processmgr.h>
+
+#include <ftpvita.h>
+
+#include "console.h"
+#include "dashboard.h"
+
+/* Drawn by the console render thread once per vblank. The text rows are
+ * only redrawn when they change, the rates are computed over
+ * SAMPLE_FRAMES frames so they don't jump around. */
+
+#define LINE_H        20
+#define MARGIN        10
+#define ROW_Y(row)    (MARGIN + (row) * LINE_H)
+#define TEXT_ROWS     18
+#define TEXT_COLS     58
+
+#define SAMPLE_FRAMES 30
+#define MAX_SHOWN_DEVICES  4
+#define MAX_SHOWN_SESSIONS 6
+
+/* Storage busy for more than this (percent) is reported as the bottleneck */
+#define BUSY_THRESHOLD 80
+
+#define GRAPH_SAMPLES 64
+#define GRAPH_X       MARGIN
+#define GRAPH_Y       ROW_Y(TEXT_ROWS + 1)
+#define GRAPH_W       (SCREEN_W - 2 * MARGIN)
+#define GRAPH_H       (SCREEN_H - MARGIN - GRAPH_Y)
+#define GRAPH_BAR_W   (GRAPH_W / GRAPH_SAMPLES)
+
+static ftpvita_stats_t stats;
+static ftpvita_session_info_t sessions[FTPVITA_MAX_SESSIONS];
+static ftpvita_device_stats_t devices[FTPVITA_MAX_DEVICES];
+static int n_sessions;
+static int n_devices;
+
+/* Previous sample, to compute the rates */
+static struct {
+	SceUInt64 time;
+	unsigned long long sent;
+	unsigned long long received;
+	ftpvita_device_stats_t devices[FTPVITA_MAX_DEVICES];
+	int n_devices;
+	struct {
+		int num;
+		unsigned long long bytes;
+	} sessions[FTPVITA_MAX_SESSIONS];
+	int n_sessions;
+} prev;
+
+/* Rates of the last sample, in bytes per second */
+static unsigned int rate_sent;
+static unsigned int rate_received;
+static unsigned int dev_rate_read[FTPVITA_MAX_DEVICES];
+static unsigned int dev_rate_written[FTPVITA_MAX_DEVICES];
+static unsigned int dev_busy[FTPVITA_MAX_DEVICES];
+static unsigned int session_rate[FTPVITA_MAX_SESSIONS];
+
+static unsigned int graph[GRAPH_SAMPLES];
+static unsigned int graph_pos = 0;
+static int frames = 0;
+
+/* Text currently on screen, to only redraw what changed */
+static char shown[TEXT_ROWS][TEXT_COLS + 1];
+static uint32_t shown_color[TEXT_ROWS];
+
+static unsigned int rate(unsigned long long now, unsigned long long before,
+			 SceUInt64 us)
+{
+	if (us == 0 || now < before)
+		return 0;
+	return (now - before) * 1000000ULL / us;
+}
+
+static void format_rate(char *out, int n, unsigned int bps)
+{
+	if (bps >= 1024 * 1024)
+		snprintf(out, n, "%5.1f MB/s", bps / (1024.0f * 1024.0f));
+	else
+		snprintf(out, n, "%5.1f KB/s", bps / 1024.0f);
+}
+
+static unsigned long long prev_session_bytes(int num, unsigned long long now)
+{
+	int i;
+
+	for (i = 0; i < prev.n_sessions; i++) {
+		if (prev.sessions[i].num == num)
+			return prev.sessions[i].bytes;
+	}
+	/* New session, no rate until the next sample */
+	return now;
+}
+
+static void sample()
+{
+	SceUInt64 now = sceKernelGetProcessTimeWide();
+	SceUInt64 us = now - prev.time;
+	unsigned long long bytes;
+	int i, j;
+
+	/* No rates until there is a previous sample */
+	if (prev.time != 0) {
+		rate_sent = rate(stats.bytes_sent, prev.sent, us);
+		rate_received = rate(stats.bytes_received, prev.received, us);
+	}
+
+	for (i = 0; i < n_devices; i++) {
+		dev_rate_read[i] = 0;
+		dev_rate_written[i] = 0;
+		dev_busy[i] = 0;
+		for (j = 0; j < prev.n_devices; j++) {
+			if (strcmp(devices[i].name, prev.devices[j].name) != 0)
+				continue;
+			dev_rate_read[i] = rate(devices[i].bytes_read,
+				prev.devices[j].bytes_read, us);
+			dev_rate_written[i] = rate(devices[i].bytes_written,
+				prev.devices[j].bytes_written, us);
+			dev_busy[i] = rate(devices[i].io_time_us,
+				prev.devices[j].io_time_us, us) / 10000;
+			break;
+		}
+	}
+
+	for (i = 0; i < n_sessions; i++) {
+		bytes = sessions[i].bytes_sent + sessions[i].bytes_received;
+		session_rate[i] = rate(bytes, prev_session_bytes(sessions[i].num, bytes), us);
+	}
+
+	prev.time = now;
+	prev.sent = stats.bytes_sent;
+	prev.received = stats.bytes_received;
+	memcpy(prev.devices, devices, n_devices * sizeof(devices[0]));
+	prev.n_devices = n_devices;
+	for (i = 0; i < n_sessions; i++) {
+		prev.sessions[i].num = sessions[i].num;
+		prev.sessions[i].bytes = sessions[i].bytes_sent + sessions[i].bytes_received;
+	}
+	prev.n_sessions = n_sessions;
+
+	graph[graph_pos++ % GRAPH_SAMPLES] = rate_sent + rate_received;
+}
+
+static void draw_graph()
+{
+	unsigned int max = 1;
+	unsigned int i, v, h;
+
+	for (i = 0; i < GRAPH_SAMPLES; i++) {
+		if (graph[i] > max)
+			max = graph[i];
+	}
+
+	draw_rectangle(GRAPH_X, GRAPH_Y, GRAPH_W, GRAPH_H, BLACK);
+	draw_rectangle(GRAPH_X, GRAPH_Y + GRAPH_H - 1, GRAPH_W, 1, WHITE);
+
+	/* Oldest sample on the left */
+	for (i = 0; i < GRAPH_SAMPLES; i++) {
+		v = graph[(graph_pos + i) % GRAPH_SAMPLES];
+		h = (unsigned long long)v * (GRAPH_H - 1) / max;
+		if (h > 0) {
+			draw_rectangle(GRAPH_X + i * GRAPH_BAR_W, GRAPH_Y + GRAPH_H - 1 - h,
+				GRAPH_BAR_W - 1, h, LIME);
+		}
+	}
+}
+
+static void draw_row(int row, uint32_t color, const char *s, ...)
+{
+	char buf[TEXT_COLS + 1];
+	va_list argptr;
+
+	va_start(argptr, s);
+	vsnprintf(buf, sizeof(buf), s, argptr);
+	va_end(argptr);
+
+	if (color == shown_color[row] && strcmp(buf, shown[row]) == 0)
+		return;
+
+	strcpy(shown[row], buf);
+	shown_color[row] = color;
+	draw_rectangle(0, ROW_Y(row), SCREEN_W, LINE_H, BLACK);
+	font_draw_string(MARGIN, ROW_Y(row), color, buf);
+}
+
+/* Returns the busiest device if it's saturated, -1 otherwise */
+static int storage_bottleneck()
+{
+	int i, busiest = -1;
+
+	for (i = 0; i < n_devices; i++) {
+		if (busiest < 0 || dev_busy[i] > dev_busy[busiest])
+			busiest = i;
+	}
+
+	if (busiest >= 0 && dev_busy[busiest] >= BUSY_THRESHOLD)
+		return busiest;
+	return -1;
+}
+
+void dashboard_draw(int redraw)
+{
+	char ip[16], r1[16], r2[16];
+	int i, row = 0;
+
+	ftpvita_get_stats(&stats);
+	n_sessions = ftpvita_get_sessions(sessions, FTPVITA_MAX_SESSIONS);
+	n_devices = ftpvita_get_device_stats(devices, FTPVITA_MAX_DEVICES);
+
+	if (redraw) {
+		memset(shown, 0, sizeof(shown));
+		memset(shown_color, 0, sizeof(shown_color));
+	}
+
+	if (++frames >= SAMPLE_FRAMES) {
+		frames = 0;
+		sample();
+		draw_graph();
+	} else if (redraw) {
+		draw_graph();
+	}
+
+	draw_row(row++, PURP, "FTPVita dashboard      /\\ back to the log");
+
+	format_rate(r1, sizeof(r1), rate_sent);
+	format_rate(r2, sizeof(r2), rate_received);
+	draw_row(row++, WHITE, "Sessions %-3u Out %s  In %s",
+		stats.active_sessions, r1, r2);
+	draw_row(row++, WHITE, "Buffers %u in use %u idle  Net pool %u/%u KB",
+		stats.buffers_in_use, stats.buffers_idle,
+		stats.net_pool_free / 1024, stats.net_pool_size / 1024);
+	if (rate_sent + rate_received == 0)
+		draw_row(row++, WHITE, "Bottleneck: idle");
+	else if ((i = storage_bottleneck()) >= 0)
+		draw_row(row++, RED, "Bottleneck: storage (%s)", devices[i].name);
+	else
+		draw_row(row++, LIME, "Bottleneck: network");
+
+	draw_row(row++, CYAN, "Device   Read        Write       Busy");
+	for (i = 0; i < MAX_SHOWN_DEVICES; i++) {
+		if (i < n_devices) {
+			format_rate(r1, sizeof(r1), dev_rate_read[i]);
+			format_rate(r2, sizeof(r2), dev_rate_written[i]);
+			draw_row(row++, dev_busy[i] >= BUSY_THRESHOLD ? RED : WHITE,
+				"%-8s %s  %s  %3u%%", devices[i].name, r1, r2,
+				dev_busy[i] > 100 ? 100 : dev_busy[i]);
+		} else {
+			draw_row(row++, WHITE, "");
+		}
+	}
+	draw_row(row++, BLACK, "");
+
+	draw_row(row++, CYAN, "#  IP              Cmd  Rate        Path");
+	for (i = 0; i < MAX_SHOWN_SESSIONS; i++) {
+		if (i < n_sessions) {
+			sceNetInetNtop(SCE_NET_AF_INET, &sessions[i].addr, ip, sizeof(ip));
+			format_rate(r1, sizeof(r1), session_rate[i]);
+			draw_row(row++, sessions[i].transferring ? LIME : WHITE,
+				"%-2i %-15s %-4.4s %s  %s", sessions[i].num, ip,
+				sessions[i].cmd, r1, sessions[i].path);
+		} else {
+			draw_row(row++, WHITE, "");
+		}
+	}
+	if (n_sessions > MAX_SHOWN_SESSIONS)
+		draw_row(row++, WHITE, "   ... %i more", n_sessions - MAX_SHOWN_SESSIONS);
+	else
+		draw_row(row++, WHITE, "");
+}
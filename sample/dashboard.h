@@ -0,0 +1,12 @@
+/*
+ * Copyright (c) 2015 Sergi Granell (xerpi)
+ */
+
+#ifndef DASHBOARD_H
+#define DASHBOARD_H
+
+/* Sessions, throughput and I/O statistics screen, to be used as a
+ * console view (see console_set_view()) */
+void dashboard_draw(int redraw);
+
+#endif
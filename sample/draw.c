@@ -8,9 +8,15 @@
 #include <psp2/display.h>
 #include <psp2/gxm.h>
 #include <psp2/kernel/sysmem.h>
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 #include "draw.h"
 #include "utils.h"
 
+/* Printable ASCII characters, starting at ' ' */
+#define FONT_GLYPHS 95
+
 extern const unsigned char msx_font[];
 
 static SceDisplayFrameBuf fb;
@@ -80,6 +86,8 @@ void init_video()
 
 	sceDisplaySetFrameBuf(&fb, SCE_DISPLAY_SETBUF_NEXTFRAME);
 
+	font_init();
+
 	printf(
 		"\nframebuffer 0:\n"
 		"\tsize:           0x%08X\n"
@@ -112,30 +120,103 @@ void draw_pixel(uint32_t x, uint32_t y, uint32_t color)
 
 void draw_rectangle(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color)
 {
+	uint32_t *first = (uint32_t *)fb.base + x + y*fb.pitch;
+	uint32_t *row;
 	int i, j;
-	for (i = 0; i < h; i++) {
-		for (j = 0; j < w; j++) {
-			((uint32_t *)fb.base)[(x + j) + (y + i)*fb.pitch] = color;
-		}
+
+	if (w == 0 || h == 0)
+		return;
+
+	/* Fill the first row with wide stores, then copy it down */
+	j = 0;
+#ifdef __ARM_NEON
+	uint32x4_t vcolor = vdupq_n_u32(color);
+	for (; j + 4 <= w; j += 4)
+		vst1q_u32(first + j, vcolor);
+#endif
+	for (; j < w; j++)
+		first[j] = color;
+
+	row = first;
+	for (i = 1; i < h; i++) {
+		row += fb.pitch;
+		memcpy(row, first, w * sizeof(uint32_t));
 	}
 }
 
-void font_draw_char(int x, int y, uint32_t color, char c)
+/* Glyphs pre-expanded to 16x16: each 8 pixel font row becomes a 16 bit
+ * row with every pixel doubled, and is drawn twice vertically */
+static uint16_t font_glyphs[FONT_GLYPHS][8];
+
+/* Pixel selection masks for each 4 pixel group of a row */
+static const uint32_t nibble_masks[16][4] __attribute__((aligned(16))) = {
+#define M(b) ((b) ? 0xFFFFFFFF : 0)
+#define N(n) {M((n) & 8), M((n) & 4), M((n) & 2), M((n) & 1)}
+	N(0), N(1), N(2), N(3), N(4), N(5), N(6), N(7),
+	N(8), N(9), N(10), N(11), N(12), N(13), N(14), N(15)
+#undef N
+#undef M
+};
+
+void font_init()
 {
-	unsigned char *font = (unsigned char *)(msx_font + (c - (uint32_t)' ') * 8);
-	int i, j, pos_x, pos_y;
-	for (i = 0; i < 8; ++i) {
-		pos_y = y + i*2;
-		for (j = 0; j < 8; ++j) {
-			pos_x = x + j*2;
-			if ((*font & (128 >> j))) {
-				draw_pixel(pos_x + 0, pos_y + 0, color);
-				draw_pixel(pos_x + 1, pos_y + 0, color);
-				draw_pixel(pos_x + 0, pos_y + 1, color);
-				draw_pixel(pos_x + 1, pos_y + 1, color);
+	int c, i, j;
+	uint16_t row;
+
+	for (c = 0; c < FONT_GLYPHS; c++) {
+		for (i = 0; i < 8; i++) {
+			row = 0;
+			for (j = 0; j < 8; j++) {
+				if (msx_font[c*8 + i] & (128 >> j))
+					row |= 3 << (14 - j*2);
 			}
+			font_glyphs[c][i] = row;
 		}
-		++font;
+	}
+}
+
+static inline void font_draw_row(uint32_t *dst, uint32_t color, uint16_t row)
+{
+	int k, nib;
+
+	for (k = 0; k < 4; k++, dst += 4) {
+		nib = (row >> (12 - k*4)) & 0xF;
+		if (nib == 0)
+			continue;
+		if (nib == 0xF) {
+			dst[0] = dst[1] = dst[2] = dst[3] = color;
+			continue;
+		}
+#ifdef __ARM_NEON
+		vst1q_u32(dst, vbslq_u32(vld1q_u32(nibble_masks[nib]),
+			vdupq_n_u32(color), vld1q_u32(dst)));
+#else
+		const uint32_t *m = nibble_masks[nib];
+		dst[0] = (color & m[0]) | (dst[0] & ~m[0]);
+		dst[1] = (color & m[1]) | (dst[1] & ~m[1]);
+		dst[2] = (color & m[2]) | (dst[2] & ~m[2]);
+		dst[3] = (color & m[3]) | (dst[3] & ~m[3]);
+#endif
+	}
+}
+
+void font_draw_char(int x, int y, uint32_t color, char c)
+{
+	const uint16_t *glyph;
+	uint32_t *dst;
+	int i;
+
+	if ((unsigned char)c < ' ' || (unsigned char)c - ' ' >= FONT_GLYPHS)
+		return;
+
+	glyph = font_glyphs[c - ' '];
+	dst = (uint32_t *)fb.base + x + y*fb.pitch;
+
+	for (i = 0; i < 8; i++, dst += fb.pitch*2) {
+		if (glyph[i] == 0)
+			continue;
+		font_draw_row(dst, color, glyph[i]);
+		font_draw_row(dst + fb.pitch, color, glyph[i]);
 	}
 }
 
@@ -28,6 +28,7 @@ void clear_screen();
 void draw_pixel(uint32_t x, uint32_t y, uint32_t color);
 void draw_rectangle(uint32_t x, uint32_t y, uint32_t w, uint32_t h, uint32_t color);
 
+void font_init();
 void font_draw_char(int x, int y, uint32_t color, char c);
 void font_draw_string(int x, int y, uint32_t color, const char *string);
 void font_draw_stringf(int x, int y, uint32_t color, const char *s, ...);
@@ -14,6 +14,9 @@
 
 #include "utils.h"
 #include "console.h"
+#include "dashboard.h"
+
+#define NET_POOL_SIZE (512 * 1024)
 
 static void info_log(const char *s)
 {
@@ -27,11 +30,32 @@ static void debug_log(const char *s)
 }
 #endif
 
+static void state_changed(ftpvita_state_t state, const char *vita_ip,
+			  unsigned short vita_port, void *arg)
+{
+	switch (state) {
+	case FTPVITA_STATE_WAITING_NETWORK:
+		INFO("Waiting for Wi-Fi...\n");
+		break;
+	case FTPVITA_STATE_LISTENING:
+		console_set_color(LIME);
+		INFO("PSVita listening on IP %s Port %i\n", vita_ip, vita_port);
+		console_set_color(WHITE);
+		console_pin();
+		break;
+	case FTPVITA_STATE_ERROR:
+		INFO("Could not initialize the network.\n");
+		break;
+	default:
+		break;
+	}
+}
+
 int main()
 {
 	int run = 1;
-	char vita_ip[16];
-	unsigned short int vita_port;
+	int dashboard = 0;
+	unsigned int old_buttons = 0;
 	SceCtrlData pad;
 	SceAppUtilInitParam init_param;
 	SceAppUtilBootParam boot_param;
@@ -45,7 +69,7 @@ int main()
 	console_set_color(PURP);
 	INFO("FTPVita by xerpi\n");
 	console_set_color(CYAN);
-	INFO("Press [] to exit\n");
+	INFO("Press [] to exit, /\\ for the dashboard\n");
 	console_set_color(WHITE);
 
 	sceSysmoduleLoadModule(SCE_SYSMODULE_NET);
@@ -59,22 +83,18 @@ int main()
 	ftpvita_set_debug_log_cb(debug_log);
 #endif
 
-	int y = console_get_y();
-	while (ftpvita_init(vita_ip, &vita_port) < 0 && run) {
-		INFO("You have to enable Wi-Fi.\nPress X to continue.\n");
+	ftpvita_set_net_pool_size(NET_POOL_SIZE);
+
+	if (ftpvita_init_async(state_changed, NULL) < 0) {
 		while (run) {
 			sceCtrlPeekBufferPositive(0, &pad, 1);
-			if (pad.buttons & SCE_CTRL_CROSS) break;
-			else if (pad.buttons & SCE_CTRL_SQUARE) run = 0;
+			if (pad.buttons & SCE_CTRL_SQUARE) run = 0;
 			sceDisplayWaitVblankStart();
 		}
-		if (!run) {
-			INFO("Exiting...\n");
-			console_fini();
-			end_video();
-			return 0;
-		}
-		console_set_y(y);
+		INFO("Exiting...\n");
+		console_fini();
+		end_video();
+		return 0;
 	}
 
 	ftpvita_add_device("app0:");
@@ -86,18 +106,19 @@ int main()
 	if (sceAppUtilPhotoMount() == 0)
 		ftpvita_add_device("photo0:");
 
-	console_set_color(LIME);
-	INFO("PSVita listening on IP %s Port %i\n", vita_ip, vita_port);
-	console_set_color(WHITE);
-
-	console_set_top_margin(10 + 20*3);
-
 	while (run) {
 		sceCtrlPeekBufferPositive(0, &pad, 1);
 		if (pad.buttons & SCE_CTRL_SQUARE) run = 0;
+		if (pad.buttons & ~old_buttons & SCE_CTRL_TRIANGLE) {
+			dashboard = !dashboard;
+			console_set_view(dashboard ? dashboard_draw : NULL);
+		}
+		old_buttons = pad.buttons;
 		sceDisplayWaitVblankStart();
 	}
 
+	/* The dashboard reads the sessions, let it finish drawing first */
+	console_set_view(NULL);
 	INFO("Exiting...\n");
 	ftpvita_fini();
 